@@ -21,6 +21,9 @@ import androidx.core.view.WindowInsetsControllerCompat;
 
 import com.rovand.wiredmon.ConnectedActivity;
 
+import java.io.BufferedInputStream;
+import java.io.DataInputStream;
+import java.io.EOFException;
 import java.io.FileInputStream;
 import java.io.FileOutputStream;
 import java.io.IOException;
@@ -28,8 +31,11 @@ import java.net.InetAddress;
 import java.net.Socket;
 import java.nio.ByteBuffer;
 import java.util.Arrays;
+import java.util.Map;
+import java.util.concurrent.ConcurrentHashMap;
 import java.util.concurrent.ArrayBlockingQueue;
 import java.util.concurrent.BlockingQueue;
+import java.util.concurrent.atomic.AtomicInteger;
 
 
 public class ShareScreenActivity extends ConnectedActivity {
@@ -37,6 +43,22 @@ public class ShareScreenActivity extends ConnectedActivity {
 
     private PlayerThread mPlayer = null;
 
+    // packet header sent by the servers, see wire_header.hpp
+    private static final int WIRE_VERSION = 1;
+    private static final int WIRE_HEADER_SIZE = 20;
+    private static final int WIRE_STREAM_VIDEO = 0;
+    private static final int WIRE_STREAM_CONTROL = 2;
+    private static final int WIRE_FLAG_KEYFRAME = 1;
+    private static final int WIRE_FLAG_CONFIG = 1 << 1;
+
+    // control messages we send back
+    private static final int CONTROL_MESSAGE_SIZE = 16;
+    private static final int CONTROL_KEYFRAME_REQUEST = 1;
+    private static final int CONTROL_REPORT = 2;
+    private static final int CONTROL_ACK = 3;
+    private static final int CONTROL_PING = 4;
+    private static final int CONTROL_PONG = 5;
+
 
     @Override
     protected void onCreate(@Nullable Bundle savedInstanceState) {
@@ -149,6 +171,12 @@ public class ShareScreenActivity extends ConnectedActivity {
 
         private String mode;
 
+        // back-channel state, shared with the decoder callbacks
+        private final AtomicInteger decodeQueue = new AtomicInteger();
+        private final Map<Long, Long> seqByPts = new ConcurrentHashMap<>();
+        private volatile boolean keyframeAsked = false;
+        private long rttUs = 0;
+
         public PlayerThread(Surface surface, String mode) {
             this.surface = surface; this.mode = mode;
         }
@@ -204,6 +232,30 @@ public class ShareScreenActivity extends ConnectedActivity {
             Log.d("GIAMMI", "stopped");
         }
 
+        void sendControl(int type, int depth, long seq, long time) {
+            ByteBuffer msg = ByteBuffer.allocate(CONTROL_MESSAGE_SIZE);
+            msg.put((byte) WIRE_VERSION);
+            msg.put((byte) type);
+            msg.putShort((short) Math.min(depth, 0xffff));
+            msg.putInt((int) seq);
+            msg.putLong(time);
+            try {
+                synchronized (this) {
+                    outputStream.write(msg.array());
+                }
+            } catch (IOException e) {
+                logExc(e);
+            }
+        }
+
+        // Once per decoder error until a keyframe shows up
+        void requestKeyframe() {
+            if (keyframeAsked)
+                return;
+            keyframeAsked = true;
+            sendControl(CONTROL_KEYFRAME_REQUEST, 0, 0, 0);
+        }
+
         boolean usbInitConnection() {
             UsbManager usbManager = (UsbManager) getSystemService(Context.USB_SERVICE);
             if (usbManager.getAccessoryList().length == 0) {
@@ -384,8 +436,6 @@ public class ShareScreenActivity extends ConnectedActivity {
                 inputStream =  socket.getInputStream();
                 outputStream = socket.getOutputStream();
 
-                int frameRate = 60;
-
                 MediaFormat format = MediaFormat.createVideoFormat(mode, 1920, 1080);
 
                 decoder = MediaCodec.createDecoderByType(mode);
@@ -414,6 +464,10 @@ public class ShareScreenActivity extends ConnectedActivity {
                                     break;
                                 default:
                                     decoder.releaseOutputBuffer(indexOut, true);
+                                    decodeQueue.decrementAndGet();
+                                    Long seq = seqByPts.remove(info.presentationTimeUs);
+                                    if (seq != null)
+                                        sendControl(CONTROL_ACK, 0, seq, info.presentationTimeUs);
                                     break;
                             }
                         } catch (Exception e) {
@@ -423,7 +477,8 @@ public class ShareScreenActivity extends ConnectedActivity {
 
                     @Override
                     public void onError(@NonNull MediaCodec mediaCodec, @NonNull MediaCodec.CodecException e) {
-
+                        logExc(e);
+                        requestKeyframe();
                     }
 
                     @Override
@@ -435,132 +490,102 @@ public class ShareScreenActivity extends ConnectedActivity {
                 decoder.configure(format, surface, null, 0);
                 decoder.start();
 
-                int frameCounter = 0;
-
                 final int maxBuffSize = 1920 * 1080;
-                byte[] buff = new byte[maxBuffSize];
-                byte[] toSend = null;
-                int d = 0;
-                int tosendOffset = 0;
-                int remainingSize = 0;
-                int fps= 0;
+                DataInputStream in = new DataInputStream(new BufferedInputStream(inputStream, maxBuffSize));
+                byte[] header = new byte[WIRE_HEADER_SIZE];
+                long lastSeq = -1;
+                int lost = 0;
+                int fps = 0;
 
                 long begin = System.currentTimeMillis();
 
-                while ((d = inputStream.read(buff)) >= 0) {
-
-                    boolean searchMore;
-
-                    do {
+                while (true) {
+                    try {
+                        in.readFully(header);
+                    } catch (EOFException e) {
+                        break;
+                    }
 
-                        searchMore = false;
+                    // see wire_header.hpp on the server side
+                    if (header[0] != WIRE_VERSION) {
+                        Log.d(TAG, "Unsupported protocol version " + header[0]);
+                        break;
+                    }
+                    ByteBuffer wire = ByteBuffer.wrap(header);
+                    int stream = wire.get(1) & 0xff;
+                    int flags = wire.getShort(2) & 0xffff;
+                    int size = wire.getInt(4);
+                    long seq = wire.getInt(8) & 0xffffffffL;
+                    long pts = wire.getLong(12);
+
+                    if (size < 0 || size > maxBuffSize) {
+                        Log.d(TAG, "Invalid size " + size);
+                        break;
+                    }
+                    byte[] toSend = new byte[size];
+                    in.readFully(toSend);
+
+                    if (stream == WIRE_STREAM_CONTROL && size == CONTROL_MESSAGE_SIZE) {
+                        ByteBuffer msg = ByteBuffer.wrap(toSend);
+                        if (msg.get(1) == CONTROL_PONG)
+                            rttUs = System.nanoTime() / 1000 - msg.getLong(8);
+                        continue;
+                    }
+                    if (stream != WIRE_STREAM_VIDEO || size == 0)
+                        continue;
+
+                    int codecFlags = 0;
+                    if ((flags & WIRE_FLAG_CONFIG) != 0) {
+                        codecFlags |= MediaCodec.BUFFER_FLAG_CODEC_CONFIG;
+                    } else {
+                        // the server drops packets when we can't keep up
+                        if (lastSeq != -1 && seq != ((lastSeq + 1) & 0xffffffffL))
+                            lost += (int) ((seq - lastSeq - 1) & 0xffffffffL);
+                        lastSeq = seq;
+                    }
+                    if ((flags & WIRE_FLAG_KEYFRAME) != 0) {
+                        codecFlags |= MediaCodec.BUFFER_FLAG_KEY_FRAME;
+                        keyframeAsked = false;
+                    }
 
-                        int toCopyFromBuff = d;
-                        int toCopyStart = 0;
+                    int inputIndex = -1;
+                    try {
+                        inputIndex = freeInputs.take();
+                    } catch (InterruptedException e) {
+                        throw new RuntimeException(e);
+                    }
 
-                        if (remainingSize <= 0) {
-                            byte newbuff[] = new byte[maxBuffSize];
-                            while (buff.length < 4 && inputStream.read(newbuff) >= 0) {
-                                Log.d(TAG, "ERROREEEE " + buff.length);
-                                d += newbuff.length;
+                    if (inputIndex != -1) {
+                        ByteBuffer inputBuf = decoder.getInputBuffer(inputIndex);
+                        inputBuf.clear();
 
-                                // create the resultant array
-                                byte[] c = new byte[buff.length + newbuff.length];
+                        inputBuf.put(toSend);
 
-                                // using the pre-defined function arraycopy
-                                System.arraycopy(buff, 0, c, 0, buff.length);
-                                System.arraycopy(newbuff, 0, c, buff.length, newbuff.length);
-                                buff = c;
-                            }
+                        fps++;
 
-                            toCopyFromBuff = d;
-                            int size = ((buff[0] & 0x7f) << 24) + ((buff[1] & 0xff) << 16) + ((buff[2] & 0xff) << 8) + ((buff[3] & 0xff));
-                            if (size > maxBuffSize) {
-                                Log.d(TAG, "Size troppo grande " + size);
-                                Log.d(TAG, "Arr " + buff[0] + " " + buff[1] + " " + buff[2] + " " + buff[3]);
-                                return;
-                            }
-                            if (size < 0) {
-                                Log.d(TAG, "Negative size " + size);
-                                return;
-                            }
-                            if (size == 0)
-                                continue;
-//                            Log.d(TAG, "Size " + size + " -> " + buff[0] + " " + buff[1] + " " + buff[2] + " " + buff[3]);
-                            toSend = new byte[size];
-                            tosendOffset = 0;
-                            remainingSize = size;
-                            toCopyFromBuff -= 4;
-                            toCopyStart = 4;
+                        if (System.currentTimeMillis() - begin > 1000) {
+                            begin = System.currentTimeMillis();
+//                            Log.d("GIAMMI", "FPS " + fps + " lost " + lost);
+                            sendControl(CONTROL_REPORT, decodeQueue.get(), lost, rttUs);
+                            sendControl(CONTROL_PING, 0, 0, System.nanoTime() / 1000);
+                            fps = 0;
+                            lost = 0;
                         }
 
-                        int toCopy = Math.min(remainingSize, toCopyFromBuff);
-
-                        // copy all from buff to tosend
-                        System.arraycopy(buff, toCopyStart, toSend, tosendOffset, toCopy);
-
-                        remainingSize -= toCopy;
-                        tosendOffset += toCopy;
-                        d = d - (toCopy + toCopyStart);
-
-                        // display the frame
-                        if (remainingSize <= 0) {
-
-                            remainingSize = 0;
-
-                            int inputIndex = -1;
-                            try {
-                                inputIndex = freeInputs.take();
-                            } catch (InterruptedException e) {
-                                throw new RuntimeException(e);
-                            }
-
-                            if (inputIndex != -1) {
-                                ByteBuffer inputBuf = decoder.getInputBuffer(inputIndex);
-                                inputBuf.clear();
-
-                                inputBuf.put(toSend);
-
-                                frameCounter++;
-
-                                fps++;
-
-                                if (System.currentTimeMillis() - begin > 1000) {
-                                    begin = System.currentTimeMillis();
-//                                    Log.d("GIAMMI", "FPS " + fps);
-                                    frameRate = fps;
-                                    fps = 0;
-                                }
-
-                                try {
-                                    decoder.queueInputBuffer(inputIndex, 0, toSend.length, 8 * (frameCounter) * (1 / frameRate), 0);
-                                } catch (Exception e) {
-                                    logExc(e);
-                                }
-                            }
-
-                            int abundantSize = (toCopyFromBuff) - (toCopy);
-
-                            if (abundantSize > 0) {
-
-                                byte newBuff[] = new byte[abundantSize];
-                                System.arraycopy(buff, toCopy + toCopyStart, newBuff, 0, abundantSize);
-                                buff = newBuff;
-
-                                searchMore = true;
-                            } else {
-                                break;
+                        try {
+                            decoder.queueInputBuffer(inputIndex, 0, toSend.length, pts, codecFlags);
+                            if ((flags & WIRE_FLAG_CONFIG) == 0) {
+                                decodeQueue.incrementAndGet();
+                                seqByPts.put(pts, seq);
                             }
+                        } catch (Exception e) {
+                            logExc(e);
+                            requestKeyframe();
                         }
-
-                    } while(searchMore);
-
-                    // so that the socket can refill the buffer
-                    buff = new byte[1920*1080];
-
+                    }
                 }
 
-                Log.d("GIAMMI", "Stopping : " + d);
+                Log.d("GIAMMI", "Stopping");
                 decoder.stop();
                 decoder.release();
             } catch (IOException e2) {
@@ -18,6 +18,7 @@ extern "C" {
 
 #include <assert.h>
 #include <libgen.h>
+#include <limits>
 #include <map>
 #include <mutex>
 #include <signal.h>
@@ -183,6 +184,28 @@ struct PacketData {
   AVPacket data;
 };
 
+// With intra refresh the encoder also flags the frames starting a new refresh
+// as keyframes, but clients can only start decoding from an IDR (or a CRA in
+// HEVC). Other codecs go with the flag.
+static bool is_idr_packet(const AVCodecContext *codec_context,
+                          const AVPacket *packet) {
+  bool hevc = codec_context->codec_id == AV_CODEC_ID_HEVC;
+  if (!hevc && codec_context->codec_id != AV_CODEC_ID_H264)
+    return true;
+  bool annexb = false;
+  for (int i = 0; i + 3 < packet->size; i++) {
+    const uint8_t *p = packet->data + i;
+    if (p[0] != 0 || p[1] != 0 || p[2] != 1)
+      continue;
+    annexb = true;
+    uint8_t type = hevc ? (p[3] >> 1) & 0x3f : p[3] & 0x1f;
+    if (hevc ? type >= 16 && type <= 21 : type == 5)
+      return true;
+  }
+  // length prefixed NAL units, go with the flag
+  return !annexb;
+}
+
 // |stream| is only required for non-replay mode
 static void
 receive_frames(AVCodecContext *av_codec_context, int stream_index,
@@ -227,7 +250,19 @@ receive_frames(AVCodecContext *av_codec_context, int stream_index,
         }
       } else {
         // send data -giammi
-        server.send_data(av_packet->data, av_packet->size);
+        uint16_t flags = 0;
+        if ((av_packet->flags & AV_PKT_FLAG_KEY) &&
+            (stream_index != VIDEO_STREAM_INDEX ||
+             is_idr_packet(av_codec_context, av_packet)))
+          flags |= WIRE_FLAG_KEYFRAME;
+        if (av_packet->flags & AV_PKT_FLAG_DISPOSABLE)
+          flags |= WIRE_FLAG_DISPOSABLE;
+        server.send_data(av_packet->data, av_packet->size, flags,
+                         av_rescale_q(pts, av_codec_context->time_base,
+                                      AVRational{1, 1000000}),
+                         stream_index == VIDEO_STREAM_INDEX
+                             ? WIRE_STREAM_VIDEO
+                             : WIRE_STREAM_AUDIO);
 
         av_packet_rescale_ts(av_packet, av_codec_context->time_base,
                              stream->time_base);
@@ -500,7 +535,8 @@ static AVCodecContext *create_video_codec_context(
     AVPixelFormat pix_fmt, VideoQuality video_quality, int fps,
     const AVCodec *codec, bool low_latency, gsr_gpu_vendor vendor,
     FramerateMode framerate_mode, bool hdr, gsr_color_range color_range,
-    float keyint, bool use_software_video_encoder, BitrateMode bitrate_mode) {
+    float keyint, bool use_software_video_encoder, BitrateMode bitrate_mode,
+    bool intra_refresh) {
 
   AVCodecContext *codec_context = avcodec_alloc_context3(codec);
 
@@ -530,6 +566,19 @@ static AVCodecContext *create_video_codec_context(
     // High values reduce file size but increases time it takes to seek
     codec_context->gop_size = fps * keyint;
   }
+  if (intra_refresh) {
+    // keyint is then the period of a column of intra blocks sweeping over the
+    // picture, IDRs are only encoded when a client asks for one
+    if (av_opt_set_int(codec_context->priv_data, "intra-refresh", 1, 0) == 0) {
+      av_opt_set_int(codec_context->priv_data, "forced-idr", 1, 0);
+    } else {
+      fprintf(stderr,
+              "Warning: %s doesn't support intra refresh, keyframes are only "
+              "encoded when a client asks for one\n",
+              codec->name);
+      codec_context->gop_size = std::numeric_limits<int>::max();
+    }
+  }
   codec_context->max_b_frames = 0;
   codec_context->pix_fmt = pix_fmt;
   codec_context->color_range = color_range == GSR_COLOR_RANGE_LIMITED
@@ -1068,7 +1117,8 @@ static void usage_header() {
       "h264|hevc|av1|vp8|vp9|hevc_hdr|av1_hdr|hevc_10bit|av1_10bit] [-ac "
       "aac|opus|flac] [-ab <bitrate>] [-oc yes|no] [-fm cfr|vfr|content] [-bm "
       "auto|qp|vbr] [-cr limited|full] [-df yes|no] [-sc <script_path>] "
-      "[-cursor yes|no] [-keyint <value>] [-restore-portal-session yes|no] "
+      "[-cursor yes|no] [-keyint <value>] [-intra-refresh yes|no] "
+      "[-restore-portal-session yes|no] "
       "[-portal-session-token-filepath filepath] [-encoder gpu|cpu] [-o "
       "<output_file>] [-v yes|no] [--version] [-h|--help]\n",
       program_name);
@@ -1280,6 +1330,16 @@ static void usage_full() {
           "is expected to be a floating point number.\n");
   fprintf(stderr, "        By default this value is set to 2.0.\n");
   fprintf(stderr, "\n");
+  fprintf(stderr, "  -intra-refresh\n");
+  fprintf(stderr, "        Refresh the picture with a column of intra blocks "
+                  "moving over it every -keyint seconds instead of periodic "
+                  "keyframes, which are several times bigger than the other "
+                  "frames. Keyframes are then only encoded when a client "
+                  "joins or asks for one after an error.\n");
+  fprintf(stderr, "        Needs an encoder with intra refresh (nvenc or "
+                  "'-encoder cpu'), others only stop encoding periodic "
+                  "keyframes. Optional, set to 'no' by default.\n");
+  fprintf(stderr, "\n");
   fprintf(stderr, "  -restore-portal-session\n");
   fprintf(stderr, "        If GPU Screen Recorder should use the same capture "
                   "option as the last time. Using this option removes the "
@@ -2955,6 +3015,7 @@ int main(int argc, char **argv) {
       {"-cr", Arg{{}, true, false}},
       {"-cursor", Arg{{}, true, false}},
       {"-keyint", Arg{{}, true, false}},
+      {"-intra-refresh", Arg{{}, true, false}},
       {"-restore-portal-session", Arg{{}, true, false}},
       {"-portal-session-token-filepath", Arg{{}, true, false}},
       {"-encoder", Arg{{}, true, false}},
@@ -3073,6 +3134,23 @@ int main(int argc, char **argv) {
     }
   }
 
+  bool intra_refresh = false;
+  const char *intra_refresh_str = args["-intra-refresh"].value();
+  if (!intra_refresh_str)
+    intra_refresh_str = "no";
+
+  if (strcmp(intra_refresh_str, "yes") == 0) {
+    intra_refresh = true;
+  } else if (strcmp(intra_refresh_str, "no") == 0) {
+    intra_refresh = false;
+  } else {
+    fprintf(stderr,
+            "Error: -intra-refresh should either be 'yes' or 'no', "
+            "got: '%s'\n",
+            intra_refresh_str);
+    usage();
+  }
+
   bool use_software_video_encoder = false;
   const char *encoder_str = args["-encoder"].value();
   if (encoder_str) {
@@ -3605,7 +3683,7 @@ int main(int argc, char **argv) {
       get_pixel_format(egl.gpu_info.vendor, use_software_video_encoder),
       quality, fps, video_codec_f, low_latency_recording, egl.gpu_info.vendor,
       framerate_mode, hdr, color_range, keyint, use_software_video_encoder,
-      bitrate_mode);
+      bitrate_mode, intra_refresh);
   if (replay_buffer_size_secs == -1)
     video_stream = create_stream(av_format_context, video_codec_context);
 
@@ -4203,6 +4281,11 @@ int main(int argc, char **argv) {
               continue;
           }
 
+          // the receiver's decoder lost track, don't make it wait out the
+          // GOP
+          video_frame->pict_type = server.keyframe_requested()
+                                       ? AV_PICTURE_TYPE_I
+                                       : AV_PICTURE_TYPE_NONE;
           int ret = avcodec_send_frame(video_codec_context, video_frame);
           if (ret == 0) {
             // TODO: Move to separate thread because this could write to network
@@ -1,6 +1,8 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "wire_header.hpp"
+#include <cstddef>
 #include <cstdint>
 
 class Server {
@@ -13,16 +15,28 @@ public:
   void restart_server();
   void send_header_server(uint8_t *data, uint32_t size);
 
-  int send_data(uint8_t *data, uint32_t size);
-  int recv_data(uint8_t **data, uint32_t size);
+  // flags are wire_flags, pts is in microseconds
+  int send_data(uint8_t *data, uint32_t size, uint16_t flags = 0,
+                int64_t pts = 0, uint8_t stream = WIRE_STREAM_VIDEO);
 
   int is_connected();
 
+  // Reads what the receiver sent so far without blocking, answers its pings
+  // and returns true if it asked for a keyframe
+  bool keyframe_requested();
+
 private:
+  void send_control(const control_message &msg);
+
   int s_socket = -1; // socket
   int c_socket = -1; // connect socket
 
   const int port = 53516;
+  uint32_t next_seq[WIRE_STREAM_COUNT] = {};
+
+  // partial control message
+  uint8_t rx[CONTROL_MESSAGE_SIZE];
+  size_t rx_size = 0;
 };
 
 #endif
@@ -665,6 +665,10 @@ FrameWriter::FrameWriter(const FrameWriterParams &_params) : params(_params) {
 
 void FrameWriter::encode(AVCodecContext *enc_ctx, AVFrame *frame,
                          AVPacket *pkt) {
+  // the receiver's decoder lost track, don't make it wait out the GOP
+  if (frame && enc_ctx == videoCodecCtx && server.keyframe_requested())
+    frame->pict_type = AV_PICTURE_TYPE_I;
+
   /* send the frame to the encoder */
   int ret = avcodec_send_frame(enc_ctx, frame);
   if (ret < 0) {
@@ -682,7 +686,15 @@ void FrameWriter::encode(AVCodecContext *enc_ctx, AVFrame *frame,
       return;
     }
 
-    server.send_data(pkt->data, pkt->size);
+    uint16_t flags = 0;
+    if (pkt->flags & AV_PKT_FLAG_KEY)
+      flags |= WIRE_FLAG_KEYFRAME;
+    if (pkt->flags & AV_PKT_FLAG_DISPOSABLE)
+      flags |= WIRE_FLAG_DISPOSABLE;
+    server.send_data(pkt->data, pkt->size, flags,
+                     av_rescale_q(pkt->pts, enc_ctx->time_base, US_RATIONAL),
+                     enc_ctx == videoCodecCtx ? WIRE_STREAM_VIDEO
+                                              : WIRE_STREAM_AUDIO);
 
     finish_frame(enc_ctx, *pkt);
   }
@@ -33,12 +33,7 @@ void Server::init_server() {
       memset(&saAddr, 0, sizeof(saAddr));
       socklen_t len = sizeof(saAddr);
       c_socket = accept(s_socket, (struct sockaddr *)&saAddr, &len);
-      // setting timeout
-      struct timeval tv;
-      tv.tv_sec = 1;
-      tv.tv_usec = 0;
-      setsockopt(c_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv,
-                 sizeof tv);
+      rx_size = 0;
 
       if (c_socket >= 0) {
         printf("[SERVER] Connection %d - %d\n", s_socket, c_socket);
@@ -81,19 +76,25 @@ void Server::send_header_server(uint8_t *data, uint32_t size) {
 }
 
 // assuming 32 bit for an int
-int32_t Server::send_data(uint8_t *data, uint32_t size) {
+int32_t Server::send_data(uint8_t *data, uint32_t size, uint16_t flags,
+                          int64_t pts, uint8_t stream) {
   init_server();
   if (c_socket == -1 || data == nullptr || size == 0)
     return -1;
-  if (size <= 3)
+  if (size <= 3 || stream >= WIRE_STREAM_COUNT)
     return -1;
   int32_t m = -1;
-  uint8_t bsize[] = {(uint8_t)((size >> 24) & 0xff),
-                     (uint8_t)((size >> 16) & 0xff),
-                     (uint8_t)((size >> 8) & 0xff), (uint8_t)((size) & 0xff)};
-  if ((m = send(c_socket, bsize, 4 * sizeof(uint8_t), 0)) < 0) {
+  wire_header wire;
+  wire.stream = stream;
+  wire.flags = flags;
+  wire.size = size;
+  wire.seq = next_seq[stream]++;
+  wire.pts = pts;
+  uint8_t header[WIRE_HEADER_SIZE];
+  wire_header_write(wire, header);
+  if ((m = send(c_socket, header, sizeof(header), 0)) < 0) {
     printf("The last error message is: %s\n", strerror(errno));
-    printf("[SERVER] Can't send size from %d -> %d\n", c_socket, m);
+    printf("[SERVER] Can't send header from %d -> %d\n", c_socket, m);
     return -1;
   }
   if ((m = send(c_socket, data, size * sizeof(uint8_t), 0)) < 0) {
@@ -104,14 +105,52 @@ int32_t Server::send_data(uint8_t *data, uint32_t size) {
   return m;
 }
 
-// assuming 32 bit for an int
-int32_t Server::recv_data(uint8_t **data, uint32_t size) {
-  int32_t m = -1;
-  if ((m = recv(c_socket, *data, size, 0)) < 0) {
-    printf("[SERVER] Can't recv data\n");
-    return -1;
+bool Server::keyframe_requested() {
+  if (c_socket == -1)
+    return false;
+  bool keyframe = false;
+  uint8_t buf[256];
+  ssize_t m;
+  while ((m = recv(c_socket, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    for (ssize_t i = 0; i < m; i++) {
+      rx[rx_size++] = buf[i];
+      if (rx_size < CONTROL_MESSAGE_SIZE)
+        continue;
+      rx_size = 0;
+      control_message msg;
+      if (!control_message_read(rx, msg))
+        continue;
+      switch (msg.type) {
+      case CONTROL_KEYFRAME_REQUEST:
+        keyframe = true;
+        break;
+      case CONTROL_PING:
+        msg.type = CONTROL_PONG;
+        send_control(msg);
+        break;
+      case CONTROL_REPORT:
+        printf("[SERVER] Receiver: decoder queue %d, %u lost, rtt %ld us\n",
+               msg.depth, msg.seq, (long)msg.time);
+        break;
+      default:
+        break;
+      }
+    }
   }
-  return m;
+  return keyframe;
+}
+
+void Server::send_control(const control_message &msg) {
+  uint8_t data[CONTROL_MESSAGE_SIZE];
+  control_message_write(msg, data);
+  wire_header wire;
+  wire.stream = WIRE_STREAM_CONTROL;
+  wire.size = sizeof(data);
+  uint8_t header[WIRE_HEADER_SIZE];
+  wire_header_write(wire, header);
+  if (send(c_socket, header, sizeof(header), 0) < 0 ||
+      send(c_socket, data, sizeof(data), 0) < 0)
+    printf("[SERVER] Can't send control message: %s\n", strerror(errno));
 }
 
 int Server::is_connected() { return c_socket != -1; }
@@ -0,0 +1,139 @@
+#ifndef WIRE_HEADER_H
+#define WIRE_HEADER_H
+
+#include <cstdint>
+
+// Every packet on the wire is a header followed by `size` bytes of payload.
+// All the fields are big-endian:
+//
+//   0  version  u8    WIRE_VERSION, receivers drop the connection otherwise
+//   1  stream   u8    wire_stream
+//   2  flags    u16   wire_flags
+//   4  size     u32   payload bytes
+//   8  seq      u32   per stream, gaps mean packets were dropped for us
+//  12  pts      i64   capture time in microseconds since the first frame
+//
+// The same layout is used by wl-screenshare-server, wf-recorder and
+// gpu-screen-recorder, keep the copies in sync.
+#define WIRE_VERSION 1
+#define WIRE_HEADER_SIZE 20
+
+enum wire_stream : uint8_t {
+  WIRE_STREAM_VIDEO = 0,
+  WIRE_STREAM_AUDIO = 1,
+  WIRE_STREAM_CONTROL = 2, // a control_message, doesn't use a seq
+  WIRE_STREAM_COUNT,
+};
+
+enum wire_flags : uint16_t {
+  WIRE_FLAG_KEYFRAME = 1 << 0,
+  WIRE_FLAG_CONFIG = 1 << 1,     // codec extradata, doesn't use a seq
+  WIRE_FLAG_DISPOSABLE = 1 << 2, // no other frame references it
+};
+
+struct wire_header {
+  uint8_t version = WIRE_VERSION;
+  uint8_t stream = WIRE_STREAM_VIDEO;
+  uint16_t flags = 0;
+  uint32_t size = 0;
+  uint32_t seq = 0;
+  int64_t pts = 0;
+};
+
+static inline void wire_header_write(const wire_header &h,
+                                     uint8_t out[WIRE_HEADER_SIZE]) {
+  out[0] = h.version;
+  out[1] = h.stream;
+  out[2] = h.flags >> 8;
+  out[3] = h.flags;
+  for (int i = 0; i < 4; i++) {
+    out[4 + i] = h.size >> (24 - 8 * i);
+    out[8 + i] = h.seq >> (24 - 8 * i);
+  }
+  for (int i = 0; i < 8; i++)
+    out[12 + i] = (uint64_t)h.pts >> (56 - 8 * i);
+}
+
+// Returns false if the header is from another version of the protocol
+static inline bool wire_header_read(const uint8_t in[WIRE_HEADER_SIZE],
+                                    wire_header &h) {
+  h.version = in[0];
+  if (h.version != WIRE_VERSION)
+    return false;
+  h.stream = in[1];
+  h.flags = (in[2] << 8) | in[3];
+  h.size = h.seq = 0;
+  for (int i = 0; i < 4; i++) {
+    h.size = (h.size << 8) | in[4 + i];
+    h.seq = (h.seq << 8) | in[8 + i];
+  }
+  uint64_t pts = 0;
+  for (int i = 0; i < 8; i++)
+    pts = (pts << 8) | in[12 + i];
+  h.pts = (int64_t)pts;
+  return true;
+}
+
+// Receivers talk back on the same connection with fixed size control
+// messages, big-endian too:
+//
+//   0  version  u8    WIRE_VERSION
+//   1  type     u8    control_type
+//   2  depth    u16   REPORT: frames waiting in the decoder
+//                     PACING: share of the frame interval in percent
+//   4  seq      u32   ACK: video seq of the frame, REPORT: frames lost
+//                     PACING: highest rate in kbit/s
+//   8  time     i64   PING/PONG: receiver clock in microseconds, echoed
+//                     ACK: pts of the frame, REPORT: RTT in microseconds
+//
+// The only one answered is PING, with a PONG on WIRE_STREAM_CONTROL.
+#define CONTROL_MESSAGE_SIZE 16
+
+enum control_type : uint8_t {
+  CONTROL_KEYFRAME_REQUEST = 1, // the decoder lost track, send an IDR
+  CONTROL_REPORT = 2,           // about once a second
+  CONTROL_ACK = 3,              // a video frame was decoded
+  CONTROL_PING = 4,
+  CONTROL_PONG = 5,
+  CONTROL_PACING = 6, // 0 in a field keeps the server setting
+};
+
+struct control_message {
+  uint8_t version = WIRE_VERSION;
+  uint8_t type = 0;
+  uint16_t depth = 0;
+  uint32_t seq = 0;
+  int64_t time = 0;
+};
+
+static inline void control_message_write(const control_message &c,
+                                         uint8_t out[CONTROL_MESSAGE_SIZE]) {
+  out[0] = c.version;
+  out[1] = c.type;
+  out[2] = c.depth >> 8;
+  out[3] = c.depth;
+  for (int i = 0; i < 4; i++)
+    out[4 + i] = c.seq >> (24 - 8 * i);
+  for (int i = 0; i < 8; i++)
+    out[8 + i] = (uint64_t)c.time >> (56 - 8 * i);
+}
+
+// Returns false if the message is from another version of the protocol
+static inline bool control_message_read(const uint8_t in[CONTROL_MESSAGE_SIZE],
+                                        control_message &c) {
+  c.version = in[0];
+  if (c.version != WIRE_VERSION)
+    return false;
+  c.type = in[1];
+  c.depth = (in[2] << 8) | in[3];
+  c.seq = 0;
+  for (int i = 0; i < 4; i++)
+    c.seq = (c.seq << 8) | in[4 + i];
+  uint64_t time = 0;
+  for (int i = 0; i < 8; i++)
+    time = (time << 8) | in[8 + i];
+  c.time = (int64_t)time;
+  return true;
+}
+
+#endif
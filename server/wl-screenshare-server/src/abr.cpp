@@ -0,0 +1,34 @@
+#include "abr.hpp"
+#include <algorithm>
+
+// queueing delay above which the link is considered saturated
+#define CONGESTED_MS 30
+// frames waiting in a receiver decoder that doesn't keep up
+#define DECODER_BACKLOG 3
+// loss reported over UDP, out of 256: above ~10% the link is saturated,
+// under ~2% there is room to probe, in between the bitrate holds
+#define CONGESTED_LOSS 26
+#define PROBE_LOSS 5
+
+bitrate_controller::bitrate_controller(int64_t _min_bps, int64_t _max_bps)
+    : min_bps(_min_bps), max_bps(_max_bps), target_bps(_max_bps) {}
+
+int64_t bitrate_controller::update(const transport_feedback &fb) {
+  int64_t measured = fb.throughput * 8;
+  bool congested = fb.queued_ms > CONGESTED_MS ||
+                   fb.queuing_delay_us > CONGESTED_MS * 1000 ||
+                   fb.fraction_lost > CONGESTED_LOSS;
+
+  if (congested) {
+    // go below what the link drained so the backlog can clear
+    target_bps = std::min(target_bps, measured) * 85 / 100;
+  } else if (fb.decode_queue > DECODER_BACKLOG) {
+    // the link is fine, the receiver can't decode that much
+    target_bps = target_bps * 85 / 100;
+  } else if (fb.fraction_lost <= PROBE_LOSS) {
+    target_bps = target_bps * 105 / 100;
+  }
+
+  target_bps = std::clamp(target_bps, min_bps, max_bps);
+  return target_bps;
+}
@@ -0,0 +1,24 @@
+#ifndef ABR_H
+#define ABR_H
+
+#include "src/server.hpp"
+#include <cstdint>
+
+// Adaptive bitrate: steers the encoder toward what the clients can actually
+// receive. It backs off as soon as delay builds up in the queues and probes
+// back up slowly while the link keeps up.
+class bitrate_controller {
+public:
+  bitrate_controller(int64_t min_bps, int64_t max_bps);
+
+  // Returns the new target bitrate in bits per second
+  int64_t update(const transport_feedback &fb);
+
+  int64_t target() const { return target_bps; }
+
+private:
+  int64_t min_bps, max_bps;
+  int64_t target_bps;
+};
+
+#endif
@@ -1,26 +1,162 @@
-#include <mutex>
-#include <queue>
+#ifndef ATOMIC_QUEUE_H
+#define ATOMIC_QUEUE_H
+
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <utility>
+
+#define CACHE_LINE_SIZE 64
+
+enum class overflow_policy {
+  block,       // the producer waits for room
+  drop_oldest, // the oldest element is evicted and handed back
+};
+
+// Bounded lock-free ring between one producer and one consumer thread.
+//
+// Each slot carries a sequence number telling whose turn it is, so the
+// producer can also take the oldest element out when the ring is full
+// (drop_oldest) without racing the consumer. Both sides sleep on a futex
+// when there is nothing to do instead of spinning.
+template <typename T, size_t N> class atomic_queue {
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "N must be a power of two");
 
-template <typename T> class atomic_queue {
 public:
-  void push(const T &value) {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    m_queque.push(value);
+  explicit atomic_queue(overflow_policy _policy = overflow_policy::block)
+      : policy(_policy) {
+    for (size_t i = 0; i < N; i++)
+      slots[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  // Returns false if the ring was full and the oldest element was dropped to
+  // make room, it is then moved to `evicted` (if given) for the caller to
+  // release
+  bool push(T value, T *evicted = nullptr) {
+    bool dropped = false;
+    while (!try_push(value)) {
+      if (policy == overflow_policy::drop_oldest) {
+        T old;
+        if (try_pop(old)) {
+          if (evicted)
+            *evicted = std::move(old);
+          dropped = true;
+        }
+        continue;
+      }
+      wait(pops, -1, [this]() { return !full(); });
+    }
+    notify(pushes);
+    return !dropped;
+  }
+
+  bool try_pop(T &value) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    while (true) {
+      slot &s = slots[pos & (N - 1)];
+      size_t seq = s.seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff < 0)
+        return false; // empty
+      if (diff == 0 &&
+          head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+      if (diff > 0)
+        pos = head.load(std::memory_order_relaxed);
+    }
+
+    slot &s = slots[pos & (N - 1)];
+    value = std::move(s.value);
+    s.value = T();
+    s.seq.store(pos + N, std::memory_order_release);
+    notify(pops);
+    return true;
+  }
+
+  // Waits up to timeout_ms (forever if negative) for an element
+  bool pop(T &value, int timeout_ms) {
+    if (try_pop(value))
+      return true;
+    wait(pushes, timeout_ms, [this]() { return !empty(); });
+    return try_pop(value);
   }
 
-  T pop() {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    T f = m_queque.front();
-    m_queque.pop();
-    return f;
+  bool empty() const {
+    return head.load(std::memory_order_acquire) ==
+           tail.load(std::memory_order_acquire);
   }
 
-  bool empty() {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    return m_queque.empty();
+  size_t size() const {
+    return tail.load(std::memory_order_acquire) -
+           head.load(std::memory_order_acquire);
   }
 
 private:
-  std::queue<T> m_queque;
-  mutable std::mutex m_mutex;
+  struct alignas(CACHE_LINE_SIZE) slot {
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  // futex word bumped on every change, and whether a thread went to sleep
+  // since the last wake up
+  struct alignas(CACHE_LINE_SIZE) event {
+    std::atomic<uint32_t> count{0};
+    std::atomic<bool> sleeping{false};
+  };
+
+  bool try_push(T &value) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    slot &s = slots[pos & (N - 1)];
+    if (s.seq.load(std::memory_order_acquire) != pos)
+      return false; // full
+    s.value = std::move(value);
+    s.seq.store(pos + 1, std::memory_order_release);
+    tail.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool full() const {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    return slots[pos & (N - 1)].seq.load(std::memory_order_acquire) != pos;
+  }
+
+  template <typename Ready>
+  static void wait(event &ev, int timeout_ms, Ready ready) {
+    uint32_t seen = ev.count.load(std::memory_order_seq_cst);
+    ev.sleeping.store(true, std::memory_order_seq_cst);
+    // checked again after announcing ourselves: a notify either happened
+    // before (and we see its effect, or count moved past seen) or will find
+    // us sleeping
+    if (!ready()) {
+      struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000};
+      syscall(SYS_futex, reinterpret_cast<uint32_t *>(&ev.count),
+              FUTEX_WAIT_PRIVATE, seen, timeout_ms < 0 ? nullptr : &ts,
+              nullptr, 0);
+    }
+  }
+
+  // Only the first notify after a thread went to sleep makes the syscall.
+  // Until the woken thread gets to run, the other side would otherwise
+  // wake it again on every element.
+  static void notify(event &ev) {
+    ev.count.fetch_add(1, std::memory_order_seq_cst);
+    if (ev.sleeping.load(std::memory_order_seq_cst) &&
+        ev.sleeping.exchange(false, std::memory_order_seq_cst)) {
+      syscall(SYS_futex, reinterpret_cast<uint32_t *>(&ev.count),
+              FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+  }
+
+  const overflow_policy policy;
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> head{0};
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail{0};
+  event pushes, pops;
+  slot slots[N];
 };
+
+#endif
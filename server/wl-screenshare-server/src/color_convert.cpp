@@ -0,0 +1,381 @@
+#include "color_convert.hpp"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS
+#endif
+
+// BT.601 full range, scaled by 1 << 15. The luma ones add up to 1 << 15 and
+// the chroma ones to 0, so white is 255 and grays have no chroma.
+#define Y_R 9798
+#define Y_G 19235
+#define Y_B 3735
+#define U_R -5529
+#define U_G -10855
+#define U_B 16384
+#define V_R 16384
+#define V_G -13720
+#define V_B -2664
+
+#define Y_SHIFT 15
+#define Y_ROUND (1 << (Y_SHIFT - 1))
+// chroma comes from the sum of 4 pixels, 2 more bits to drop
+#define UV_SHIFT 17
+#define UV_BIAS ((128 << UV_SHIFT) + (1 << (UV_SHIFT - 1)))
+
+static inline uint8_t clamp_u8(int v) {
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline uint8_t luma(const uint8_t *p, const convert_coeffs &c) {
+  return (c.y[0] * p[0] + c.y[1] * p[1] + c.y[2] * p[2] + Y_ROUND) >> Y_SHIFT;
+}
+
+// From x (even) to the end of the rows, an odd last column makes its chroma
+// sample on its own
+static void convert_rows_c(const convert_rows &r, const convert_coeffs &c,
+                           int x) {
+  for (; x < r.width; x += 2) {
+    int x1 = x + 1 < r.width ? x + 1 : x;
+    const uint8_t *p[4] = {r.src0 + 4 * x, r.src0 + 4 * x1, r.src1 + 4 * x,
+                           r.src1 + 4 * x1};
+    r.y0[x] = luma(p[0], c);
+    r.y1[x] = luma(p[2], c);
+    if (x1 != x) {
+      r.y0[x1] = luma(p[1], c);
+      r.y1[x1] = luma(p[3], c);
+    }
+
+    int sum[3];
+    for (int i = 0; i < 3; i++)
+      sum[i] = p[0][i] + p[1][i] + p[2][i] + p[3][i];
+    uint8_t u = clamp_u8(
+        (c.u[0] * sum[0] + c.u[1] * sum[1] + c.u[2] * sum[2] + UV_BIAS) >>
+        UV_SHIFT);
+    uint8_t v = clamp_u8(
+        (c.v[0] * sum[0] + c.v[1] * sum[1] + c.v[2] * sum[2] + UV_BIAS) >>
+        UV_SHIFT);
+    if (r.v) {
+      r.u[x / 2] = u;
+      r.v[x / 2] = v;
+    } else {
+      r.u[x] = u;
+      r.u[x + 1] = v;
+    }
+  }
+}
+
+static void convert_rows_scalar(const convert_rows &r,
+                                const convert_coeffs &c) {
+  convert_rows_c(r, c, 0);
+}
+
+#ifdef HAVE_X86_KERNELS
+// 8 pixels a step. Every 128-bit vector holds 2 pixels widened to 16 bits,
+// pmaddwd and phaddd then give one 32-bit sum per pixel.
+__attribute__((target("sse4.1"))) static __m128i
+luma_sse41(const __m128i px[4], __m128i coeffs) {
+  const __m128i round = _mm_set1_epi32(Y_ROUND);
+  __m128i lo = _mm_hadd_epi32(_mm_madd_epi16(px[0], coeffs),
+                              _mm_madd_epi16(px[1], coeffs));
+  __m128i hi = _mm_hadd_epi32(_mm_madd_epi16(px[2], coeffs),
+                              _mm_madd_epi16(px[3], coeffs));
+  lo = _mm_srai_epi32(_mm_add_epi32(lo, round), Y_SHIFT);
+  hi = _mm_srai_epi32(_mm_add_epi32(hi, round), Y_SHIFT);
+  __m128i y = _mm_packs_epi32(lo, hi);
+  return _mm_packus_epi16(y, y);
+}
+
+__attribute__((target("sse4.1"))) static __m128i
+chroma_sse41(__m128i pair01, __m128i pair23, __m128i coeffs) {
+  __m128i sum = _mm_hadd_epi32(_mm_madd_epi16(pair01, coeffs),
+                               _mm_madd_epi16(pair23, coeffs));
+  return _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(UV_BIAS)),
+                        UV_SHIFT);
+}
+
+__attribute__((target("sse4.1"))) static void
+convert_rows_sse41(const convert_rows &r, const convert_coeffs &c) {
+  const __m128i cy = _mm_set_epi16(0, c.y[2], c.y[1], c.y[0], 0, c.y[2],
+                                   c.y[1], c.y[0]);
+  const __m128i cu = _mm_set_epi16(0, c.u[2], c.u[1], c.u[0], 0, c.u[2],
+                                   c.u[1], c.u[0]);
+  const __m128i cv = _mm_set_epi16(0, c.v[2], c.v[1], c.v[0], 0, c.v[2],
+                                   c.v[1], c.v[0]);
+  const __m128i nv12 =
+      _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15);
+
+  int x = 0;
+  for (; x + 8 <= r.width; x += 8) {
+    __m128i px0[4], px1[4], sum[4];
+    for (int i = 0; i < 2; i++) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(r.src0 + 4 * x) + i);
+      __m128i b = _mm_loadu_si128((const __m128i *)(r.src1 + 4 * x) + i);
+      px0[2 * i] = _mm_cvtepu8_epi16(a);
+      px0[2 * i + 1] = _mm_cvtepu8_epi16(_mm_srli_si128(a, 8));
+      px1[2 * i] = _mm_cvtepu8_epi16(b);
+      px1[2 * i + 1] = _mm_cvtepu8_epi16(_mm_srli_si128(b, 8));
+    }
+    _mm_storel_epi64((__m128i *)(r.y0 + x), luma_sse41(px0, cy));
+    _mm_storel_epi64((__m128i *)(r.y1 + x), luma_sse41(px1, cy));
+
+    // 2x2 blocks: the rows added, then the 2 pixels of every vector
+    for (int i = 0; i < 4; i++)
+      sum[i] = _mm_add_epi16(px0[i], px1[i]);
+    __m128i pair01 = _mm_add_epi16(_mm_unpacklo_epi64(sum[0], sum[1]),
+                                   _mm_unpackhi_epi64(sum[0], sum[1]));
+    __m128i pair23 = _mm_add_epi16(_mm_unpacklo_epi64(sum[2], sum[3]),
+                                   _mm_unpackhi_epi64(sum[2], sum[3]));
+    __m128i uv = _mm_packs_epi32(chroma_sse41(pair01, pair23, cu),
+                                 chroma_sse41(pair01, pair23, cv));
+    uv = _mm_packus_epi16(uv, uv); // u0-u3, v0-v3
+    if (r.v) {
+      uint32_t u = _mm_cvtsi128_si32(uv), v = _mm_extract_epi32(uv, 1);
+      memcpy(r.u + x / 2, &u, 4);
+      memcpy(r.v + x / 2, &v, 4);
+    } else {
+      _mm_storel_epi64((__m128i *)(r.u + x), _mm_shuffle_epi8(uv, nv12));
+    }
+  }
+  convert_rows_c(r, c, x);
+}
+
+// 16 pixels a step. The 256-bit instructions work on each 128-bit lane,
+// lane 0 gets pixels 0-1 of every group of 4 and lane 1 pixels 2-3, the
+// lanes are interleaved back before the stores.
+__attribute__((target("avx2"))) static __m128i
+luma_avx2(const __m256i px[4], __m256i coeffs) {
+  const __m256i round = _mm256_set1_epi32(Y_ROUND);
+  __m256i lo = _mm256_hadd_epi32(_mm256_madd_epi16(px[0], coeffs),
+                                 _mm256_madd_epi16(px[1], coeffs));
+  __m256i hi = _mm256_hadd_epi32(_mm256_madd_epi16(px[2], coeffs),
+                                 _mm256_madd_epi16(px[3], coeffs));
+  lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), Y_SHIFT);
+  hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), Y_SHIFT);
+  // lane 0: 0 1 4 5 8 9 12 13, lane 1: 2 3 6 7 10 11 14 15
+  __m256i y = _mm256_packs_epi32(lo, hi);
+  y = _mm256_packus_epi16(y, y);
+  return _mm_unpacklo_epi16(_mm256_castsi256_si128(y),
+                            _mm256_extracti128_si256(y, 1));
+}
+
+__attribute__((target("avx2"))) static __m256i
+chroma_avx2(__m256i pair01, __m256i pair23, __m256i coeffs) {
+  __m256i sum = _mm256_hadd_epi32(_mm256_madd_epi16(pair01, coeffs),
+                                  _mm256_madd_epi16(pair23, coeffs));
+  return _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(UV_BIAS)),
+                           UV_SHIFT);
+}
+
+__attribute__((target("avx2"))) static void
+convert_rows_avx2(const convert_rows &r, const convert_coeffs &c) {
+  const __m256i cy = _mm256_set_epi16(
+      0, c.y[2], c.y[1], c.y[0], 0, c.y[2], c.y[1], c.y[0], 0, c.y[2], c.y[1],
+      c.y[0], 0, c.y[2], c.y[1], c.y[0]);
+  const __m256i cu = _mm256_set_epi16(
+      0, c.u[2], c.u[1], c.u[0], 0, c.u[2], c.u[1], c.u[0], 0, c.u[2], c.u[1],
+      c.u[0], 0, c.u[2], c.u[1], c.u[0]);
+  const __m256i cv = _mm256_set_epi16(
+      0, c.v[2], c.v[1], c.v[0], 0, c.v[2], c.v[1], c.v[0], 0, c.v[2], c.v[1],
+      c.v[0], 0, c.v[2], c.v[1], c.v[0]);
+
+  int x = 0;
+  for (; x + 16 <= r.width; x += 16) {
+    __m256i px0[4], px1[4], pair[4];
+    for (int i = 0; i < 4; i++) {
+      px0[i] = _mm256_cvtepu8_epi16(
+          _mm_loadu_si128((const __m128i *)(r.src0 + 4 * x) + i));
+      px1[i] = _mm256_cvtepu8_epi16(
+          _mm_loadu_si128((const __m128i *)(r.src1 + 4 * x) + i));
+    }
+    _mm_storeu_si128((__m128i *)(r.y0 + x), luma_avx2(px0, cy));
+    _mm_storeu_si128((__m128i *)(r.y1 + x), luma_avx2(px1, cy));
+
+    // 2x2 block sums in the low 64 bits of every lane
+    for (int i = 0; i < 4; i++) {
+      __m256i sum = _mm256_add_epi16(px0[i], px1[i]);
+      pair[i] = _mm256_add_epi16(
+          sum, _mm256_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    }
+    // lane 0: blocks 0 2 4 6, lane 1: blocks 1 3 5 7
+    __m256i pair01 = _mm256_unpacklo_epi64(pair[0], pair[1]);
+    __m256i pair23 = _mm256_unpacklo_epi64(pair[2], pair[3]);
+    __m256i uv = _mm256_packs_epi32(chroma_avx2(pair01, pair23, cu),
+                                    chroma_avx2(pair01, pair23, cv));
+    uv = _mm256_packus_epi16(uv, uv);
+    // u0-u7, v0-v7
+    __m128i planar = _mm_unpacklo_epi8(_mm256_castsi256_si128(uv),
+                                       _mm256_extracti128_si256(uv, 1));
+    if (r.v) {
+      _mm_storel_epi64((__m128i *)(r.u + x / 2), planar);
+      _mm_storel_epi64((__m128i *)(r.v + x / 2), _mm_srli_si128(planar, 8));
+    } else {
+      _mm_storeu_si128((__m128i *)(r.u + x),
+                       _mm_unpacklo_epi8(planar, _mm_srli_si128(planar, 8)));
+    }
+  }
+  convert_rows_c(r, c, x);
+}
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+static inline uint8x8_t luma_neon(uint8x8_t c0, uint8x8_t c1, uint8x8_t c2,
+                                  const convert_coeffs &c) {
+  uint16x8_t p0 = vmovl_u8(c0), p1 = vmovl_u8(c1), p2 = vmovl_u8(c2);
+  uint32x4_t lo = vmull_n_u16(vget_low_u16(p0), c.y[0]);
+  lo = vmlal_n_u16(lo, vget_low_u16(p1), c.y[1]);
+  lo = vmlal_n_u16(lo, vget_low_u16(p2), c.y[2]);
+  uint32x4_t hi = vmull_n_u16(vget_high_u16(p0), c.y[0]);
+  hi = vmlal_n_u16(hi, vget_high_u16(p1), c.y[1]);
+  hi = vmlal_n_u16(hi, vget_high_u16(p2), c.y[2]);
+  return vqmovn_u16(
+      vcombine_u16(vrshrn_n_u32(lo, Y_SHIFT), vrshrn_n_u32(hi, Y_SHIFT)));
+}
+
+static inline uint8x8_t chroma_neon(const int16x8_t sum[3],
+                                    const int16_t coeffs[4]) {
+  const int32x4_t bias = vdupq_n_s32(UV_BIAS);
+  int32x4_t lo = vmlal_n_s16(bias, vget_low_s16(sum[0]), coeffs[0]);
+  lo = vmlal_n_s16(lo, vget_low_s16(sum[1]), coeffs[1]);
+  lo = vmlal_n_s16(lo, vget_low_s16(sum[2]), coeffs[2]);
+  int32x4_t hi = vmlal_n_s16(bias, vget_high_s16(sum[0]), coeffs[0]);
+  hi = vmlal_n_s16(hi, vget_high_s16(sum[1]), coeffs[1]);
+  hi = vmlal_n_s16(hi, vget_high_s16(sum[2]), coeffs[2]);
+  return vqmovn_u16(vcombine_u16(vqmovun_s32(vshrq_n_s32(lo, UV_SHIFT)),
+                                 vqmovun_s32(vshrq_n_s32(hi, UV_SHIFT))));
+}
+
+// 16 pixels a step, vld4 splits the channels
+static void convert_rows_neon(const convert_rows &r, const convert_coeffs &c) {
+  int x = 0;
+  for (; x + 16 <= r.width; x += 16) {
+    uint8x16x4_t p0 = vld4q_u8(r.src0 + 4 * x);
+    uint8x16x4_t p1 = vld4q_u8(r.src1 + 4 * x);
+    vst1q_u8(r.y0 + x,
+             vcombine_u8(luma_neon(vget_low_u8(p0.val[0]),
+                                   vget_low_u8(p0.val[1]),
+                                   vget_low_u8(p0.val[2]), c),
+                         luma_neon(vget_high_u8(p0.val[0]),
+                                   vget_high_u8(p0.val[1]),
+                                   vget_high_u8(p0.val[2]), c)));
+    vst1q_u8(r.y1 + x,
+             vcombine_u8(luma_neon(vget_low_u8(p1.val[0]),
+                                   vget_low_u8(p1.val[1]),
+                                   vget_low_u8(p1.val[2]), c),
+                         luma_neon(vget_high_u8(p1.val[0]),
+                                   vget_high_u8(p1.val[1]),
+                                   vget_high_u8(p1.val[2]), c)));
+
+    // pairs of pixels added, then the second row
+    int16x8_t sum[3];
+    for (int i = 0; i < 3; i++)
+      sum[i] = vreinterpretq_s16_u16(
+          vpadalq_u8(vpaddlq_u8(p0.val[i]), p1.val[i]));
+    uint8x8x2_t uv = {{chroma_neon(sum, c.u), chroma_neon(sum, c.v)}};
+    if (r.v) {
+      vst1_u8(r.u + x / 2, uv.val[0]);
+      vst1_u8(r.v + x / 2, uv.val[1]);
+    } else {
+      vst2_u8(r.u + x, uv);
+    }
+  }
+  convert_rows_c(r, c, x);
+}
+#endif
+
+convert_simd convert_best_simd() {
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return CONVERT_AVX2;
+  if (__builtin_cpu_supports("sse4.1"))
+    return CONVERT_SSE41;
+#elif defined(HAVE_NEON_KERNELS)
+  return CONVERT_NEON;
+#endif
+  return CONVERT_SCALAR;
+}
+
+const char *convert_simd_name(convert_simd simd) {
+  switch (simd) {
+  case CONVERT_SSE41:
+    return "SSE4.1";
+  case CONVERT_AVX2:
+    return "AVX2";
+  case CONVERT_NEON:
+    return "NEON";
+  default:
+    return "scalar";
+  }
+}
+
+void color_converter::init(convert_input input, convert_output _output,
+                           convert_simd simd) {
+  output = _output;
+  int16_t y[3] = {Y_R, Y_G, Y_B}, u[3] = {U_R, U_G, U_B},
+          v[3] = {V_R, V_G, V_B};
+  // the coefficients follow the channels in memory
+  for (int i = 0; i < 3; i++) {
+    int channel = input == CONVERT_RGBX ? i : 2 - i;
+    coeffs.y[i] = y[channel];
+    coeffs.u[i] = u[channel];
+    coeffs.v[i] = v[channel];
+  }
+  coeffs.y[3] = coeffs.u[3] = coeffs.v[3] = 0;
+
+  level = CONVERT_SCALAR;
+  kernel = convert_rows_scalar;
+#ifdef HAVE_X86_KERNELS
+  if (simd == CONVERT_AVX2) {
+    level = simd;
+    kernel = convert_rows_avx2;
+  } else if (simd == CONVERT_SSE41) {
+    level = simd;
+    kernel = convert_rows_sse41;
+  }
+#elif defined(HAVE_NEON_KERNELS)
+  if (simd == CONVERT_NEON) {
+    level = simd;
+    kernel = convert_rows_neon;
+  }
+#endif
+}
+
+void color_converter::convert_region(const uint8_t *src, int src_stride,
+                                     int x, int y, int width, int height,
+                                     uint8_t *const dst[3],
+                                     const int dst_stride[3]) const {
+  uint8_t *region[3] = {
+      dst[0] + (intptr_t)y * dst_stride[0] + x,
+      dst[1] + (intptr_t)(y / 2) * dst_stride[1] +
+          (output == CONVERT_NV12 ? x : x / 2),
+      output == CONVERT_I420
+          ? dst[2] + (intptr_t)(y / 2) * dst_stride[2] + x / 2
+          : nullptr};
+  convert(src + (intptr_t)y * src_stride + 4 * x, src_stride, width, height,
+          region, dst_stride);
+}
+
+void color_converter::convert(const uint8_t *src, int src_stride, int width,
+                              int height, uint8_t *const dst[3],
+                              const int dst_stride[3]) const {
+  for (int row = 0; row < height; row += 2) {
+    // an odd last row is its own second row
+    int row1 = row + 1 < height ? row + 1 : row;
+    convert_rows r;
+    r.src0 = src + (intptr_t)row * src_stride;
+    r.src1 = src + (intptr_t)row1 * src_stride;
+    r.y0 = dst[0] + (intptr_t)row * dst_stride[0];
+    r.y1 = dst[0] + (intptr_t)row1 * dst_stride[0];
+    r.u = dst[1] + (intptr_t)(row / 2) * dst_stride[1];
+    r.v = output == CONVERT_I420
+              ? dst[2] + (intptr_t)(row / 2) * dst_stride[2]
+              : nullptr;
+    r.width = width;
+    kernel(r, coeffs);
+  }
+}
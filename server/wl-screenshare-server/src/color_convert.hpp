@@ -0,0 +1,72 @@
+#ifndef COLOR_CONVERT_H
+#define COLOR_CONVERT_H
+
+#include <cstdint>
+
+// Packed 8-bit RGB to 4:2:0 YUV for the software encoders, instead of the
+// swscale filter the graph would insert. BT.601 full range, like the
+// swscale setup (src_range=1:dst_range=1) it replaces, with every chroma
+// sample the average of a 2x2 block.
+//
+// The fixed point math is the same in every kernel, the SIMD ones give
+// the exact bytes of the scalar one. The best kernel the CPU supports is
+// picked at runtime.
+enum convert_input {
+  CONVERT_BGRX, // B, G, R, X in memory (XRGB8888, AV_PIX_FMT_BGR0)
+  CONVERT_RGBX, // R, G, B, X in memory (XBGR8888, AV_PIX_FMT_RGB0)
+};
+
+enum convert_output {
+  CONVERT_I420, // Y, U and V planes (yuv420p)
+  CONVERT_NV12, // Y plane and interleaved UV plane
+};
+
+enum convert_simd {
+  CONVERT_SCALAR,
+  CONVERT_SSE41,
+  CONVERT_AVX2,
+  CONVERT_NEON,
+};
+
+// The fastest kernel this CPU runs
+convert_simd convert_best_simd();
+const char *convert_simd_name(convert_simd simd);
+
+// 15-bit fixed point coefficients, in the memory order of the channels
+struct convert_coeffs {
+  int16_t y[4], u[4], v[4];
+};
+
+// Two source rows and the output rows they make. For NV12, u is the UV row
+// and v is null.
+struct convert_rows {
+  const uint8_t *src0, *src1;
+  uint8_t *y0, *y1, *u, *v;
+  int width;
+};
+
+class color_converter {
+
+public:
+  void init(convert_input input, convert_output output,
+            convert_simd simd = convert_best_simd());
+
+  // Strides may be negative, for y-inverted buffers
+  void convert(const uint8_t *src, int src_stride, int width, int height,
+               uint8_t *const dst[3], const int dst_stride[3]) const;
+  // Only a rectangle of the frame, src and dst being the whole frames. With
+  // x and y even it gives the same bytes as a full conversion.
+  void convert_region(const uint8_t *src, int src_stride, int x, int y,
+                      int width, int height, uint8_t *const dst[3],
+                      const int dst_stride[3]) const;
+
+  convert_simd simd() const { return level; }
+
+private:
+  convert_coeffs coeffs;
+  convert_output output = CONVERT_I420;
+  convert_simd level = CONVERT_SCALAR;
+  void (*kernel)(const convert_rows &rows, const convert_coeffs &c) = nullptr;
+};
+
+#endif
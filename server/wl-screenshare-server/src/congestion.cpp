@@ -0,0 +1,100 @@
+#include "congestion.hpp"
+#include <cstddef>
+#include <cstring>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+
+// drain rate samples shorter than this are too noisy
+#define DRAIN_SAMPLE_US 50000
+
+static int64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// <netinet/tcp.h> has an older tcp_info without the delivery rate, this file
+// only uses the kernel headers
+bool read_transport_stats(int fd, transport_stats &stats) {
+  int outq = 0;
+  if (ioctl(fd, SIOCOUTQ, &outq) < 0)
+    return false;
+  stats.outq = outq;
+
+  struct tcp_info info;
+  memset(&info, 0, sizeof(info));
+  socklen_t len = sizeof(info);
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+    return false;
+
+  stats.rtt_us = info.tcpi_rtt;
+  // older kernels fill only part of the struct
+  stats.notsent = len > offsetof(struct tcp_info, tcpi_notsent_bytes)
+                      ? info.tcpi_notsent_bytes
+                      : outq;
+  stats.delivery_rate = len > offsetof(struct tcp_info, tcpi_delivery_rate)
+                            ? info.tcpi_delivery_rate
+                            : 0;
+  if (stats.delivery_rate == 0 && info.tcpi_rtt > 0) {
+    // one congestion window per round trip
+    stats.delivery_rate = (uint64_t)info.tcpi_snd_cwnd * info.tcpi_snd_mss *
+                          1000000 / info.tcpi_rtt;
+  }
+  return true;
+}
+
+// What left the send buffer is what the client consumed: measuring it
+// directly catches a slow reader, which the kernel delivery rate (computed
+// from ACKs) doesn't on a short link
+void congestion_control::sample_drain_rate() {
+  int64_t now = now_us();
+  uint64_t acked = bytes_sent - last.outq;
+  if (sample_us == 0 || acked != sample_acked)
+    progress_us = now;
+
+  if (sample_us == 0) {
+    sample_us = now;
+    sample_acked = acked;
+    return;
+  }
+  if (now - sample_us < DRAIN_SAMPLE_US)
+    return;
+
+  uint64_t rate = (acked - sample_acked) * 1000000 / (now - sample_us);
+  drain_rate = drain_rate == 0 ? rate : (7 * drain_rate + rate) / 8;
+  sample_us = now;
+  sample_acked = acked;
+}
+
+bool congestion_control::over_budget(int fd, size_t user_queued) {
+  if (latency_budget_ms <= 0 && !track)
+    return false;
+  if (!read_transport_stats(fd, last))
+    return false;
+  sample_drain_rate();
+  if (last.rtt_us > 0 && (min_rtt_us == 0 || last.rtt_us < min_rtt_us))
+    min_rtt_us = last.rtt_us;
+
+  size_t queued = user_queued + last.outq;
+  if (queued > max_queued_bytes)
+    max_queued_bytes = queued;
+
+  // With nothing waiting in the kernel we are sending less than the link
+  // could take, the drain rate then only reflects our own bitrate
+  uint64_t rate = drain_rate;
+  if (last.notsent == 0 && last.delivery_rate > rate)
+    rate = last.delivery_rate;
+  throughput = rate;
+
+  if (rate > 0)
+    queued_ms = queued * 1000 / rate + last.rtt_us / 2000;
+  else if (queued > 0 && progress_us > 0)
+    queued_ms = (now_us() - progress_us) / 1000; // stalled
+  else
+    queued_ms = 0;
+  return latency_budget_ms > 0 && queued_ms > latency_budget_ms;
+}
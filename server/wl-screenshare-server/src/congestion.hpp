@@ -0,0 +1,47 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <cstddef>
+#include <cstdint>
+
+// What the kernel knows about a TCP connection
+struct transport_stats {
+  uint32_t outq = 0;          // bytes in the send buffer, unsent or unacked
+  uint32_t notsent = 0;       // bytes in the send buffer not sent yet
+  uint32_t rtt_us = 0;        // smoothed round trip time
+  uint64_t delivery_rate = 0; // bytes per second, 0 if unknown
+};
+
+bool read_transport_stats(int fd, transport_stats &stats);
+
+// Keeps the time a packet spends queued, in the server and in the kernel,
+// under a latency budget. A second monitor is useless if it lags behind, so
+// frames are dropped rather than letting the socket buffer grow.
+class congestion_control {
+public:
+  int latency_budget_ms = 0; // 0 disables it
+  bool track = false;         // keep estimating even without a budget
+
+  // Samples the socket, true if a packet queued now would be late
+  bool over_budget(int fd, size_t user_queued);
+
+  uint64_t bytes_sent = 0; // everything the kernel accepted so far
+
+  transport_stats last;
+  uint64_t drain_rate = 0;      // bytes per second the client consumes
+  uint64_t throughput = 0;      // best guess of what the link can take
+  uint32_t min_rtt_us = 0;      // round trip time with empty queues
+  int queued_ms = 0;            // estimated queueing delay
+  uint64_t frames_dropped = 0;  // frames never sent because of congestion
+  uint64_t skips = 0;           // times the client skipped to a keyframe
+  size_t max_queued_bytes = 0;  // worst queue depth since the last report
+
+private:
+  void sample_drain_rate();
+
+  int64_t sample_us = 0;
+  uint64_t sample_acked = 0;
+  int64_t progress_us = 0; // last time the client consumed anything
+};
+
+#endif
@@ -0,0 +1,203 @@
+#include "src/dmabuf_pool.hpp"
+
+#include <cerrno>
+#include <gbm.h>
+#include <iostream>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wayland-client-protocol.h>
+
+dmabuf_pool buffer_pool;
+
+dmabuf_pool::dmabuf_pool() {
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+dmabuf_pool::~dmabuf_pool() {
+  if (wake_fd >= 0)
+    close(wake_fd);
+}
+
+wf_buffer *dmabuf_pool::acquire(uint32_t _width, uint32_t _height,
+                                uint32_t _format, uint32_t _stride) {
+  collect_stale();
+
+  if (_width != width || _height != height || _format != format ||
+      _stride != stride) {
+    if (!buffers.empty()) {
+      std::cerr << "Output mode changed, reallocating capture buffers"
+                << std::endl;
+    }
+    for (auto buffer : buffers) {
+      if (buffer->in_use)
+        stale.push_back(buffer);
+      else
+        destroy(buffer);
+    }
+    buffers.clear();
+    width = _width;
+    height = _height;
+    format = _format;
+    stride = _stride;
+  }
+
+  for (auto buffer : buffers) {
+    bool expected = false;
+    if (buffer->in_use.compare_exchange_strong(expected, true))
+      return buffer;
+  }
+
+  if (buffers.size() >= DMABUF_POOL_SIZE) {
+    // looked again after raising the flag: a release() either comes
+    // before and is found here, or after and sees the flag
+    starved = true;
+    for (auto buffer : buffers) {
+      bool expected = false;
+      if (buffer->in_use.compare_exchange_strong(expected, true)) {
+        starved = false;
+        return buffer;
+      }
+    }
+    return nullptr;
+  }
+
+  wf_buffer *buffer = use_dmabuf ? allocate() : allocate_shm();
+  if (buffer == nullptr)
+    return nullptr;
+  buffer->in_use = true;
+  buffers.push_back(buffer);
+  return buffer;
+}
+
+void dmabuf_pool::release(wf_buffer *buffer) {
+  buffer->in_use = false;
+  if (starved.exchange(false)) {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0)
+      std::cerr << "Can't wake the capture loop up" << std::endl;
+  }
+}
+
+void dmabuf_pool::drain_wakeup() {
+  uint64_t count;
+  if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    std::cerr << "Can't read the capture wakeup" << std::endl;
+}
+
+void dmabuf_pool::discard(wf_buffer *buffer) {
+  for (auto list : {&buffers, &stale}) {
+    for (auto it = list->begin(); it != list->end(); ++it) {
+      if (*it == buffer) {
+        list->erase(it);
+        destroy(buffer);
+        return;
+      }
+    }
+  }
+}
+
+void dmabuf_pool::clear() {
+  for (auto buffer : buffers)
+    destroy(buffer);
+  for (auto buffer : stale)
+    destroy(buffer);
+  buffers.clear();
+  stale.clear();
+  width = height = format = stride = 0;
+}
+
+// The wl_buffer is created asynchronously, see dmabuf_created
+wf_buffer *dmabuf_pool::allocate() {
+  wf_buffer *buffer = new wf_buffer;
+  buffer->format = drm_to_wl_shm_format(format);
+  buffer->drm_format = format;
+  buffer->width = width;
+  buffer->height = height;
+
+  const uint64_t modifier = 0; // DRM_FORMAT_MOD_LINEAR
+  buffer->bo = gbm_bo_create_with_modifiers(gbm_device, width, height, format,
+                                            &modifier, 1);
+  if (buffer->bo == NULL) {
+    buffer->bo = gbm_bo_create(gbm_device, width, height, format,
+                               GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING);
+  }
+  if (buffer->bo == NULL) {
+    std::cerr << "Failed to create gbm bo" << std::endl;
+    delete buffer;
+    return nullptr;
+  }
+
+  buffer->stride = gbm_bo_get_stride(buffer->bo);
+  buffer->bo_fd = gbm_bo_get_fd(buffer->bo);
+
+  buffer->params = zwp_linux_dmabuf_v1_create_params(dmabuf);
+  uint64_t mod = gbm_bo_get_modifier(buffer->bo);
+  zwp_linux_buffer_params_v1_add(buffer->params, buffer->bo_fd, 0,
+                                 gbm_bo_get_offset(buffer->bo, 0),
+                                 gbm_bo_get_stride(buffer->bo), mod >> 32,
+                                 mod & 0xffffffff);
+  return buffer;
+}
+
+// The wl_buffer is ready right away, the memfd only lives on in the mapping
+// and in the compositor
+wf_buffer *dmabuf_pool::allocate_shm() {
+  wf_buffer *buffer = new wf_buffer;
+  buffer->format = (wl_shm_format)format;
+  buffer->drm_format = wl_shm_to_drm_format(format);
+  buffer->width = width;
+  buffer->height = height;
+  buffer->stride = stride;
+  buffer->size = (size_t)stride * height;
+
+  int fd = memfd_create("wl-screenshare-capture", MFD_CLOEXEC);
+  if (fd < 0 || ftruncate(fd, buffer->size) != 0) {
+    std::cerr << "Failed to create a capture buffer" << std::endl;
+    if (fd >= 0)
+      close(fd);
+    delete buffer;
+    return nullptr;
+  }
+
+  // the encoder only reads it
+  buffer->data = mmap(NULL, buffer->size, PROT_READ, MAP_SHARED, fd, 0);
+  if (buffer->data == MAP_FAILED) {
+    std::cerr << "Failed to map a capture buffer" << std::endl;
+    close(fd);
+    delete buffer;
+    return nullptr;
+  }
+
+  struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, buffer->size);
+  buffer->wl_buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
+                                                stride, format);
+  wl_shm_pool_destroy(pool);
+  close(fd);
+  return buffer;
+}
+
+void dmabuf_pool::destroy(wf_buffer *buffer) {
+  if (buffer->params)
+    zwp_linux_buffer_params_v1_destroy(buffer->params);
+  if (buffer->wl_buffer)
+    wl_buffer_destroy(buffer->wl_buffer);
+  if (buffer->bo)
+    gbm_bo_destroy(buffer->bo);
+  if (buffer->bo_fd >= 0)
+    close(buffer->bo_fd);
+  if (buffer->data)
+    munmap(buffer->data, buffer->size);
+  delete buffer;
+}
+
+void dmabuf_pool::collect_stale() {
+  for (auto it = stale.begin(); it != stale.end();) {
+    if ((*it)->in_use) {
+      ++it;
+      continue;
+    }
+    destroy(*it);
+    it = stale.erase(it);
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef DMABUF_POOL_H
+#define DMABUF_POOL_H
+
+#include "src/zwlr_screencopy.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// queued frames, plus the ones being captured and the one being encoded
+#define DMABUF_POOL_SIZE (BUFFER_QUEUE_SIZE + MAX_CAPTURE_DEPTH + 1)
+
+// Capture buffers (gbm_bo, dmabuf fd and wl_buffer) allocated once and
+// reused for every frame, so capturing doesn't go through the kernel
+// allocator and a wl_buffer roundtrip each time. They are reallocated only
+// when the output mode changes.
+//
+// Without dmabuf they are wl_shm buffers in a memfd each, mapped once, and
+// the encoder reads the pixels straight from the mapping.
+//
+// acquire() and clear() are called from the Wayland thread, release() from
+// any thread.
+class dmabuf_pool {
+
+public:
+  dmabuf_pool();
+  ~dmabuf_pool();
+
+  // Returns a free buffer for the mode, nullptr if all of them are in use.
+  // format is a DRM format for dmabuf, a wl_shm one otherwise, which also
+  // needs the stride.
+  wf_buffer *acquire(uint32_t width, uint32_t height, uint32_t format,
+                     uint32_t stride = 0);
+  void release(wf_buffer *buffer);
+  // Whether the last acquire() found every buffer in use, until one is
+  // released
+  bool exhausted() const { return starved; }
+  // Readable once a buffer is released after acquire() found none, so the
+  // Wayland loop can capture again. drain_wakeup() rearms it.
+  int wakeup_fd() const { return wake_fd; }
+  void drain_wakeup();
+  // Destroys a buffer that can't be used, e.g. the compositor refused to
+  // import it. It must not be in use by the encoder.
+  void discard(wf_buffer *buffer);
+  // Frees everything, no buffer may be in use anymore
+  void clear();
+
+private:
+  wf_buffer *allocate();
+  wf_buffer *allocate_shm();
+  void destroy(wf_buffer *buffer);
+  void collect_stale();
+
+  // the modifier is always DRM_FORMAT_MOD_LINEAR (or whatever gbm falls
+  // back to), so the size and format are enough to tell modes apart
+  uint32_t width = 0, height = 0, format = 0, stride = 0;
+  std::vector<wf_buffer *> buffers;
+  // buffers of a previous mode still held by the encoder
+  std::vector<wf_buffer *> stale;
+  std::atomic<bool> starved{false};
+  int wake_fd = -1;
+};
+
+extern dmabuf_pool buffer_pool;
+
+#endif
@@ -1,12 +1,33 @@
 #include "frame-writer.hpp"
 #include "averr.h"
+#include "pipeline_stats.hpp"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
 #include <cstring>
 #include <gbm.h>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 #define HAVE_CH_LAYOUT (LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100))
 
+// how often the bitrate follows the transport feedback
+#define ABR_INTERVAL_USEC 1000000
+// more than the capture buffers there can ever be
+#define MAX_MAPPED_FRAMES 16
+// above this many damage rects only their bounding box is used
+#define MAX_DAMAGE_ROI 16
+// quantizer offset (in hundredths, libx264 scales it by ~51 QP) for the parts
+// of a frame that didn't change
+#define STATIC_ROI_QOFFSET 4
+// frame rate assumed when none is given, what most outputs refresh at
+#define DEFAULT_FRAMERATE 60
+// conversion threads by default, more stripes than that only add overhead
+#define MAX_AUTO_CONVERT_THREADS 8
+// share of the frame (in percent) above which damage is converted as a whole
+#define DAMAGE_FULL_CONVERT_PCT 60
+
 static const AVRational US_RATIONAL{1, 1000000};
 
 Server server;
@@ -33,6 +54,8 @@ void FrameWriter::load_codec_options(AVDictionary **dict) {
       {"tune", "zerolatency"},
       {"preset", "ultrafast"},
       {"crf", "20"},
+      // one thread per core, as sliced threads with zerolatency
+      {"threads", "auto"},
   };
 
   static const CodecOptions default_libvpx_options = {
@@ -117,6 +140,184 @@ AVPixelFormat FrameWriter::get_input_format() {
   }
 }
 
+// What the filter graph gets, the input format or what it was converted to
+AVPixelFormat FrameWriter::source_format() {
+  return converted_format != AV_PIX_FMT_NONE ? converted_format
+                                             : get_input_format();
+}
+
+// Only when the graph would do nothing but the conversion, and maybe
+// drop frames for a fixed framerate
+void FrameWriter::init_converter(AVPixelFormat out_fmt) {
+  if (this->hw_device_context)
+    return;
+
+  const std::string &filter = params.video_filter;
+  if (filter != "null" &&
+      (filter.rfind("fps=", 0) != 0 ||
+       filter.find_first_of(",;") != std::string::npos))
+    return;
+
+  convert_input input;
+  if (params.format == INPUT_FORMAT_BGR0)
+    input = CONVERT_BGRX;
+  else if (params.format == INPUT_FORMAT_RGB0)
+    input = CONVERT_RGBX;
+  else
+    return;
+
+  convert_output output;
+  if (out_fmt == AV_PIX_FMT_YUV420P || out_fmt == AV_PIX_FMT_YUVJ420P)
+    output = CONVERT_I420;
+  else if (out_fmt == AV_PIX_FMT_NV12)
+    output = CONVERT_NV12;
+  else
+    return;
+
+  converter.init(input, output);
+  converted_format = out_fmt;
+
+  int threads = params.convert_threads;
+  if (threads <= 0)
+    threads = std::min<int>(std::thread::hardware_concurrency(),
+                            MAX_AUTO_CONVERT_THREADS);
+  convert_pool.start(threads, params.convert_cpus);
+  std::cerr << "Converting to " << av_get_pix_fmt_name(out_fmt) << " with "
+            << convert_simd_name(converter.simd()) << " kernels on "
+            << std::max(threads, 1) << " threads" << std::endl;
+}
+
+// The frame is kept from one capture to the next, only what the damage
+// covers is converted again. It is reused once the encoder let go of it,
+// otherwise a new one is converted whole.
+AVFrame *FrameWriter::convert_frame(const uint8_t *pixels, int stride,
+                                    const std::vector<damage_rect> &damage) {
+  bool whole = damage.empty();
+  if (!converted_frame || !av_frame_is_writable(converted_frame)) {
+    whole = true;
+    av_frame_free(&converted_frame);
+    converted_frame = av_frame_alloc();
+    if (!converted_frame)
+      return NULL;
+    converted_frame->format = converted_format;
+    converted_frame->width = params.width;
+    converted_frame->height = params.height;
+    converted_frame->color_range = AVCOL_RANGE_JPEG;
+    if (av_frame_get_buffer(converted_frame, 0) < 0) {
+      av_frame_free(&converted_frame);
+      return NULL;
+    }
+  }
+
+  // rectangles on even coordinates, their chroma samples don't take
+  // pixels from outside of them
+  std::vector<damage_rect> rects;
+  int64_t area = 0;
+  for (auto &r : damage) {
+    int x0 = std::max(r.x, 0) & ~1, y0 = std::max(r.y, 0) & ~1;
+    int x1 = std::min((r.x + r.width + 1) & ~1, params.width);
+    int y1 = std::min((r.y + r.height + 1) & ~1, params.height);
+    if (x1 > x0 && y1 > y0) {
+      rects.push_back({x0, y0, x1 - x0, y1 - y0});
+      area += (int64_t)(x1 - x0) * (y1 - y0);
+    }
+  }
+  if (area * 100 >= (int64_t)params.width * params.height *
+                        DAMAGE_FULL_CONVERT_PCT)
+    whole = true;
+  if (whole)
+    rects = {{0, 0, params.width, params.height}};
+
+  // stripes of an even number of rows, so that they have their own chroma
+  // rows, each one converting its part of every rectangle. A negative
+  // stride flips the frame on the way.
+  int stripes = std::max(convert_pool.threads(), 1);
+  int rows = (params.height + stripes - 1) / stripes;
+  rows += rows & 1;
+  convert_pool.run(stripes, [&](int stripe) {
+    int first = stripe * rows, last = first + rows;
+    for (auto &r : rects) {
+      int y0 = std::max(r.y, first);
+      int y1 = std::min(r.y + r.height, last);
+      if (y1 > y0)
+        converter.convert_region(pixels, stride, r.x, y0, r.width, y1 - y0,
+                                 converted_frame->data,
+                                 converted_frame->linesize);
+    }
+  });
+
+  AVFrame *frame = av_frame_alloc();
+  if (frame && av_frame_ref(frame, converted_frame) < 0)
+    av_frame_free(&frame);
+  return frame;
+}
+
+// Every tile is hashed and compared with the previous frame, on the
+// conversion threads. Dirty tiles next to each other in a row of tiles make
+// one rectangle.
+bool FrameWriter::find_damage(const uint8_t *pixels,
+                              std::vector<damage_rect> &damage,
+                              bool every_row) {
+  int64_t start = monotonic_usec();
+  int row_step = every_row ? 1 : TILE_ROW_STEP;
+  if (tiles.tiles_x() == 0 || tiles.row_step() != row_step) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(get_input_format());
+    tiles.init(params.width, params.height,
+               av_get_padded_bits_per_pixel(desc) / 8, convert_best_simd(),
+               row_step);
+  }
+
+  int stripes = std::max(convert_pool.threads(), 1);
+  int rows = (tiles.tiles_y() + stripes - 1) / stripes;
+  convert_pool.run(
+      stripes,
+      [&](int stripe) {
+        tiles.hash(pixels, params.stride, stripe * rows, (stripe + 1) * rows);
+      },
+      false);
+  bool changed = tiles.compare() > 0;
+
+  damage.clear();
+  for (int ty = 0; ty < tiles.tiles_y(); ty++) {
+    for (int tx = 0; tx < tiles.tiles_x(); tx++) {
+      if (!tiles.dirty(tx, ty))
+        continue;
+      int first = tx;
+      while (tx + 1 < tiles.tiles_x() && tiles.dirty(tx + 1, ty))
+        tx++;
+      int x = first * TILE_SIZE, y = ty * TILE_SIZE;
+      damage.push_back({x, y,
+                        std::min((tx + 1) * TILE_SIZE, params.width) - x,
+                        std::min(TILE_SIZE, params.height - y)});
+    }
+  }
+
+  tiles_current = changed;
+  int64_t now = monotonic_usec();
+  report_tile_hash(now, now - start, changed);
+  return changed;
+}
+
+void FrameWriter::report_tile_hash(int64_t now_usec, int64_t usec,
+                                   bool changed) {
+  tile_usec_total += usec;
+  tile_usec_max = std::max(tile_usec_max, usec);
+  tile_frames++;
+  tile_unchanged += !changed;
+
+  if (tile_last_report == 0)
+    tile_last_report = now_usec;
+  if (now_usec - tile_last_report < 1000000)
+    return;
+
+  printf("Tile hash %.2f/%.2f ms (avg/max) | %d/%d frames unchanged\n",
+         tile_usec_total / 1000.0 / tile_frames, tile_usec_max / 1000.0,
+         tile_unchanged, tile_frames);
+  tile_usec_total = tile_usec_max = 0;
+  tile_frames = tile_unchanged = 0;
+  tile_last_report = now_usec;
+}
+
 static const struct {
   int drm;
   AVPixelFormat av;
@@ -195,6 +396,9 @@ void FrameWriter::init_video_filters(const AVCodec *codec) {
     }
   }
 
+  AVPixelFormat out_fmt = handle_buffersink_pix_fmt(codec);
+  init_converter(out_fmt);
+
   this->videoFilterGraph = avfilter_graph_alloc();
   av_opt_set(videoFilterGraph, "scale_sws_opts",
              "flags=fast_bilinear:src_range=1:dst_range=1", 0);
@@ -228,7 +432,7 @@ void FrameWriter::init_video_filters(const AVCodec *codec) {
   // See: https://ffmpeg.org/ffmpeg-filters.html#buffer
   std::stringstream buffer_filter_config;
   buffer_filter_config << "video_size=" << params.width << "x" << params.height;
-  buffer_filter_config << ":pix_fmt=" << (int)this->get_input_format();
+  buffer_filter_config << ":pix_fmt=" << (int)this->source_format();
   buffer_filter_config << ":time_base=" << US_RATIONAL.num << "/"
                        << US_RATIONAL.den;
   if (params.buffrate != 0) {
@@ -268,8 +472,7 @@ void FrameWriter::init_video_filters(const AVCodec *codec) {
   // We also need to tell the sink which pixel formats are supported.
   // by the video encoder. codevIndicate to our sink  pixel formats
   // are accepted by our codec.
-  const AVPixelFormat picked_pix_fmt[] = {handle_buffersink_pix_fmt(codec),
-                                          AV_PIX_FMT_NONE};
+  const AVPixelFormat picked_pix_fmt[] = {out_fmt, AV_PIX_FMT_NONE};
 
   err =
       av_opt_set_int_list(this->videoFilterSinkCtx, "pix_fmts", picked_pix_fmt,
@@ -392,6 +595,15 @@ void FrameWriter::init_video_stream() {
   if (params.bframes != -1)
     videoCodecCtx->max_b_frames = params.bframes;
 
+  if (params.intra_refresh != 0)
+    init_intra_refresh(codec, &options);
+
+  if (params.slices > 0)
+    init_slices(&options);
+
+  if (params.abr_max_bitrate > 0)
+    init_abr();
+
   if (!params.hw_device.empty()) {
     init_hw_accel();
   }
@@ -419,6 +631,13 @@ void FrameWriter::init_video_stream() {
   }
   av_dict_free(&options);
 
+  // with a global header SPS/PPS only live in the extradata, late joiners
+  // get it right before their first keyframe
+  if (videoCodecCtx->extradata_size > 0) {
+    server.send_header_server(videoCodecCtx->extradata,
+                              videoCodecCtx->extradata_size);
+  }
+
   if ((ret = avcodec_parameters_from_context(videoStream->codecpar,
                                              videoCodecCtx)) < 0) {
     av_strerror(ret, err, 256);
@@ -427,6 +646,122 @@ void FrameWriter::init_video_stream() {
   }
 }
 
+// A column of intra blocks sweeps over the picture every intra_refresh frames
+// instead of periodic keyframes, so the frames all have about the same size.
+// IDRs are only encoded when a client asks for one, to join or after an error.
+void FrameWriter::init_intra_refresh(const AVCodec *codec,
+                                     AVDictionary **options) {
+  void *priv_class = const_cast<const AVClass **>(&codec->priv_class);
+  if (params.intra_refresh < 0)
+    params.intra_refresh =
+        params.framerate > 0 ? params.framerate : DEFAULT_FRAMERATE;
+
+  if (!av_opt_find(priv_class, "intra-refresh", NULL, 0,
+                   AV_OPT_SEARCH_FAKE_OBJ)) {
+    std::cerr << "Intra refresh: " << params.codec
+              << " doesn't support it, keyframes are only sent when a "
+                 "client needs one"
+              << std::endl;
+    videoCodecCtx->gop_size = INT_MAX;
+    return;
+  }
+
+  // the period of the refresh, periodic IDRs are disabled
+  videoCodecCtx->gop_size = params.intra_refresh;
+  av_dict_set(options, "intra-refresh", "1", 0);
+  // a forced keyframe would otherwise only start a new refresh, which a
+  // joining client can't decode from
+  if (av_opt_find(priv_class, "forced-idr", NULL, 0, AV_OPT_SEARCH_FAKE_OBJ))
+    av_dict_set(options, "forced-idr", "1", 0);
+  std::cerr << "Intra refresh over " << params.intra_refresh << " frames"
+            << std::endl;
+}
+
+// Every frame is split in slices encoded at the same time by one thread each,
+// instead of the default frame threading which keeps as many frames in the
+// encoder as there are threads. A frame is then out as soon as its slowest
+// slice is done, and decoders can decode the slices in parallel as well.
+void FrameWriter::init_slices(AVDictionary **options) {
+  videoCodecCtx->slices = params.slices;
+  videoCodecCtx->thread_type = FF_THREAD_SLICE;
+  if (params.codec.find("libx264") != std::string::npos) {
+    // sliced threads, and no lookahead or b-frames holding frames back
+    av_dict_set(options, "tune", "zerolatency", AV_DICT_DONT_OVERWRITE);
+  }
+  std::cerr << "Slices: " << params.slices << std::endl;
+}
+
+// Only some encoders take a new bitrate without being reopened: libx264
+// reconfigures itself when the rate control fields of the context change,
+// NVENC does the same for its bitrate
+bool FrameWriter::set_bitrate(int64_t bps) {
+  if (params.codec.find("libx264") != std::string::npos) {
+    // in CRF mode (the default) the VBV caps the bitrate, 250ms of buffer,
+    // or a single frame with intra refresh for a flat bitrate
+    int fps = params.framerate > 0 ? params.framerate : DEFAULT_FRAMERATE;
+    videoCodecCtx->rc_max_rate = bps;
+    videoCodecCtx->rc_buffer_size =
+        params.intra_refresh != 0 ? bps / fps : bps / 4;
+    // in CRF mode a bit_rate set before opening would switch it to ABR
+    if (x264_abr_mode)
+      videoCodecCtx->bit_rate = bps;
+    return true;
+  }
+
+  if (params.codec.find("nvenc") != std::string::npos) {
+    videoCodecCtx->bit_rate = bps;
+    videoCodecCtx->rc_max_rate = bps;
+    return true;
+  }
+
+  return false;
+}
+
+void FrameWriter::init_abr() {
+  int64_t max_bps = params.abr_max_bitrate * 1000ll;
+  int64_t min_bps = params.abr_min_bitrate * 1000ll;
+  // the codec options are loaded by now, with the default crf
+  auto crf = params.codec_options.find("crf");
+  x264_abr_mode = crf == params.codec_options.end() ||
+                  atof(crf->second.c_str()) < 0;
+
+  // start from the top, the controller backs off at the first sign of
+  // congestion
+  if (!set_bitrate(max_bps)) {
+    std::cerr << "Adaptive bitrate: " << params.codec
+              << " can't change bitrate while encoding, ignoring it"
+              << std::endl;
+    return;
+  }
+
+  std::cerr << "Adaptive bitrate: " << min_bps / 1000 << "-" << max_bps / 1000
+            << " kbit/s" << std::endl;
+  abr = std::unique_ptr<bitrate_controller>(
+      new bitrate_controller(min_bps, max_bps));
+}
+
+void FrameWriter::update_bitrate(int64_t usec) {
+  if (!abr || usec - abr_last_usec < ABR_INTERVAL_USEC)
+    return;
+  abr_last_usec = usec;
+
+  transport_feedback fb;
+  if (!server.get_feedback(fb))
+    return;
+
+  int64_t old_bps = abr->target();
+  int64_t bps = abr->update(fb);
+  if (bps == old_bps)
+    return;
+
+  set_bitrate(bps);
+  std::cerr << "Adaptive bitrate: " << bps / 1000 << " kbit/s (throughput "
+            << fb.throughput * 8 / 1000 << " kbit/s, delay " << fb.queued_ms
+            << " ms, rtt " << fb.rtt_us / 1000 << " ms, loss "
+            << fb.fraction_lost * 100 / 256 << "%, decoder queue "
+            << fb.decode_queue << ")" << std::endl;
+}
+
 void FrameWriter::init_codecs() { init_video_stream(); }
 
 static const char *determine_output_format(const FrameWriterParams &params) {
@@ -464,6 +799,51 @@ FrameWriter::FrameWriter(const FrameWriterParams &_params) : params(_params) {
   init_codecs();
 }
 
+// With intra refresh the encoder also flags the frames starting a new refresh
+// as keyframes, but clients can only start decoding from an IDR
+static bool has_idr(const uint8_t *data, int size, bool hevc) {
+  bool annexb = false;
+  for (int i = 0; i + 3 < size; i++) {
+    if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1)
+      continue;
+    annexb = true;
+    uint8_t type = hevc ? (data[i + 3] >> 1) & 0x3f : data[i + 3] & 0x1f;
+    if (hevc ? type >= 16 && type <= 21 : type == 5)
+      return true;
+  }
+  // length prefixed NAL units, go with the flag
+  return !annexb;
+}
+
+// The server thread keeps a reference on the packet buffer instead of a
+// copy, it is released once every client is done with it
+static void send_packet(AVCodecContext *enc_ctx, AVPacket *pkt,
+                        uint8_t stream) {
+  if (!server.is_connected())
+    return;
+
+  AVPacket *ref = av_packet_clone(pkt);
+  if (!ref) {
+    std::cerr << "Failed to reference packet" << std::endl;
+    return;
+  }
+  std::shared_ptr<AVPacket> owner(ref,
+                                  [](AVPacket *p) { av_packet_free(&p); });
+
+  uint32_t flags = 0;
+  if ((ref->flags & AV_PKT_FLAG_KEY) &&
+      (params.intra_refresh == 0 || stream != WIRE_STREAM_VIDEO ||
+       has_idr(ref->data, ref->size, enc_ctx->codec_id == AV_CODEC_ID_HEVC)))
+    flags |= PACKET_KEYFRAME;
+  // the server may drop these first when the network can't keep up
+  if (ref->flags & AV_PKT_FLAG_DISPOSABLE)
+    flags |= PACKET_DISPOSABLE;
+
+  int64_t pts = av_rescale_q(ref->pts, enc_ctx->time_base, US_RATIONAL);
+  server.send_data(std::shared_ptr<const uint8_t>(owner, ref->data), ref->size,
+                   flags, pts, stream);
+}
+
 void FrameWriter::encode(AVCodecContext *enc_ctx, AVFrame *frame,
                          AVPacket *pkt) {
   /* send the frame to the encoder */
@@ -484,7 +864,9 @@ void FrameWriter::encode(AVCodecContext *enc_ctx, AVFrame *frame,
     }
 
     // send data -giammi
-    server.send_data(pkt->data, pkt->size);
+    send_packet(enc_ctx, pkt,
+                enc_ctx == videoCodecCtx ? WIRE_STREAM_VIDEO
+                                         : WIRE_STREAM_AUDIO);
 
     finish_frame(enc_ctx, *pkt);
   }
@@ -493,6 +875,8 @@ void FrameWriter::encode(AVCodecContext *enc_ctx, AVFrame *frame,
 bool FrameWriter::push_frame(AVFrame *frame, int64_t usec) {
   frame->pts = usec; // We use time_base = 1/US_RATE
 
+  update_bitrate(usec);
+
   // Push the RGB frame into the filtergraph */
   int err = av_buffersrc_add_frame_flags(videoFilterSourceCtx, frame, 0);
   if (err < 0) {
@@ -525,7 +909,20 @@ bool FrameWriter::push_frame(AVFrame *frame, int64_t usec) {
       return false;
     }
 
-    filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
+    // a client joined mid-GOP or its decoder lost track, it can't decode
+    // anything before a keyframe
+    bool keyframe = server.keyframe_requested();
+    filtered_frame->pict_type =
+        keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+    // keyframes are what late joiners start from and the rest of the GOP
+    // refers to, the static parts are coded as well as the rest
+    int gop = videoCodecCtx->gop_size;
+    keyframe |= frames_in_gop < 0 || (gop > 0 && frames_in_gop >= gop);
+    frames_in_gop = keyframe ? 1 : frames_in_gop + 1;
+    if (keyframe)
+      av_frame_remove_side_data(filtered_frame,
+                                AV_FRAME_DATA_REGIONS_OF_INTEREST);
 
     // So we have a frame. Encode it!
     AVPacket *pkt = av_packet_alloc();
@@ -542,7 +939,15 @@ bool FrameWriter::push_frame(AVFrame *frame, int64_t usec) {
 }
 
 bool FrameWriter::add_frame(const uint8_t *pixels, int64_t usec,
-                            bool y_invert) {
+                            bool y_invert,
+                            const std::vector<damage_rect> &damage,
+                            void (*release)(void *opaque, uint8_t *data),
+                            void *opaque) {
+  // a frame find_damage() didn't see, its hashes are out of date
+  if (!tiles_current)
+    tiles.reset();
+  tiles_current = false;
+
   /* Calculate data after y-inversion */
   int stride[] = {int(params.stride)};
   const uint8_t *formatted_pixels = pixels;
@@ -551,48 +956,77 @@ bool FrameWriter::add_frame(const uint8_t *pixels, int64_t usec,
     stride[0] *= -1;
   }
 
-  auto frame = av_frame_alloc();
+  // damage is in buffer coordinates
+  std::vector<damage_rect> frame_damage = damage;
+  if (y_invert) {
+    for (auto &r : frame_damage)
+      r.y = params.height - r.y - r.height;
+  }
+
+  AVFrame *frame;
+  if (converted_format != AV_PIX_FMT_NONE) {
+    // the capture buffer can go back to the pool right away
+    frame = convert_frame(formatted_pixels, stride[0], frame_damage);
+    if (release)
+      release(opaque, (uint8_t *)pixels);
+    if (!frame) {
+      std::cerr << "Failed to allocate frame!" << std::endl;
+      return false;
+    }
+    add_damage_roi(frame, frame_damage);
+    return push_frame(frame, usec);
+  }
+
+  frame = av_frame_alloc();
   if (!frame) {
     std::cerr << "Failed to allocate frame!" << std::endl;
+    if (release)
+      release(opaque, (uint8_t *)pixels);
     return false;
   }
 
+  // a frame without a buffer would be copied by the filter graph,
+  // referencing the mapping lets the conversion read it in place
+  if (release) {
+    frame->buf[0] =
+        av_buffer_create((uint8_t *)pixels, params.stride * params.height,
+                         release, opaque, AV_BUFFER_FLAG_READONLY);
+    if (!frame->buf[0]) {
+      release(opaque, (uint8_t *)pixels);
+      av_frame_free(&frame);
+      return false;
+    }
+  }
+
   frame->data[0] = (uint8_t *)formatted_pixels;
   frame->linesize[0] = stride[0];
   frame->format = get_input_format();
   frame->width = params.width;
   frame->height = params.height;
+  add_damage_roi(frame, frame_damage);
 
   return push_frame(frame, usec);
 }
 
-bool FrameWriter::add_frame(struct gbm_bo *bo, int bo_fd, int64_t usec,
-                            bool y_invert) {
-  if (y_invert) {
-    std::cerr << "Y_INVERT not supported with dmabuf" << std::endl;
-    return false;
-  }
-
+// Imports the dmabuf into a VAAPI surface
+AVFrame *FrameWriter::map_dmabuf(struct gbm_bo *bo, int bo_fd) {
   auto frame = av_frame_alloc();
   if (!frame) {
     std::cerr << "Failed to allocate frame!" << std::endl;
-    return false;
+    return NULL;
   }
 
-  // if (mapped_frames.find(bo) == mapped_frames.end()) {
   auto vaapi_frame = av_frame_alloc();
   if (!vaapi_frame) {
     std::cerr << "Failed to allocate frame!" << std::endl;
-    return false;
+    av_frame_free(&frame);
+    return NULL;
   }
 
   AVDRMFrameDescriptor *desc =
       (AVDRMFrameDescriptor *)av_mallocz(sizeof(AVDRMFrameDescriptor));
   desc->nb_layers = 1;
   desc->nb_objects = 1;
-  // if (bo_fd == -1)
-  // desc->objects[0].fd = gbm_bo_get_fd(bo);
-  // else
   desc->objects[0].fd = bo_fd;
   desc->objects[0].format_modifier = gbm_bo_get_modifier(bo);
   desc->objects[0].size = gbm_bo_get_stride(bo) * gbm_bo_get_height(bo);
@@ -615,19 +1049,137 @@ bool FrameWriter::add_frame(struct gbm_bo *bo, int bo_fd, int64_t usec,
   vaapi_frame->format = AV_PIX_FMT_VAAPI;
   vaapi_frame->hw_frames_ctx = av_buffer_ref(this->hw_frame_context_in);
 
+  // the mapping keeps its own reference on the source frame
   int ret = av_hwframe_map(vaapi_frame, frame, AV_HWFRAME_MAP_READ);
-  av_frame_unref(frame);
+  av_frame_free(&frame);
   if (ret < 0) {
     std::cerr << "Failed to map vaapi frame " << averr(ret) << std::endl;
+    av_frame_free(&vaapi_frame);
+    return NULL;
+  }
+  return vaapi_frame;
+}
+
+void FrameWriter::clear_mapped_frames() {
+  for (auto &it : mapped_frames)
+    av_frame_free(&it.second);
+  mapped_frames.clear();
+}
+
+// Tells the encoder which parts of the frame changed: the rest is coded at a
+// lower quality, it is the same as in the previous frame anyway. Encoders
+// without ROI support (only libx264, libx265 and VAAPI have it) ignore it.
+void FrameWriter::add_damage_roi(AVFrame *frame,
+                                 const std::vector<damage_rect> &damage) {
+  // with intra refresh every frame carries a part of the refresh, which
+  // must not come out worse than the rest
+  if (damage.empty() || params.intra_refresh != 0)
+    return;
+
+  std::vector<damage_rect> rects = damage;
+  if (rects.size() > MAX_DAMAGE_ROI) {
+    // too fragmented, fall back to the bounding box
+    int x0 = params.width, y0 = params.height, x1 = 0, y1 = 0;
+    for (auto &r : damage) {
+      x0 = std::min(x0, r.x);
+      y0 = std::min(y0, r.y);
+      x1 = std::max(x1, r.x + r.width);
+      y1 = std::max(y1, r.y + r.height);
+    }
+    rects = {{x0, y0, x1 - x0, y1 - y0}};
+  }
+
+  // the first region covering a block wins, the whole frame goes last
+  size_t count = rects.size() + 1;
+  AVFrameSideData *sd = av_frame_new_side_data(
+      frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+      count * sizeof(AVRegionOfInterest));
+  if (!sd)
+    return;
+
+  AVRegionOfInterest *roi = (AVRegionOfInterest *)sd->data;
+  for (size_t i = 0; i < count; i++) {
+    roi[i].self_size = sizeof(AVRegionOfInterest);
+    if (i < rects.size()) {
+      roi[i].left = rects[i].x;
+      roi[i].top = rects[i].y;
+      roi[i].right = rects[i].x + rects[i].width;
+      roi[i].bottom = rects[i].y + rects[i].height;
+      roi[i].qoffset = av_make_q(0, 1);
+    } else {
+      roi[i].left = roi[i].top = 0;
+      roi[i].right = params.width;
+      roi[i].bottom = params.height;
+      roi[i].qoffset = av_make_q(STATIC_ROI_QOFFSET, 100);
+    }
+  }
+}
+
+bool FrameWriter::add_frame(struct gbm_bo *bo, int bo_fd, int64_t usec,
+                            bool y_invert,
+                            const std::vector<damage_rect> &damage,
+                            void (*release)(void *opaque, uint8_t *data),
+                            void *opaque) {
+  if (y_invert) {
+    std::cerr << "Y_INVERT not supported with dmabuf" << std::endl;
+    if (release)
+      release(opaque, NULL);
     return false;
   }
 
-  //   mapped_frames[bo] = vaapi_frame;
-  // }
+  // new buffers, possibly at the addresses of the old ones: start over
+  uint32_t width = gbm_bo_get_width(bo);
+  uint32_t height = gbm_bo_get_height(bo);
+  uint32_t format = gbm_bo_get_format(bo);
+  uint64_t modifier = gbm_bo_get_modifier(bo);
+  if (width != mapped_width || height != mapped_height ||
+      format != mapped_format || modifier != mapped_modifier ||
+      mapped_frames.size() >= MAX_MAPPED_FRAMES) {
+    clear_mapped_frames();
+    mapped_width = width;
+    mapped_height = height;
+    mapped_format = format;
+    mapped_modifier = modifier;
+  }
 
-  // av_frame_ref(frame, mapped_frames[bo]);
-  // av_frame_ref(frame, vaapi_frame);
-  return push_frame(vaapi_frame, usec);
+  auto it = mapped_frames.find(bo);
+  if (it == mapped_frames.end()) {
+    AVFrame *vaapi_frame = map_dmabuf(bo, bo_fd);
+    if (!vaapi_frame) {
+      if (release)
+        release(opaque, NULL);
+      return false;
+    }
+    it = mapped_frames.emplace(bo, vaapi_frame).first;
+  }
+
+  auto frame = av_frame_alloc();
+  if (!frame || av_frame_ref(frame, it->second) < 0) {
+    std::cerr << "Failed to allocate frame!" << std::endl;
+    av_frame_free(&frame);
+    if (release)
+      release(opaque, NULL);
+    return false;
+  }
+
+  // the mapping stays, but the compositor must not copy the next capture
+  // into the bo before the last reference to this frame is gone: an extra
+  // buffer on the frame hands it back then
+  if (release) {
+    int slot = 0;
+    while (slot < AV_NUM_DATA_POINTERS && frame->buf[slot])
+      slot++;
+    if (slot < AV_NUM_DATA_POINTERS)
+      frame->buf[slot] = av_buffer_create(NULL, 0, release, opaque, 0);
+    if (slot == AV_NUM_DATA_POINTERS || !frame->buf[slot]) {
+      std::cerr << "Failed to allocate frame!" << std::endl;
+      av_frame_free(&frame);
+      release(opaque, NULL);
+      return false;
+    }
+  }
+  add_damage_roi(frame, damage);
+  return push_frame(frame, usec);
 }
 
 void FrameWriter::finish_frame(AVCodecContext *enc_ctx, AVPacket &pkt) {
@@ -667,6 +1219,8 @@ FrameWriter::~FrameWriter() {
     avcodec_free_context(&audioCodecCtx);
 #endif
   av_packet_free(&pkt);
+  clear_mapped_frames();
+  av_frame_free(&converted_frame);
   // TODO: free all the hw accel
   avformat_free_context(fmtCtx);
 }
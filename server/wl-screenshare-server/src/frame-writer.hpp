@@ -6,9 +6,14 @@
 #define FRAME_WRITER
 
 #include "config.h"
+#include "src/abr.hpp"
+#include "src/color_convert.hpp"
+#include "src/stripe_pool.hpp"
+#include "src/tile_hash.hpp"
 #include "src/server.hpp"
 #include <atomic>
 #include <map>
+#include <memory>
 #include <stdint.h>
 #include <string>
 #include <vector>
@@ -46,6 +51,11 @@ enum InputFormat {
   INPUT_FORMAT_DMABUF,
 };
 
+// Part of the frame the compositor reported as changed, in buffer coordinates
+struct damage_rect {
+  int x, y, width, height;
+};
+
 struct FrameWriterParams {
   std::string file;
   int width;
@@ -76,6 +86,22 @@ struct FrameWriterParams {
 
   int bframes;
 
+  // adaptive bitrate range in kbit/s, disabled if abr_max_bitrate is 0
+  int abr_min_bitrate = 0;
+  int abr_max_bitrate = 0;
+
+  // intra refresh period in frames instead of periodic keyframes, -1 for one
+  // second worth of frames, 0 disables it
+  int intra_refresh = 0;
+
+  // slices per frame, encoded in parallel, 0 leaves it to the encoder
+  int slices = 0;
+
+  // threads converting RGB to YUV in stripes, 0 for one per core, and the
+  // CPUs they are pinned to
+  int convert_threads = 0;
+  std::vector<int> convert_cpus;
+
   std::atomic<bool> &write_aborted_flag;
   FrameWriterParams(std::atomic<bool> &flag) : write_aborted_flag(flag) {}
 };
@@ -98,7 +124,38 @@ class FrameWriter {
   AVBufferRef *hw_frame_context = NULL;
   AVBufferRef *hw_frame_context_in = NULL;
 
+  // VAAPI surfaces the capture buffers are imported as. The buffers are
+  // reused from frame to frame, so each one is only mapped once, until the
+  // buffers are reallocated for a new mode.
   std::map<struct gbm_bo *, AVFrame *> mapped_frames;
+  uint32_t mapped_width = 0, mapped_height = 0, mapped_format = 0;
+  uint64_t mapped_modifier = 0;
+  AVFrame *map_dmabuf(struct gbm_bo *bo, int bo_fd);
+  void clear_mapped_frames();
+  void add_damage_roi(AVFrame *frame, const std::vector<damage_rect> &damage);
+  // frames since the last keyframe, -1 before the first one
+  int frames_in_gop = -1;
+
+  // RGB to YUV done here instead of by swscale in the filter graph, the
+  // graph then gets converted_format
+  color_converter converter;
+  AVPixelFormat converted_format = AV_PIX_FMT_NONE;
+  AVFrame *converted_frame = NULL;
+  stripe_pool convert_pool;
+  void init_converter(AVPixelFormat out_fmt);
+  // Empty damage converts the whole frame
+  AVFrame *convert_frame(const uint8_t *pixels, int stride,
+                         const std::vector<damage_rect> &damage);
+  AVPixelFormat source_format();
+
+  // Damage found by find_damage(), for captures without usable damage. The
+  // hashes are only those of the previous frame if it went through it too.
+  tile_hasher tiles;
+  bool tiles_current = false;
+  int64_t tile_usec_total = 0, tile_usec_max = 0;
+  int tile_frames = 0, tile_unchanged = 0;
+  int64_t tile_last_report = 0;
+  void report_tile_hash(int64_t now_usec, int64_t usec, bool changed);
 
   AVPixelFormat lookup_pixel_format(std::string pix_fmt);
   AVPixelFormat handle_buffersink_pix_fmt(const AVCodec *codec);
@@ -107,6 +164,16 @@ class FrameWriter {
   void init_codecs();
   void init_video_filters(const AVCodec *codec);
   void init_video_stream();
+  void init_abr();
+  void init_intra_refresh(const AVCodec *codec, AVDictionary **options);
+  void init_slices(AVDictionary **options);
+
+  std::unique_ptr<bitrate_controller> abr;
+  int64_t abr_last_usec = 0;
+  // libx264 with its crf option turned off, encoding to bit_rate
+  bool x264_abr_mode = false;
+  bool set_bitrate(int64_t bps);
+  void update_bitrate(int64_t usec);
 
   void encode(AVCodecContext *enc_ctx, AVFrame *frame, AVPacket *pkt);
 
@@ -123,9 +190,29 @@ class FrameWriter {
 
 public:
   FrameWriter(const FrameWriterParams &params);
-  bool add_frame(const uint8_t *pixels, int64_t usec, bool y_invert);
+  // With release, the pixels are used in place and release(opaque, pixels)
+  // is called once the filters and the encoder are done with them, which
+  // may be later than the return. Without it they are copied. damage is
+  // what changed since the previous frame, empty if unknown.
+  bool add_frame(const uint8_t *pixels, int64_t usec, bool y_invert,
+                 const std::vector<damage_rect> &damage = {},
+                 void (*release)(void *opaque, uint8_t *data) = nullptr,
+                 void *opaque = nullptr);
   bool add_frame(struct gbm_bo *bo, int64_t usec, bool y_invert);
-  bool add_frame(struct gbm_bo *bo, int bo_fd, int64_t usec, bool y_invert);
+  // For pixels in memory without usable damage: the tiles that changed
+  // since the previous frame, as damage in buffer coordinates. False when
+  // nothing did, the frame can be skipped. every_row when the next frame
+  // may not come before the screen changes again (damage-driven capture),
+  // a change only found later would stay off the stream until then.
+  bool find_damage(const uint8_t *pixels, std::vector<damage_rect> &damage,
+                   bool every_row);
+  // release(opaque, NULL) is called once the filters and the encoder are
+  // done with the VAAPI surface the bo is mapped to, or right away if the
+  // frame can't be added
+  bool add_frame(struct gbm_bo *bo, int bo_fd, int64_t usec, bool y_invert,
+                 const std::vector<damage_rect> &damage = {},
+                 void (*release)(void *opaque, uint8_t *data) = nullptr,
+                 void *opaque = nullptr);
 
 #ifdef HAVE_AUDIO
   /* Buffer must have size get_audio_buffer_size() */
@@ -0,0 +1,84 @@
+#include "latency_stats.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+static const char *STAGE_NAMES[LATENCY_STAGES] = {
+    "capture", "queue", "encode", "send", "delivery", "total"};
+
+static int bucket(int64_t usec) {
+  if (usec < 0)
+    usec = 0;
+  if (usec < 50000)
+    return usec / 250;
+  if (usec < 500000)
+    return 200 + (usec - 50000) / 5000;
+  return LATENCY_BUCKETS - 1;
+}
+
+static int64_t bucket_limit(int b) {
+  if (b < 200)
+    return (b + 1) * 250;
+  if (b < LATENCY_BUCKETS - 1)
+    return 50000 + (b - 199) * 5000;
+  return 500000;
+}
+
+void latency_histogram::add(const frame_timing &t) {
+  int64_t usec[LATENCY_STAGES] = {
+      t.captured - t.presented, t.encode_start - t.captured,
+      t.encode_end - t.encode_start, t.written - t.encode_end,
+      t.acked - t.written, t.acked - t.presented};
+  for (int i = 0; i < LATENCY_STAGES; i++)
+    counts[slot][i][bucket(usec[i])]++;
+}
+
+void latency_histogram::rotate() {
+  slot = (slot + 1) % LATENCY_WINDOW;
+  memset(counts[slot], 0, sizeof(counts[slot]));
+}
+
+uint64_t latency_histogram::frames() const {
+  uint64_t n = 0;
+  for (int s = 0; s < LATENCY_WINDOW; s++)
+    for (int b = 0; b < LATENCY_BUCKETS; b++)
+      n += counts[s][LATENCY_TOTAL][b];
+  return n;
+}
+
+int64_t latency_histogram::percentile(latency_stage stage,
+                                      double fraction) const {
+  uint64_t sum[LATENCY_BUCKETS] = {};
+  uint64_t total = 0;
+  for (int s = 0; s < LATENCY_WINDOW; s++) {
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+      sum[b] += counts[s][stage][b];
+      total += counts[s][stage][b];
+    }
+  }
+  if (total == 0)
+    return 0;
+
+  uint64_t target = std::ceil(total * fraction);
+  uint64_t seen = 0;
+  for (int b = 0; b < LATENCY_BUCKETS; b++) {
+    seen += sum[b];
+    if (seen >= target)
+      return bucket_limit(b);
+  }
+  return bucket_limit(LATENCY_BUCKETS - 1);
+}
+
+void latency_histogram::print() const {
+  printf("[SERVER] Glass to glass %.2f ms p50, %.2f p95, %.2f p99 over %lu "
+         "frames |",
+         percentile(LATENCY_TOTAL, 0.5) / 1000.0,
+         percentile(LATENCY_TOTAL, 0.95) / 1000.0,
+         percentile(LATENCY_TOTAL, 0.99) / 1000.0, (unsigned long)frames());
+  for (int i = 0; i < LATENCY_TOTAL; i++) {
+    printf(" %s %.2f/%.2f", STAGE_NAMES[i],
+           percentile((latency_stage)i, 0.5) / 1000.0,
+           percentile((latency_stage)i, 0.95) / 1000.0);
+  }
+  printf(" ms (p50/p95)\n");
+}
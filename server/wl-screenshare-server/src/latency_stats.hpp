@@ -0,0 +1,50 @@
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#include <cstdint>
+
+// When a video frame went through each step, CLOCK_MONOTONIC microseconds
+struct frame_timing {
+  int64_t presented = 0; // shown by the compositor, 0 if unknown
+  int64_t captured = 0;  // copy done
+  int64_t encode_start = 0;
+  int64_t encode_end = 0; // packet handed over to the server
+  int64_t written = 0;    // last byte in the socket of the client
+  int64_t acked = 0;      // decoded by the receiver, as estimated from its ACK
+};
+
+enum latency_stage {
+  LATENCY_CAPTURE,  // presented -> captured
+  LATENCY_QUEUE,    // captured -> encode start
+  LATENCY_ENCODE,   // encode start -> encode end
+  LATENCY_SEND,     // encode end -> written, our queue and the pacing
+  LATENCY_DELIVERY, // written -> acked, network and decoding
+  LATENCY_TOTAL,    // presented -> acked, glass to glass
+  LATENCY_STAGES,
+};
+
+// 250us steps up to 50ms, then 5ms steps up to 500ms, then everything above
+#define LATENCY_BUCKETS 291
+// seconds the histogram covers
+#define LATENCY_WINDOW 10
+
+// Rolling histogram of the latency of the acknowledged frames, stage by
+// stage, over the last LATENCY_WINDOW seconds
+class latency_histogram {
+
+public:
+  void add(const frame_timing &timing);
+  // Starts a new second, forgetting the oldest one
+  void rotate();
+
+  uint64_t frames() const;
+  // Upper bound of the bucket holding the given fraction of the frames
+  int64_t percentile(latency_stage stage, double fraction) const;
+  void print() const;
+
+private:
+  uint32_t counts[LATENCY_WINDOW][LATENCY_STAGES][LATENCY_BUCKETS] = {};
+  int slot = 0;
+};
+
+#endif
@@ -8,6 +8,7 @@
 #include <cstdint>
 #include <cstdlib>
 #include <getopt.h>
+#include <poll.h>
 #include <list>
 #include <string>
 #include <sys/time.h>
@@ -30,6 +31,8 @@
 #include "wlr-screencopy-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-client-protocol.h"
 
+#include "src/dmabuf_pool.hpp"
+#include "src/pipeline_stats.hpp"
 #include "src/wl_registry.hpp"
 #include "src/xdg_output.hpp"
 #include "src/zwlr_screencopy.hpp"
@@ -49,15 +52,23 @@ void request_next_frame();
 
 static bool use_hwupload = false;
 
-static void wf_buffer_destroy(wf_buffer *buffer) {
-  zwp_linux_buffer_params_v1_destroy(buffer->params);
-  gbm_bo_destroy(buffer->bo);
-  munmap(buffer->data, buffer->size);
-  wl_buffer_destroy(buffer->wl_buffer);
-  buffer->wl_buffer = NULL;
-  close(buffer->bo_fd);
-  buffer->bo_fd = -1;
-  free(buffer);
+// frames the compositor is copying while the previous ones are encoded
+static int capture_depth = 2;
+
+// the encoder is done with a capture buffer
+static void release_capture_buffer(void *opaque, uint8_t *) {
+  buffer_pool.release((wf_buffer *)opaque);
+}
+
+// Damage that tells nothing, some compositors report the whole buffer for
+// every frame
+static bool whole_frame_damage(const wf_buffer *buffer) {
+  for (auto &r : buffer->damage) {
+    if (r.x <= 0 && r.y <= 0 && r.x + r.width >= buffer->width &&
+        r.y + r.height >= buffer->height)
+      return true;
+  }
+  return false;
 }
 
 static void write_loop() {
@@ -71,16 +82,65 @@ static void write_loop() {
   pthread_sigmask(SIG_BLOCK, &sigset, NULL);
 
   std::optional<uint64_t> first_frame_ts;
+  std::optional<uint64_t> last_frame_ts;
+  std::vector<damage_rect> skipped_damage;
+  pipeline_stats stats;
 
   while (!exit_main_loop) {
     if (exit_main_loop) {
       break;
     }
 
-    if (buffer_queue.empty())
+    // wakes up now and then to notice exit_main_loop
+    wf_buffer *buffer = nullptr;
+    if (!buffer_queue.pop(buffer, 100))
       continue;
 
-    wf_buffer *buffer = buffer_queue.pop();
+    // Without usable damage the pixels are compared tile by tile with the
+    // previous frame that was encoded, which makes up for lost and skipped
+    // frames too. Buffers in video memory can't be read cheaply.
+    bool lost = damage_lost.exchange(false);
+    bool hashed = !buffer->bo && (!use_damage || whole_frame_damage(buffer));
+
+    // nothing changed since the last encoded frame, clients keep showing it.
+    // With several frames in flight the compositor fills all of them from
+    // the same commit. What a skipped frame still reports is added to the
+    // next one, the encoder only converts what changed. A client waiting
+    // for a keyframe gets one from a frame that didn't change.
+    if (hashed) {
+      // with damage, the compositor sends nothing more until the screen
+      // changes again, every row has to be looked at
+      if (!frame_writer->find_damage((const uint8_t *)buffer->data,
+                                     buffer->damage, use_damage) &&
+          !server.keyframe_pending()) {
+        buffer_pool.release(buffer);
+        stats.frame_skipped();
+        continue;
+      }
+    } else if (use_damage && !lost && last_frame_ts.has_value() &&
+               !server.keyframe_pending() &&
+               (buffer->damage.empty() ||
+                buffer->base_usec == last_frame_ts)) {
+      skipped_damage.insert(skipped_damage.end(), buffer->damage.begin(),
+                            buffer->damage.end());
+      buffer_pool.release(buffer);
+      stats.frame_skipped();
+      continue;
+    }
+    last_frame_ts = buffer->base_usec;
+    if (hashed) {
+      // the hashes already cover what was skipped
+    } else if (lost && use_damage) {
+      buffer->damage = {{0, 0, buffer->width, buffer->height}};
+    } else {
+      buffer->damage.insert(buffer->damage.end(), skipped_damage.begin(),
+                            skipped_damage.end());
+    }
+    skipped_damage.clear();
+
+    int64_t start_usec = monotonic_usec();
+    stats.add(STAGE_CAPTURE, buffer->ready_usec - (int64_t)buffer->base_usec);
+    stats.add(STAGE_QUEUE, start_usec - buffer->ready_usec);
 
     uint64_t sync_timestamp = 0;
     if (first_frame_ts.has_value()) {
@@ -90,15 +150,38 @@ static void write_loop() {
       first_frame_ts = buffer->base_usec;
     }
 
-    bool do_cont = frame_writer->add_frame(buffer->bo, buffer->bo_fd,
-                                           sync_timestamp, buffer->y_invert);
-    wf_buffer_destroy(buffer);
+    frame_timing timing;
+    timing.presented = buffer->base_usec;
+    timing.captured = buffer->ready_usec;
+    timing.encode_start = start_usec;
+    server.set_frame_timing(sync_timestamp, timing);
+
+    bool do_cont;
+    // the pixels are read from the mapping (or the VAAPI surface imported
+    // from the bo), the buffer goes back to the pool once the encoder has
+    // let go of them
+    if (buffer->bo) {
+      do_cont = frame_writer->add_frame(
+          buffer->bo, buffer->bo_fd, sync_timestamp, buffer->y_invert,
+          buffer->damage, release_capture_buffer, buffer);
+    } else {
+      do_cont = frame_writer->add_frame(
+          (const uint8_t *)buffer->data, sync_timestamp, buffer->y_invert,
+          buffer->damage, release_capture_buffer, buffer);
+    }
+
+    int64_t end_usec = monotonic_usec();
+    stats.add(STAGE_ENCODE, end_usec - start_usec);
+    stats.frame_done(end_usec);
 
     if (!do_cont) {
       break;
     }
   }
 
+  wf_buffer *buffer;
+  while (buffer_queue.try_pop(buffer))
+    buffer_pool.release(buffer);
   frame_writer = nullptr;
 }
 
@@ -135,6 +218,11 @@ static void check_has_protos() {
     exit(EXIT_FAILURE);
   }
 
+  if (!use_dmabuf && shm == NULL) {
+    fprintf(stderr, "compositor doesn't support wl_shm\n");
+    exit(EXIT_FAILURE);
+  }
+
   if (available_outputs.empty()) {
     fprintf(stderr, "no outputs available\n");
     exit(EXIT_FAILURE);
@@ -248,12 +336,22 @@ Use Ctrl+C to stop.)");
   --no-dmabuf               By default, wf-recorder will try to use only GPU buffers and copies if
                             using a GPU encoder. However, this can cause issues on some systems. In such
                             cases, this option will disable the GPU copy and force a CPU one.
+                            Software encoders always capture into shared memory buffers which
+                            they read in place, libx264 and libx265 use a thread per core.
 
   -D, --no-damage           By default, wf-recorder will request a new frame from the compositor
                             only when the screen updates. This results in a much smaller output
                             file, which however has a variable refresh rate. When this option is
                             on, wf-recorder does not use this optimization and continuously
                             records new frames, even if there are no updates on the screen.
+                            With damage on, frames that didn't change are not encoded again
+                            and the encoder is told which regions changed (libx264, libx265
+                            and VAAPI spend a few bits less on the rest, except on keyframes
+                            and with intra refresh). Software encoders only get
+                            those regions converted to YUV again. Without damage, or when the
+                            compositor reports the whole screen every time, frames captured to
+                            shared memory are compared with the previous one in 64x64 tiles
+                            instead.
 
   -f <filename>.ext         By using the -f option the output file will have the name :
                             filename.ext and the file format will be determined by provided
@@ -307,6 +405,88 @@ Use Ctrl+C to stop.)");
   
   -y, --overwrite           Force overwriting the output file without prompting.
 
+  -M, --max-clients         Maximum number of clients receiving the stream at the same time.
+                            Every packet is encoded once and sent to all of them. With the
+                            default of 1, a new connection replaces the current one.
+
+  -Z, --zerocopy            Send packets bigger than the given size in bytes (64KiB by default,
+                            mostly keyframes) with MSG_ZEROCOPY, avoiding the copy into the
+                            kernel. Only pays off with big packets and a capable NIC. The
+                            size is optional and has to be attached: -Z131072 or
+                            --zerocopy=131072.
+
+  -L, --latency-budget      Maximum time in ms a frame may wait in the send queues (ours and
+                            the kernel's) of a client. Past it, frames no other frame depends
+                            on are dropped, otherwise the client skips ahead to a new keyframe.
+                            Queue depth and drop statistics are printed every second.
+
+  -A, --abr                 Adapt the bitrate to the throughput and delay measured on the
+                            clients connections, as <min>:<max> or <max> in kbit/s. With --udp,
+                            to the throughput and loss in the RTCP receiver reports. Works with
+                            encoders that can change bitrate on the fly (libx264, nvenc).
+
+  -I, --intra-refresh       Refresh the picture with a moving column of intra blocks over the
+                            given number of frames (one second by default) instead of periodic
+                            keyframes, which are several times bigger than the other frames.
+                            IDRs are only encoded when a client joins or asks for one after an
+                            error. Needs an encoder with intra refresh (libx264, nvenc), others
+                            only stop sending periodic keyframes. With --abr, libx264 keeps
+                            every frame within the bitrate for a flat rate. The number of
+                            frames is optional and has to be attached: -I30 or
+                            --intra-refresh=30.
+
+  -S, --slices              Split every frame in the given number of slices, encoded in
+                            parallel (libx264 switches to sliced threads without lookahead,
+                            nvenc and VA-API only split). A frame is ready as soon as its
+                            slices are, instead of after several frames in a threaded encoder,
+                            which cuts the latency at high resolutions. Over --udp a lost
+                            packet then only breaks one slice.
+
+  -j, --convert-threads     Threads converting the captured RGB frames to YUV for software
+                            encoders, each one converting a horizontal stripe of every frame
+                            (one per core up to 8 by default, 1 converts on the encoding
+                            thread). They can be pinned to CPUs, as <threads>:<cpu list>,
+                            e.g. 8:0-7 or 4:0,2,4,6. The time of every stripe is printed
+                            every second.
+
+  -Q, --capture-depth       Number of frames requested from the compositor at the same time
+                            (1 to 3, default 2). With more than one, the next frame is copied
+                            while the previous one is encoded, for a higher frame rate at the
+                            cost of some latency. The time frames spend being captured, queued
+                            and encoded is printed every second.
+
+  -U, --udp                 Stream RTP over UDP instead of accepting TCP connections. Receivers
+                            register with an RTCP hello and echo the cookie they get back, then
+                            keep sending receiver reports. Lost packets are retransmitted when
+                            they send NACKs and a PLI forces a keyframe. Better suited to lossy
+                            links (Wi-Fi) than TCP, audio isn't sent.
+
+  -E, --fec                 With --udp, protect keyframes with one ULP FEC packet (RFC 5109) for
+                            every given number of packets, up to 48, so a single loss in a group
+                            is repaired without waiting for a retransmission.
+
+  -G, --pacing              Spread every packet over the given share of the frame interval, in
+                            percent, instead of sending it at line rate. Keyframes then don't
+                            flood the Wi-Fi queues and delay the frames behind them. An upper
+                            rate in kbit/s can follow, as <percent>:<kbit/s>. Pacing is done by
+                            the kernel (best with the fq qdisc), receivers can change it for
+                            their own connection. The rate and bursts are printed every second.
+
+  -T, --tls-cert            Encrypt the stream with TLS 1.3, using the given PEM certificate
+                            chain and the key given with --tls-key. After the handshake the
+                            kernel (kTLS, modprobe tls) encrypts the records, so the send path
+                            stays the same as in plaintext. Without kTLS, OpenSSL encrypts in
+                            userspace. The CPU used per Mbit is printed every 5 seconds.
+                            Clients that don't finish the handshake in 5 seconds are dropped.
+                            Needs a build with OpenSSL 3 (meson option tls).
+
+  -k, --tls-key             PEM private key of the --tls-cert certificate.
+
+  -s, --local-socket        Also hand the stream to readers on this host through shared memory:
+                            they connect to the given Unix socket and map a ring the packets
+                            are written to once, instead of getting them copied through TCP
+                            loopback. Any number of readers, next to the network clients.
+
 Examples:)");
 #ifdef HAVE_AUDIO
   printf(R"(
@@ -342,6 +522,41 @@ Examples:)");
   exit(EXIT_SUCCESS);
 }
 
+// wl_display_dispatch(), also woken up by a capture buffer coming back to
+// the pool while frames wait for one
+static bool dispatch_wayland() {
+  while (wl_display_prepare_read(display) != 0) {
+    if (wl_display_dispatch_pending(display) == -1)
+      return false;
+  }
+  wl_display_flush(display);
+
+  struct pollfd fds[2] = {{wl_display_get_fd(display), POLLIN, 0},
+                          {buffer_pool.wakeup_fd(), POLLIN, 0}};
+  if (poll(fds, 2, -1) < 0) {
+    wl_display_cancel_read(display);
+    return false;
+  }
+  if (fds[0].revents & POLLIN) {
+    if (wl_display_read_events(display) == -1)
+      return false;
+  } else {
+    wl_display_cancel_read(display);
+    // the compositor went away
+    if (fds[0].revents & (POLLERR | POLLHUP))
+      return false;
+  }
+  if (wl_display_dispatch_pending(display) == -1)
+    return false;
+
+  if (fds[1].revents & POLLIN) {
+    buffer_pool.drain_wakeup();
+    frames_in_flight -= frames_starved;
+    frames_starved = 0;
+  }
+  return true;
+}
+
 capture_region selected_region{};
 wf_recorder_output *chosen_output = nullptr;
 
@@ -360,8 +575,9 @@ void request_next_frame() {
         selected_region.height);
   }
 
-  wf_buffer *buffer = new wf_buffer;
-  zwlr_screencopy_frame_v1_add_listener(frame, &frame_listener, buffer);
+  // the buffer is picked from the pool once the frame format is known
+  zwlr_screencopy_frame_v1_add_listener(frame, &frame_listener, NULL);
+  frames_in_flight++;
 }
 
 static void parse_codec_opts(std::map<std::string, std::string> &options,
@@ -390,6 +606,7 @@ int main(int argc, char *argv[]) {
   std::string cmdline_output = default_cmdline_output;
   bool force_no_dmabuf = false;
   bool force_overwrite = false;
+  ServerParams server_params;
 
   struct option opts[] = {{"output", required_argument, NULL, 'o'},
                           {"file", required_argument, NULL, 'f'},
@@ -415,12 +632,26 @@ int main(int argc, char *argv[]) {
                           {"version", no_argument, NULL, 'v'},
                           {"no-damage", no_argument, NULL, 'D'},
                           {"overwrite", no_argument, NULL, 'y'},
+                          {"max-clients", required_argument, NULL, 'M'},
+                          {"zerocopy", optional_argument, NULL, 'Z'},
+                          {"latency-budget", required_argument, NULL, 'L'},
+                          {"abr", required_argument, NULL, 'A'},
+                          {"intra-refresh", optional_argument, NULL, 'I'},
+                          {"slices", required_argument, NULL, 'S'},
+                          {"convert-threads", required_argument, NULL, 'j'},
+                          {"capture-depth", required_argument, NULL, 'Q'},
+                          {"udp", no_argument, NULL, 'U'},
+                          {"fec", required_argument, NULL, 'E'},
+                          {"pacing", required_argument, NULL, 'G'},
+                          {"tls-cert", required_argument, NULL, 'T'},
+                          {"tls-key", required_argument, NULL, 'k'},
+                          {"local-socket", required_argument, NULL, 's'},
                           {0, 0, NULL, 0}};
 
   int c, i;
-  while (
-      (c = getopt_long(argc, argv, "o:f:m:g:c:p:r:x:C:P:R:X:d:b:B:la::hvDF:y",
-                       opts, &i)) != -1) {
+  while ((c = getopt_long(argc, argv,
+                          "o:f:m:g:c:p:r:x:C:P:R:X:d:b:B:la::hvDF:yM:Z::L:A:I::S:j:Q:UE:G:T:k:s:",
+                          opts, &i)) != -1) {
     switch (c) {
     case 'f':
       params.file = optarg;
@@ -513,6 +744,102 @@ int main(int argc, char *argv[]) {
       force_overwrite = true;
       break;
 
+    case 'M':
+      server_params.max_clients = atoi(optarg);
+      if (server_params.max_clients < 1)
+        server_params.max_clients = 1;
+      break;
+
+    case 'Z':
+      server_params.zerocopy_threshold = optarg ? atoi(optarg) : 64 * 1024;
+      break;
+
+    case 'L':
+      server_params.latency_budget_ms = atoi(optarg);
+      break;
+
+    case 'A':
+      if (sscanf(optarg, "%d:%d", &params.abr_min_bitrate,
+                 &params.abr_max_bitrate) != 2) {
+        params.abr_max_bitrate = atoi(optarg);
+        params.abr_min_bitrate = params.abr_max_bitrate / 10;
+      }
+      server_params.track_transport = params.abr_max_bitrate > 0;
+      break;
+
+    case 'I':
+      params.intra_refresh = optarg ? atoi(optarg) : -1;
+      if (optarg && params.intra_refresh <= 0) {
+        fprintf(stderr, "Intra refresh period must be a number of frames\n");
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'S':
+      params.slices = atoi(optarg);
+      if (params.slices < 1) {
+        fprintf(stderr, "Slices must be a positive number\n");
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'j': {
+      const char *cpus = strchr(optarg, ':');
+      params.convert_threads = atoi(optarg);
+      if (params.convert_threads < 1 ||
+          (cpus && !parse_cpu_list(cpus + 1, params.convert_cpus))) {
+        fprintf(stderr, "Conversion threads must be <threads>[:<cpu list>]\n");
+        return EXIT_FAILURE;
+      }
+      break;
+    }
+
+    case 'Q':
+      capture_depth = atoi(optarg);
+      if (capture_depth < 1 || capture_depth > MAX_CAPTURE_DEPTH) {
+        fprintf(stderr, "Capture depth must be between 1 and %d\n",
+                MAX_CAPTURE_DEPTH);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'U':
+      server_params.udp = true;
+      break;
+
+    case 'E':
+      server_params.fec_group = atoi(optarg);
+      if (server_params.fec_group < 0 ||
+          server_params.fec_group > FEC_MAX_GROUP) {
+        fprintf(stderr, "FEC group must be between 0 and %d packets\n",
+                FEC_MAX_GROUP);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'G': {
+      unsigned long kbps = 0;
+      if (sscanf(optarg, "%d:%lu", &server_params.pacing_pct, &kbps) < 1 ||
+          server_params.pacing_pct < 0 || server_params.pacing_pct > 100) {
+        fprintf(stderr, "Pacing must be a percentage of the frame interval\n");
+        return EXIT_FAILURE;
+      }
+      server_params.max_pacing_rate = (uint64_t)kbps * 1000 / 8;
+      break;
+    }
+
+    case 'T':
+      server_params.tls_cert = optarg;
+      break;
+
+    case 'k':
+      server_params.tls_key = optarg;
+      break;
+
+    case 's':
+      server_params.local_socket = optarg;
+      break;
+
     case '*':
       break;
 
@@ -521,6 +848,15 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  if (server_params.tls_cert.empty() != server_params.tls_key.empty()) {
+    fprintf(stderr, "TLS needs both --tls-cert and --tls-key\n");
+    return EXIT_FAILURE;
+  }
+  if (server_params.udp && !server_params.tls_cert.empty()) {
+    fprintf(stderr, "TLS is only available over TCP\n");
+    return EXIT_FAILURE;
+  }
+
   if (!force_overwrite && !user_specified_overwrite(params.file)) {
     return EXIT_FAILURE;
   }
@@ -590,8 +926,6 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  printf("SO DMA BUF %d\n", use_dmabuf);
-
   check_has_protos();
   load_output_info();
 
@@ -648,45 +982,33 @@ int main(int argc, char *argv[]) {
     signal(signo, handle_graceful_termination);
   }
 
-  assert(use_dmabuf);
+  // the server accepts clients on its own thread, frames are captured
+  // and encoded whether or not someone is connected
+  server_params.hevc = params.codec.find("265") != std::string::npos ||
+                       params.codec.find("hevc") != std::string::npos;
+  server.init_server(server_params);
 
   writer_thread = std::thread([=]() { write_loop(); });
 
-  int fps = 0;
-  struct timeval tp;
-  gettimeofday(&tp, NULL);
-  long int prev_ms = tp.tv_sec * 1000 + tp.tv_usec / 1000;
-
   while (!exit_main_loop) {
-    can_read_buffer = false;
-    request_next_frame();
+    // keep capture_depth frames in flight, the compositor copies the next
+    // ones while the previous are being encoded
+    while (frames_in_flight < capture_depth)
+      request_next_frame();
 
-    while (!can_read_buffer && !exit_main_loop &&
-           wl_display_dispatch(display) != -1) {
-      std::this_thread::sleep_for(std::chrono::microseconds(10));
-    }
-
-    if (exit_main_loop) {
+    if (!dispatch_wayland()) {
+      exit_main_loop = true;
       break;
     }
-
-    struct timeval tp;
-    gettimeofday(&tp, NULL);
-    long int ms = tp.tv_sec * 1000 + tp.tv_usec / 1000;
-
-    fps++;
-
-    if (ms - prev_ms >= 1000) {
-      printf("FPS %d\n", fps);
-      fps = 0;
-      prev_ms = ms;
-    }
   }
 
   if (writer_thread.joinable()) {
     writer_thread.join();
   }
 
+  server.close_server();
+  buffer_pool.clear();
+
   if (gbm_device) {
     gbm_device_destroy(gbm_device);
     close(drm_fd);
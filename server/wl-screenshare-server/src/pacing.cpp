@@ -0,0 +1,59 @@
+#include "pacing.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <sys/socket.h>
+#include <time.h>
+
+// longer than a GOP, so the rate is still there for the next keyframe
+#define PACING_WINDOW_US 5000000
+// don't go through a setsockopt for changes smaller than this, in percent
+#define RATE_HYSTERESIS 10
+
+static int64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void packet_pacer::packet(int fd, size_t bytes, int64_t frame_interval_us) {
+  if (fraction_pct <= 0 || frame_interval_us <= 0)
+    return;
+
+  uint64_t needed =
+      bytes * 1000000 * 100 / (frame_interval_us * fraction_pct) + 1;
+  if (max_rate > 0)
+    needed = std::min(needed, max_rate);
+
+  if (last_bytes > 0 && bytes > last_bytes * 2) {
+    bursts++;
+    if (bytes > max_burst_bytes) {
+      max_burst_bytes = bytes;
+      max_burst_ms = bytes * 1000 / needed;
+    }
+  }
+  last_bytes = bytes;
+
+  int64_t now = now_us();
+  if (now - window_start > PACING_WINDOW_US) {
+    prev_window_max = window_max;
+    window_max = 0;
+    window_start = now;
+  }
+  window_max = std::max(window_max, needed);
+  uint64_t target = std::max(window_max, prev_window_max);
+
+  if (target > rate * (100 + RATE_HYSTERESIS) / 100 ||
+      target < rate * (100 - RATE_HYSTERESIS) / 100)
+    set_rate(fd, target);
+}
+
+bool packet_pacer::set_rate(int fd, uint64_t _rate) {
+  if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &_rate, sizeof(_rate)) <
+      0) {
+    perror("[SERVER] SO_MAX_PACING_RATE");
+    fraction_pct = 0;
+    return false;
+  }
+  rate = _rate;
+  return true;
+}
@@ -0,0 +1,37 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Spreads every packet over a share of the frame interval instead of
+// letting it leave at line rate: a keyframe 10-50x bigger than the other
+// frames otherwise floods the Wi-Fi queues and delays the frames behind it.
+//
+// The kernel does the pacing (SO_MAX_PACING_RATE, enforced by the fq qdisc
+// or by TCP itself). The rate follows the biggest packet of the last few
+// seconds rather than every packet: lowering it applies at once, but TCP
+// only climbs back up with the ACKs, too late for the next keyframe.
+class packet_pacer {
+public:
+  int fraction_pct = 0;  // share of the frame interval, 0 disables pacing
+  uint64_t max_rate = 0; // bytes per second, 0 for no limit
+
+  // Picks the rate for a packet about to be queued on the socket
+  void packet(int fd, size_t bytes, int64_t frame_interval_us);
+
+  uint64_t rate = 0;          // current pacing rate, bytes per second
+  uint64_t bursts = 0;        // packets more than twice the previous one
+  size_t max_burst_bytes = 0; // biggest one since the last report
+  int max_burst_ms = 0;       // and the time it is spread over
+
+private:
+  bool set_rate(int fd, uint64_t rate);
+
+  // windowed maximum of the rate the packets needed
+  uint64_t window_max = 0, prev_window_max = 0;
+  int64_t window_start = 0;
+  size_t last_bytes = 0;
+};
+
+#endif
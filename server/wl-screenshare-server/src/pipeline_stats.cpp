@@ -0,0 +1,39 @@
+#include "pipeline_stats.hpp"
+#include <algorithm>
+#include <stdio.h>
+#include <time.h>
+
+static const char *STAGE_NAMES[STAGE_COUNT] = {"capture", "queue", "encode"};
+
+int64_t monotonic_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void pipeline_stats::add(pipeline_stage stage, int64_t usec) {
+  usec = std::max<int64_t>(usec, 0);
+  stages[stage].total += usec;
+  stages[stage].max = std::max(stages[stage].max, usec);
+}
+
+void pipeline_stats::frame_done(int64_t now_usec) {
+  frames++;
+  if (last_report == 0)
+    last_report = now_usec;
+  if (now_usec - last_report < 1000000)
+    return;
+
+  printf("FPS %d |", frames);
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    printf(" %s %.1f/%.1f ms", STAGE_NAMES[i],
+           stages[i].total / 1000.0 / frames, stages[i].max / 1000.0);
+    stages[i] = stage_time();
+  }
+  printf(" (avg/max)");
+  if (skipped > 0)
+    printf(", %d unchanged skipped", skipped);
+  printf("\n");
+  frames = skipped = 0;
+  last_report = now_usec;
+}
@@ -0,0 +1,38 @@
+#ifndef PIPELINE_STATS_H
+#define PIPELINE_STATS_H
+
+#include <cstdint>
+
+enum pipeline_stage {
+  STAGE_CAPTURE, // presented by the compositor -> copy done
+  STAGE_QUEUE,   // copy done -> picked up by the encoder
+  STAGE_ENCODE,  // filtering, encoding and handing over to the server
+  STAGE_COUNT,
+};
+
+// Where the time of each frame goes, printed every second so the effect of
+// the capture depth on latency and frame rate can be seen
+class pipeline_stats {
+
+public:
+  void add(pipeline_stage stage, int64_t usec);
+  // Counts a frame through the whole pipeline, reports once per second
+  void frame_done(int64_t now_usec);
+  // A frame not encoded because nothing changed
+  void frame_skipped() { skipped++; }
+
+private:
+  struct stage_time {
+    int64_t total = 0;
+    int64_t max = 0;
+  };
+
+  stage_time stages[STAGE_COUNT];
+  int frames = 0;
+  int skipped = 0;
+  int64_t last_report = 0;
+};
+
+int64_t monotonic_usec();
+
+#endif
@@ -0,0 +1,789 @@
+// Headless receiver: connects to wl-screenshare-server like the Android app
+// does, decodes in software and prints statistics as JSON, one line per
+// interval. Several clients can be simulated to load the fan-out.
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "config.h"
+#ifdef HAVE_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#else
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+#endif
+
+#include "src/shm_transport.hpp"
+#include "src/udp_transport.hpp"
+#include "src/wire_header.hpp"
+
+// same limit as the Android app
+#define MAX_PACKET_SIZE (1920 * 1080)
+// a frame arriving this much later than its pts says counts as late
+#define LATE_FRAME_US 50000
+
+static std::atomic<bool> exit_main_loop{false};
+
+static int64_t monotonic_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct receiver_params {
+  std::string address = "127.0.0.1";
+  int port = 53516;
+  int clients = 1;
+  int duration = 0; // seconds, 0 runs until the server goes away
+  int interval = 1; // seconds between reports
+  std::string codec = "h264";
+  bool decode = true;
+  bool feedback = true; // send ACKs, reports and pings back
+  bool tls = false;
+  std::string tls_ca; // verify the server against it, if set
+  // pacing asked for this connection, 0 keeps the server setting
+  int pacing_pct = 0;
+  uint32_t pacing_kbps = 0;
+  // read the shared memory ring of the server behind this socket instead
+  std::string local_socket;
+  // RTP over UDP, for a server started with --udp
+  bool udp = false;
+  double loss_pct = 0; // simulated, on the incoming datagrams
+};
+
+// Counters of one report interval
+struct receiver_stats {
+  uint64_t packets = 0;
+  uint64_t bytes = 0;
+  uint64_t received = 0; // video frames
+  uint64_t frames = 0;   // decoded
+  uint64_t keyframes = 0;
+  uint64_t lost = 0; // seq gaps, dropped by the server
+  uint64_t decode_errors = 0;
+  uint64_t late_frames = 0;
+  // RTP only
+  uint64_t nacked = 0;
+  uint64_t recovered = 0;
+  int64_t decode_us_sum = 0;
+  int64_t decode_us_max = 0;
+  int64_t interarrival_us_max = 0;
+  // video frame sizes, to compare how flat the bitrate is
+  uint64_t frame_bytes = 0;
+  double frame_bytes_sq = 0;
+  uint64_t frame_bytes_max = 0;
+
+  void add(const receiver_stats &o) {
+    packets += o.packets;
+    bytes += o.bytes;
+    received += o.received;
+    frames += o.frames;
+    keyframes += o.keyframes;
+    lost += o.lost;
+    decode_errors += o.decode_errors;
+    late_frames += o.late_frames;
+    nacked += o.nacked;
+    recovered += o.recovered;
+    decode_us_sum += o.decode_us_sum;
+    decode_us_max = std::max(decode_us_max, o.decode_us_max);
+    interarrival_us_max = std::max(interarrival_us_max, o.interarrival_us_max);
+    frame_bytes += o.frame_bytes;
+    frame_bytes_sq += o.frame_bytes_sq;
+    frame_bytes_max = std::max(frame_bytes_max, o.frame_bytes_max);
+  }
+
+  double frame_kb_avg() const {
+    return received > 0 ? frame_bytes / 1000.0 / received : 0.0;
+  }
+  double frame_kb_stddev() const {
+    if (received == 0)
+      return 0.0;
+    double avg = frame_kb_avg();
+    return std::sqrt(
+        std::max(0.0, frame_bytes_sq / 1e6 / received - avg * avg));
+  }
+};
+
+class receiver_client {
+
+public:
+  receiver_client(const receiver_params &params, SSL_CTX *tls_ctx, int id);
+  ~receiver_client();
+
+  bool start();
+  void stop();
+  void join();
+
+  // Moves the interval counters out, or returns the ones of the whole run
+  receiver_stats take_stats(bool whole_run);
+  double jitter_ms();
+  uint32_t rtt_us() const { return rtt; }
+  bool connected() const { return running; }
+  int get_id() const { return id; }
+
+private:
+  void run();
+  void run_local();
+  void run_udp();
+  bool read_full(uint8_t *data, size_t size);
+  void handle_packet(const wire_header &wire, uint8_t *data);
+  void decode(const wire_header &wire, uint8_t *data);
+  void send_control(uint8_t type, uint16_t depth, uint32_t seq, int64_t time);
+
+  const receiver_params &params;
+  SSL_CTX *tls_ctx;
+  SSL *ssl = nullptr;
+  int id;
+  int fd = -1;
+  std::thread thread;
+  std::atomic<bool> running{false};
+  std::atomic<bool> stopping{false};
+  shm_reader shm;
+  udp_receiver udp;
+  uint32_t udp_seq = 0;
+
+  const AVCodec *codec = nullptr;
+  AVCodecContext *dec_ctx = nullptr;
+  AVPacket *pkt = nullptr;
+  AVFrame *frame = nullptr;
+
+  std::mutex stats_mutex;
+  receiver_stats stats, total;
+  double jitter_us = 0; // RFC 3550 interarrival jitter, against the pts
+
+  int64_t last_seq = -1;
+  int64_t last_arrival = -1, last_pts = 0;
+  int64_t last_ping = 0;
+  uint32_t lost_total = 0;
+  std::atomic<uint32_t> rtt{0};
+  bool keyframe_asked = false;
+};
+
+receiver_client::receiver_client(const receiver_params &_params,
+                                 SSL_CTX *_tls_ctx, int _id)
+    : params(_params), tls_ctx(_tls_ctx), id(_id) {}
+
+receiver_client::~receiver_client() {
+  join();
+#ifdef HAVE_TLS
+  if (ssl)
+    SSL_free(ssl);
+#endif
+  if (fd >= 0)
+    close(fd);
+  avcodec_free_context(&dec_ctx);
+  av_packet_free(&pkt);
+  av_frame_free(&frame);
+}
+
+bool receiver_client::start() {
+  if (params.decode) {
+    codec = avcodec_find_decoder_by_name(params.codec.c_str());
+    if (!codec) {
+      fprintf(stderr, "Unknown decoder %s\n", params.codec.c_str());
+      return false;
+    }
+    dec_ctx = avcodec_alloc_context3(codec);
+    // one thread per client, they are meant to be many
+    dec_ctx->thread_count = params.clients > 1 ? 1 : 0;
+    dec_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    if (avcodec_open2(dec_ctx, codec, NULL) < 0) {
+      fprintf(stderr, "Failed to open decoder %s\n", params.codec.c_str());
+      return false;
+    }
+    pkt = av_packet_alloc();
+    frame = av_frame_alloc();
+  }
+
+  if (!params.local_socket.empty()) {
+    if (!shm.connect(params.local_socket))
+      return false;
+    running = true;
+    thread = std::thread([this]() { run_local(); });
+    return true;
+  }
+
+  if (params.udp) {
+    if (!udp.connect(params.address, params.port,
+                     params.codec.find("hevc") != std::string::npos))
+      return false;
+    if (params.loss_pct > 0) {
+      // per client, so that they don't all lose the same packets
+      uint32_t state = 0x9e3779b9u * (id + 1);
+      double loss = params.loss_pct / 100;
+      udp.drop = [state, loss](const uint8_t *, size_t) mutable {
+        state = state * 1664525 + 1013904223;
+        return (state >> 8) < loss * (1 << 24);
+      };
+    }
+    running = true;
+    thread = std::thread([this]() { run_udp(); });
+    return true;
+  }
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  std::string port = std::to_string(params.port);
+  if (getaddrinfo(params.address.c_str(), port.c_str(), &hints, &res) != 0) {
+    fprintf(stderr, "Can't resolve %s\n", params.address.c_str());
+    return false;
+  }
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+    fprintf(stderr, "Client %d can't connect to %s:%d: %s\n", id,
+            params.address.c_str(), params.port, strerror(errno));
+    freeaddrinfo(res);
+    return false;
+  }
+  freeaddrinfo(res);
+
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+#ifdef HAVE_TLS
+  if (tls_ctx) {
+    ssl = SSL_new(tls_ctx);
+    SSL_set_fd(ssl, fd);
+    SSL_set_tlsext_host_name(ssl, params.address.c_str());
+    if (SSL_connect(ssl) != 1) {
+      fprintf(stderr, "Client %d: TLS handshake failed\n", id);
+      ERR_print_errors_fp(stderr);
+      return false;
+    }
+  }
+#endif
+
+  if (params.pacing_pct > 0 || params.pacing_kbps > 0)
+    send_control(CONTROL_PACING, params.pacing_pct, params.pacing_kbps, 0);
+
+  running = true;
+  thread = std::thread([this]() { run(); });
+  return true;
+}
+
+void receiver_client::stop() {
+  stopping = true;
+  // wakes the thread up from recv
+  if (fd >= 0)
+    shutdown(fd, SHUT_RDWR);
+}
+
+void receiver_client::join() {
+  if (thread.joinable())
+    thread.join();
+}
+
+receiver_stats receiver_client::take_stats(bool whole_run) {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  receiver_stats s = stats;
+  total.add(stats);
+  stats = receiver_stats();
+  return whole_run ? total : s;
+}
+
+double receiver_client::jitter_ms() {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  return jitter_us / 1000.0;
+}
+
+bool receiver_client::read_full(uint8_t *data, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+#ifdef HAVE_TLS
+    ssize_t m = ssl ? SSL_read(ssl, data + done, size - done)
+                    : recv(fd, data + done, size - done, 0);
+#else
+    ssize_t m = recv(fd, data + done, size - done, 0);
+#endif
+    if (m < 0 && errno == EINTR)
+      continue;
+    if (m <= 0)
+      return false;
+    done += m;
+  }
+  return true;
+}
+
+void receiver_client::run() {
+  std::vector<uint8_t> data(MAX_PACKET_SIZE + AV_INPUT_BUFFER_PADDING_SIZE);
+  uint8_t header[WIRE_HEADER_SIZE];
+  while (true) {
+    if (!read_full(header, sizeof(header)))
+      break;
+    wire_header wire;
+    if (!wire_header_read(header, wire)) {
+      fprintf(stderr, "Client %d: unsupported protocol version %d\n", id,
+              wire.version);
+      break;
+    }
+    if (wire.size > MAX_PACKET_SIZE) {
+      fprintf(stderr, "Client %d: invalid size %u\n", id, wire.size);
+      break;
+    }
+    if (!read_full(data.data(), wire.size))
+      break;
+    memset(data.data() + wire.size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    handle_packet(wire, data.data());
+  }
+  running = false;
+}
+
+// The packets are used in place, only the decoder gets a copy: it wants
+// zeroed padding after the data
+void receiver_client::run_local() {
+  std::vector<uint8_t> data(MAX_PACKET_SIZE + AV_INPUT_BUFFER_PADDING_SIZE);
+  while (!stopping) {
+    wire_header wire;
+    const uint8_t *payload;
+    shm_result r = shm.next(wire, payload, 100);
+    if (r == SHM_CLOSED)
+      break;
+    if (r == SHM_TIMEOUT)
+      continue;
+    if (r == SHM_PACKET && params.decode && wire.size <= MAX_PACKET_SIZE) {
+      memcpy(data.data(), payload, wire.size);
+      if (shm.valid()) {
+        memset(data.data() + wire.size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+        handle_packet(wire, data.data());
+        continue;
+      }
+    } else if (r == SHM_PACKET && !params.decode) {
+      handle_packet(wire, const_cast<uint8_t *>(payload));
+      if (shm.valid())
+        continue;
+    }
+    // overwritten before we got to it, start over from a keyframe
+    if (!keyframe_asked) {
+      keyframe_asked = true;
+      send_control(CONTROL_KEYFRAME_REQUEST, 0, 0, 0);
+    }
+  }
+  running = false;
+}
+
+// Access units are numbered as they come out of the jitter buffer, the
+// frames given up on leave a gap in the seq like on TCP
+void receiver_client::run_udp() {
+  std::vector<uint8_t> data;
+  udp_frame frame;
+  while (!stopping) {
+    if (!udp.poll(20))
+      break;
+    while (udp.next_frame(frame)) {
+      wire_header wire;
+      wire.stream = WIRE_STREAM_VIDEO;
+      wire.size = frame.data.size();
+      wire.pts = frame.pts;
+      wire.flags = frame.keyframe ? WIRE_FLAG_KEYFRAME : 0;
+      udp_seq += frame.dropped;
+      wire.seq = udp_seq++;
+      data.resize(frame.data.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+      memcpy(data.data(), frame.data.data(), frame.data.size());
+      memset(data.data() + wire.size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+      handle_packet(wire, data.data());
+    }
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    stats.nacked += udp.stats.nacked;
+    stats.recovered += udp.stats.recovered;
+    udp.stats.nacked = udp.stats.recovered = 0;
+  }
+  running = false;
+}
+
+void receiver_client::handle_packet(const wire_header &wire, uint8_t *data) {
+  int64_t now = monotonic_usec();
+
+  if (wire.stream == WIRE_STREAM_CONTROL) {
+    control_message msg;
+    if (wire.size == CONTROL_MESSAGE_SIZE &&
+        control_message_read(data, msg) && msg.type == CONTROL_PONG)
+      rtt = now - msg.time;
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    stats.packets++;
+    stats.bytes += WIRE_HEADER_SIZE + wire.size;
+  }
+  if (wire.stream != WIRE_STREAM_VIDEO)
+    return;
+
+  if (!(wire.flags & WIRE_FLAG_CONFIG)) {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    if (last_seq >= 0 && wire.seq != (uint32_t)(last_seq + 1)) {
+      uint32_t gap = wire.seq - (uint32_t)last_seq - 1;
+      stats.lost += gap;
+      lost_total += gap;
+    }
+    last_seq = wire.seq;
+    stats.received++;
+    stats.frame_bytes += wire.size;
+    stats.frame_bytes_sq += (double)wire.size * wire.size;
+    stats.frame_bytes_max =
+        std::max<uint64_t>(stats.frame_bytes_max, wire.size);
+
+    if (last_arrival >= 0) {
+      int64_t arrival = now - last_arrival;
+      int64_t d = arrival - (wire.pts - last_pts);
+      jitter_us += (std::abs(d) - jitter_us) / 16;
+      stats.interarrival_us_max = std::max(stats.interarrival_us_max, arrival);
+      if (d > LATE_FRAME_US)
+        stats.late_frames++;
+    }
+    last_arrival = now;
+    last_pts = wire.pts;
+    if (wire.flags & WIRE_FLAG_KEYFRAME) {
+      stats.keyframes++;
+      keyframe_asked = false;
+    }
+  }
+
+  if (params.decode)
+    decode(wire, data);
+  else if (!(wire.flags & WIRE_FLAG_CONFIG))
+    send_control(CONTROL_ACK, 0, wire.seq, wire.pts);
+
+  if (params.feedback && now - last_ping >= 1000000) {
+    last_ping = now;
+    send_control(CONTROL_REPORT, 0, lost_total, rtt);
+    send_control(CONTROL_PING, 0, 0, now);
+  }
+}
+
+void receiver_client::decode(const wire_header &wire, uint8_t *data) {
+  pkt->data = data;
+  pkt->size = wire.size;
+  pkt->pts = wire.pts;
+
+  int64_t start = monotonic_usec();
+  int ret = avcodec_send_packet(dec_ctx, pkt);
+  int decoded = 0;
+  while (ret >= 0) {
+    ret = avcodec_receive_frame(dec_ctx, frame);
+    if (ret < 0)
+      break;
+    decoded++;
+    av_frame_unref(frame);
+  }
+  int64_t elapsed = monotonic_usec() - start;
+  bool failed = ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF;
+
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    stats.frames += decoded;
+    if (decoded > 0) {
+      stats.decode_us_sum += elapsed;
+      stats.decode_us_max = std::max(stats.decode_us_max, elapsed);
+    }
+    if (failed)
+      stats.decode_errors++;
+  }
+
+  if (failed && !keyframe_asked) {
+    keyframe_asked = true;
+    send_control(CONTROL_KEYFRAME_REQUEST, 0, 0, 0);
+  } else if (decoded > 0 && !(wire.flags & WIRE_FLAG_CONFIG)) {
+    send_control(CONTROL_ACK, 0, wire.seq, wire.pts);
+  }
+}
+
+void receiver_client::send_control(uint8_t type, uint16_t depth, uint32_t seq,
+                                   int64_t time) {
+  if (!params.feedback)
+    return;
+  if (params.udp) {
+    // RTCP has no ACKs or pings, the receiver reports go out on their own
+    if (type == CONTROL_KEYFRAME_REQUEST)
+      udp.request_keyframe();
+    return;
+  }
+  control_message msg;
+  msg.type = type;
+  msg.depth = depth;
+  msg.seq = seq;
+  msg.time = time;
+  uint8_t data[CONTROL_MESSAGE_SIZE];
+  control_message_write(msg, data);
+  int out = params.local_socket.empty() ? fd : shm.socket_fd();
+#ifdef HAVE_TLS
+  if (ssl) {
+    SSL_write(ssl, data, sizeof(data));
+    return;
+  }
+#endif
+  if (send(out, data, sizeof(data), MSG_NOSIGNAL) < 0 && errno != EPIPE)
+    perror("send control");
+}
+
+static void print_report(std::vector<receiver_client *> &clients,
+                         double seconds, int64_t elapsed_us, bool final) {
+  printf("{\"time\": %.3f, \"final\": %s, \"clients\": [",
+         elapsed_us / 1000000.0, final ? "true" : "false");
+  for (size_t i = 0; i < clients.size(); i++) {
+    receiver_client *c = clients[i];
+    receiver_stats s = c->take_stats(final);
+    printf("%s{\"id\": %d, \"connected\": %s, \"recv_fps\": %.1f, "
+           "\"fps\": %.1f, "
+           "\"bitrate_kbps\": %.1f, \"packets\": %lu, \"keyframes\": %lu, "
+           "\"lost\": %lu, \"decode_errors\": %lu, "
+           "\"decode_ms_avg\": %.2f, \"decode_ms_max\": %.2f, "
+           "\"jitter_ms\": %.2f, \"interarrival_ms_max\": %.2f, "
+           "\"late_frames\": %lu, \"nacked\": %lu, \"fec_recovered\": %lu, "
+           "\"frame_kb_avg\": %.2f, "
+           "\"frame_kb_stddev\": %.2f, \"frame_kb_max\": %.2f, "
+           "\"rtt_ms\": %.2f}",
+           i > 0 ? ", " : "", c->get_id(), c->connected() ? "true" : "false",
+           s.received / seconds, s.frames / seconds,
+           s.bytes * 8 / seconds / 1000,
+           (unsigned long)s.packets, (unsigned long)s.keyframes,
+           (unsigned long)s.lost, (unsigned long)s.decode_errors,
+           s.frames > 0 ? s.decode_us_sum / 1000.0 / s.frames : 0.0,
+           s.decode_us_max / 1000.0, c->jitter_ms(),
+           s.interarrival_us_max / 1000.0, (unsigned long)s.late_frames,
+           (unsigned long)s.nacked, (unsigned long)s.recovered,
+           s.frame_kb_avg(), s.frame_kb_stddev(), s.frame_bytes_max / 1000.0,
+           c->rtt_us() / 1000.0);
+  }
+  printf("]}\n");
+  fflush(stdout);
+}
+
+static void help() {
+  printf(R"(Usage: wl-screenshare-receiver [OPTION]...
+
+Connects to wl-screenshare-server, decodes the stream in software and prints
+statistics as one JSON object per interval on stdout.
+
+  -a, --address             Server address (127.0.0.1 by default).
+
+  -p, --port                Server port (53516 by default).
+
+  -n, --clients             Number of simulated clients, each with its own
+                            connection and decoder. The server has to be started
+                            with a --max-clients at least as big.
+
+  -t, --duration            Stop after the given number of seconds. By default the
+                            receiver runs until every connection is closed.
+
+  -i, --interval            Seconds between two reports (1 by default).
+
+  -c, --codec               Decoder to use (h264 by default, hevc for H.265).
+
+  -N, --no-decode           Only receive, for fan-out tests with many clients.
+
+  -F, --no-feedback         Don't send ACKs, reports, pings and keyframe requests
+                            back to the server.
+
+  -r, --pacing              Ask the server to pace this connection over the given share of
+                            the frame interval, in percent, optionally up to a rate in
+                            kbit/s: <percent>:<kbit/s>.
+
+  -s, --tls                 Connect with TLS 1.3, for a server started with --tls-cert.
+                            The certificate isn't checked unless --tls-ca is given.
+
+  -C, --tls-ca              PEM certificate(s) to verify the server with.
+
+  -l, --local               Read the shared memory ring of a server started with
+                            --local-socket, through the given Unix socket, instead of
+                            connecting over TCP.
+
+  -u, --udp                 Receive RTP over UDP from a server started with --udp. Lost
+                            packets are repaired from the FEC or asked again with NACKs,
+                            frames that can't be repaired in time are skipped up to the
+                            next keyframe.
+
+  -L, --loss                With --udp, drop the given percentage of the incoming
+                            datagrams, to see how the stream copes with loss.
+
+  -h, --help                Prints this help screen.
+
+Every report has, per client: received and decoded fps, bitrate, packets,
+keyframes, frames lost (sequence gaps), decode errors, decode time (avg/max),
+interarrival jitter against the pts (RFC 3550), the longest interarrival time,
+frames later than 50 ms, the size of the video frames (avg/stddev/max) and the
+RTT measured with pings. Over UDP there are no pings, the packets asked again
+and the ones rebuilt from the FEC are counted instead. The last report, with "final": true, covers the whole
+run.
+)");
+  exit(EXIT_SUCCESS);
+}
+
+static void handle_termination(int) { exit_main_loop = true; }
+
+int main(int argc, char *argv[]) {
+  receiver_params params;
+
+  struct option opts[] = {{"address", required_argument, NULL, 'a'},
+                          {"port", required_argument, NULL, 'p'},
+                          {"clients", required_argument, NULL, 'n'},
+                          {"duration", required_argument, NULL, 't'},
+                          {"interval", required_argument, NULL, 'i'},
+                          {"codec", required_argument, NULL, 'c'},
+                          {"no-decode", no_argument, NULL, 'N'},
+                          {"no-feedback", no_argument, NULL, 'F'},
+                          {"pacing", required_argument, NULL, 'r'},
+                          {"tls", no_argument, NULL, 's'},
+                          {"tls-ca", required_argument, NULL, 'C'},
+                          {"local", required_argument, NULL, 'l'},
+                          {"udp", no_argument, NULL, 'u'},
+                          {"loss", required_argument, NULL, 'L'},
+                          {"help", no_argument, NULL, 'h'},
+                          {0, 0, NULL, 0}};
+
+  int c, i;
+  while ((c = getopt_long(argc, argv, "a:p:n:t:i:c:NFr:sC:l:uL:h", opts,
+                          &i)) != -1) {
+    switch (c) {
+    case 'a':
+      params.address = optarg;
+      break;
+    case 'p':
+      params.port = atoi(optarg);
+      break;
+    case 'n':
+      params.clients = std::max(1, atoi(optarg));
+      break;
+    case 't':
+      params.duration = atoi(optarg);
+      break;
+    case 'i':
+      params.interval = std::max(1, atoi(optarg));
+      break;
+    case 'c':
+      params.codec = optarg;
+      break;
+    case 'N':
+      params.decode = false;
+      break;
+    case 'F':
+      params.feedback = false;
+      break;
+    case 'r':
+      sscanf(optarg, "%d:%u", &params.pacing_pct, &params.pacing_kbps);
+      break;
+    case 's':
+      params.tls = true;
+      break;
+    case 'C':
+      params.tls = true;
+      params.tls_ca = optarg;
+      break;
+    case 'l':
+      params.local_socket = optarg;
+      break;
+    case 'u':
+      params.udp = true;
+      break;
+    case 'L':
+      params.loss_pct = atof(optarg);
+      break;
+    case 'h':
+      help();
+      break;
+    default:
+      printf("Unsupported command line argument %s\n", optarg);
+    }
+  }
+
+  signal(SIGINT, handle_termination);
+  signal(SIGTERM, handle_termination);
+  signal(SIGPIPE, SIG_IGN);
+
+  SSL_CTX *tls_ctx = nullptr;
+  if (params.tls) {
+#ifdef HAVE_TLS
+    tls_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_3_VERSION);
+    if (!params.tls_ca.empty()) {
+      if (SSL_CTX_load_verify_locations(tls_ctx, params.tls_ca.c_str(),
+                                        NULL) != 1) {
+        fprintf(stderr, "Can't load %s\n", params.tls_ca.c_str());
+        return EXIT_FAILURE;
+      }
+      SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+    }
+#else
+    fprintf(stderr, "Built without OpenSSL, TLS is not available\n");
+    return EXIT_FAILURE;
+#endif
+  }
+
+  std::vector<receiver_client *> clients;
+  for (int n = 0; n < params.clients; n++) {
+    receiver_client *client = new receiver_client(params, tls_ctx, n);
+    if (!client->start()) {
+      delete client;
+      continue;
+    }
+    clients.push_back(client);
+  }
+  if (clients.empty())
+    return EXIT_FAILURE;
+  if (params.local_socket.empty())
+    fprintf(stderr, "%zu clients connected to %s:%d\n", clients.size(),
+            params.address.c_str(), params.port);
+  else
+    fprintf(stderr, "%zu clients reading %s\n", clients.size(),
+            params.local_socket.c_str());
+
+  int64_t start = monotonic_usec();
+  int64_t last_report = start;
+  while (!exit_main_loop) {
+    usleep(100000);
+    int64_t now = monotonic_usec();
+    bool any = std::any_of(clients.begin(), clients.end(),
+                           [](receiver_client *c) { return c->connected(); });
+    if (!any ||
+        (params.duration > 0 && now - start >= params.duration * 1000000LL))
+      break;
+    if (now - last_report >= params.interval * 1000000LL) {
+      print_report(clients, (now - last_report) / 1000000.0, now - start,
+                   false);
+      last_report = now;
+    }
+  }
+
+  for (receiver_client *client : clients)
+    client->stop();
+  for (receiver_client *client : clients)
+    client->join();
+
+  // the final report covers the whole run
+  int64_t now = monotonic_usec();
+  print_report(clients, std::max(now - start, (int64_t)1) / 1000000.0,
+               now - start, true);
+
+  for (receiver_client *client : clients)
+    delete client;
+#ifdef HAVE_TLS
+  if (tls_ctx)
+    SSL_CTX_free(tls_ctx);
+#endif
+  return EXIT_SUCCESS;
+}
@@ -4,114 +4,1023 @@
 #include <cstdio>
 #include <cstring>
 #include <errno.h>
+#include <linux/errqueue.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#define MAX_EVENTS 16
+// header and payload of up to 32 packets per sendmsg
+#define MAX_IOV 64
+// network thread CPU usage report
+#define CPU_REPORT_USEC 5000000
+// glass to glass latency report
+#define LATENCY_REPORT_USEC 5000000
+// how far the pts of a packet may be from the one of the frame it came
+// from, when the filters change the timestamps
+#define PTS_MATCH_USEC 100000
+// a client that hasn't finished the TLS handshake by then is dropped, it
+// would hold one of the max_clients slots forever
+#define TLS_HANDSHAKE_USEC 5000000
+
+static int64_t monotonic_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 Server::Server() {}
 
-void Server::init_server() {
-  if (s_socket != -1)
+Server::~Server() { close_server(); }
+
+void Server::init_server(const ServerParams &_params) {
+  if (running)
     return;
+  params = _params;
   printf("[SERVER] Init\n");
 
-  printf("[SERVER] SOCKET mode\n");
+  if (params.udp) {
+    printf("[SERVER] RTP/UDP mode\n");
+    udp_params up;
+    up.port = params.port;
+    up.max_peers = params.max_clients;
+    up.hevc = params.hevc;
+    up.fec_group = params.fec_group;
+    u_socket = udp.init(up);
+  } else {
+    printf("[SERVER] SOCKET mode\n");
+
+    if (!params.tls_cert.empty() && !tls.enabled()) {
+      if (!tls.init(params.tls_cert, params.tls_key))
+        exit(-1);
+      printf("[SERVER] TLS 1.3 enabled\n");
+    }
+
+    s_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s_socket < 0) {
+      perror("[SERVER] create socket");
+      exit(-1);
+    }
+
+    int reuse = 1;
+    setsockopt(s_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
-  s_socket = socket(AF_INET, SOCK_STREAM, 0);
-  if (s_socket >= 0) {
     struct sockaddr_in saAddr;
     memset(&saAddr, 0, sizeof(saAddr));
     saAddr.sin_family = AF_INET;
     saAddr.sin_addr.s_addr = htonl(0); // (IPADDR_ANY)
-    saAddr.sin_port = htons(port);
-
-    if ((bind(s_socket, (struct sockaddr *)&saAddr, sizeof(saAddr)) == 0) &&
-        (listen(s_socket, 10) == 0)) {
-      memset(&saAddr, 0, sizeof(saAddr));
-      socklen_t len = sizeof(saAddr);
-      c_socket = accept(s_socket, (struct sockaddr *)&saAddr, &len);
-      // setting timeout
-      struct timeval tv;
-      tv.tv_sec = 1;
-      tv.tv_usec = 0;
-      setsockopt(c_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv,
-                 sizeof tv);
-
-      if (c_socket >= 0) {
-        printf("[SERVER] Connection %d - %d\n", s_socket, c_socket);
-      } else {
-        perror("[SERVER] no connection");
-      }
-    } else {
+    saAddr.sin_port = htons(params.port);
+
+    if ((bind(s_socket, (struct sockaddr *)&saAddr, sizeof(saAddr)) != 0) ||
+        (listen(s_socket, 10) != 0)) {
       perror("[SERVER] cant bind");
       exit(-1);
     }
-  } else {
-    perror("[SERVER] create socket");
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd < 0 || wake_fd < 0) {
+    perror("[SERVER] epoll");
     exit(-1);
   }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = params.udp ? u_socket : s_socket;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+  ev.data.fd = wake_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+  if (!params.local_socket.empty()) {
+    if (!shm.init(params.local_socket, params.local_ring_size, epoll_fd))
+      exit(-1);
+    // extradata cached before a restart
+    if (header.data)
+      shm.publish(header.header, header.data.get(), header.size, false, true);
+  }
+
+  running = true;
+  loop_thread = std::thread([this]() { event_loop(); });
+  printf("[SERVER] Listening on port %d (max %d clients)\n", params.port,
+         params.max_clients);
 }
 
 void Server::close_server() {
+  if (!running)
+    return;
   printf("[SERVER] Closing\n");
-  shutdown(s_socket, SHUT_RDWR);
-  shutdown(c_socket, SHUT_RDWR);
-  close(s_socket);
-  close(c_socket);
+  running = false;
+  wake();
+  if (loop_thread.joinable())
+    loop_thread.join();
+
+  while (!clients.empty())
+    drop_client(clients.begin()->first);
+  server_packet pkt;
+  while (pending.try_pop(pkt))
+    ;
+  if (s_socket >= 0) {
+    shutdown(s_socket, SHUT_RDWR);
+    close(s_socket);
+  }
+  udp.close();
+  u_socket = -1;
+  shm.close();
+  close(wake_fd);
+  close(epoll_fd);
+  s_socket = wake_fd = epoll_fd = -1;
   printf("[SERVER] Closed\n");
 }
 
 void Server::restart_server() {
   printf("[SERVER] Restarting\n");
   close_server();
-  sleep(1);
   printf("[SERVER] Reconnecting\n");
-  init_server();
+  init_server(params);
 }
 
+// The codec extradata is cached and sent to every client right before
+// the first keyframe it receives
 void Server::send_header_server(uint8_t *data, uint32_t size) {
-  return;
+  if (!running || data == nullptr || size == 0)
+    return;
   printf("[SERVER] header (%d)\n", size);
-  send_data(data, size);
 
-  printf("[SERVER] HEADER SENT\n");
+  std::shared_ptr<uint8_t> copy(new uint8_t[size],
+                                std::default_delete<uint8_t[]>());
+  memcpy(copy.get(), data, size);
+  wire_header wire;
+  wire.flags = WIRE_FLAG_CONFIG;
+  server_packet pkt = make_packet(copy, size, wire);
+  pkt.config = true;
+  pending.push(pkt);
+  wake();
 }
 
-// assuming 32 bit for an int
-int32_t Server::send_data(uint8_t *data, uint32_t size) {
-  init_server();
-  if (c_socket == -1 || data == nullptr || size == 0)
+// For callers that don't hold a reference counted buffer: the data is copied
+int32_t Server::send_data(uint8_t *data, uint32_t size, uint32_t flags,
+                          int64_t pts, uint8_t stream) {
+  if (!running || data == nullptr || size <= 3)
     return -1;
-  if (size <= 3)
+  if (n_clients == 0)
+    return 0;
+
+  std::shared_ptr<uint8_t> copy(new uint8_t[size],
+                                std::default_delete<uint8_t[]>());
+  memcpy(copy.get(), data, size);
+  return send_data(std::shared_ptr<const uint8_t>(copy), size, flags, pts,
+                   stream);
+}
+
+// Called from the encoder thread: never blocks, the packet is handed over
+// to the event loop which fans it out
+int32_t Server::send_data(std::shared_ptr<const uint8_t> data, uint32_t size,
+                          uint32_t flags, int64_t pts, uint8_t stream) {
+  if (!running || data == nullptr || size == 0)
     return -1;
-  int32_t m = -1;
-  uint8_t bsize[] = {(uint8_t)((size >> 24) & 0xff),
-                     (uint8_t)((size >> 16) & 0xff),
-                     (uint8_t)((size >> 8) & 0xff), (uint8_t)((size) & 0xff)};
-  if ((m = send(c_socket, bsize, 4 * sizeof(uint8_t), 0)) < 0) {
-    printf("The last error message is: %s\n", strerror(errno));
-    printf("[SERVER] Can't send size from %d -> %d\n", c_socket, m);
+  if (size <= 3)
     return -1;
+  // nobody to send it to, don't let packets pile up
+  if (n_clients == 0 || stream >= WIRE_STREAM_COUNT)
+    return 0;
+
+  wire_header wire;
+  wire.stream = stream;
+  wire.seq = next_seq[stream]++;
+  wire.pts = pts;
+  if (flags & PACKET_KEYFRAME)
+    wire.flags |= WIRE_FLAG_KEYFRAME;
+  if (flags & PACKET_DISPOSABLE)
+    wire.flags |= WIRE_FLAG_DISPOSABLE;
+
+  server_packet pkt = make_packet(std::move(data), size, wire);
+  if (stream == WIRE_STREAM_VIDEO)
+    pkt.timing = encoded_frame_timing(pts);
+  pkt.stream = stream;
+  pkt.pts = pts;
+  pkt.seq = wire.seq;
+  pkt.keyframe = flags & PACKET_KEYFRAME;
+  pkt.disposable = flags & PACKET_DISPOSABLE;
+  pending.push(pkt);
+  wake();
+  return size;
+}
+
+int Server::is_connected() { return n_clients > 0; }
+
+bool Server::keyframe_requested() { return need_keyframe.exchange(false); }
+
+void Server::set_frame_timing(int64_t pts, const frame_timing &timing) {
+  encoding_frame &frame = encoding[next_encoding++ % 64];
+  frame.pts = pts;
+  frame.timing = timing;
+}
+
+// The frame a packet was encoded from, the one with the closest pts
+frame_timing Server::encoded_frame_timing(int64_t pts) {
+  const encoding_frame *best = nullptr;
+  for (const encoding_frame &frame : encoding) {
+    if (frame.pts >= 0 && std::abs(frame.pts - pts) < PTS_MATCH_USEC &&
+        (!best || std::abs(frame.pts - pts) < std::abs(best->pts - pts)))
+      best = &frame;
   }
-  if ((m = send(c_socket, data, size * sizeof(uint8_t), 0)) < 0) {
-    printf("The last error message is: %s\n", strerror(errno));
-    printf("[SERVER] Can't send data from %d -> %d\n", c_socket, m);
-    return -1;
+  if (!best)
+    return frame_timing();
+  frame_timing timing = best->timing;
+  timing.encode_end = monotonic_usec();
+  return timing;
+}
+
+server_packet Server::make_packet(std::shared_ptr<const uint8_t> data,
+                                  uint32_t size, wire_header &wire) {
+  server_packet pkt;
+  pkt.data = std::move(data);
+  pkt.size = size;
+  wire.size = size;
+  wire_header_write(wire, pkt.header);
+  return pkt;
+}
+
+void Server::wake() {
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("[SERVER] wake");
+}
+
+void Server::event_loop() {
+  /* Signals are handled by the main thread */
+  sigset_t sigset;
+  sigfillset(&sigset);
+  pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+  struct epoll_event events[MAX_EVENTS];
+  struct timespec last_report;
+  clock_gettime(CLOCK_MONOTONIC, &last_report);
+  while (running) {
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("[SERVER] epoll_wait");
+      break;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > last_report.tv_sec) {
+      update_feedback();
+      expire_handshakes();
+      last_report = now;
+    }
+
+    for (int i = 0; i < n && running; i++) {
+      int fd = events[i].data.fd;
+      uint32_t ev = events[i].events;
+
+      if (fd == s_socket) {
+        accept_client();
+        continue;
+      }
+      if (fd == u_socket) {
+        // receiver reports, NACKs and PLIs
+        if (udp.handle_input())
+          need_keyframe = true;
+        count_clients();
+        continue;
+      }
+      if (shm.owns(fd)) {
+        // local readers joining, leaving or asking for a keyframe
+        if (shm.handle_event(fd, ev))
+          need_keyframe = true;
+        count_clients();
+        continue;
+      }
+      if (fd == wake_fd) {
+        uint64_t count;
+        while (read(wake_fd, &count, sizeof(count)) > 0)
+          ;
+        drain_pending();
+        continue;
+      }
+
+      auto it = clients.find(fd);
+      if (it == clients.end())
+        continue; // dropped earlier in this batch
+      server_client &client = it->second;
+
+      if (ev & EPOLLERR) {
+        // zerocopy completions are reported as errors too
+        reap_zerocopy(client);
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+          printf("[SERVER] Client %d error: %s\n", fd, strerror(err));
+          drop_client(fd);
+          continue;
+        }
+      }
+      if (ev & (EPOLLHUP | EPOLLRDHUP)) {
+        printf("[SERVER] Client %d disconnected\n", fd);
+        drop_client(fd);
+        continue;
+      }
+      if (client.handshaking) {
+        if (!handshake_client(client))
+          drop_client(fd);
+        continue;
+      }
+      if ((ev & EPOLLIN) && !read_client(client)) {
+        printf("[SERVER] Client %d disconnected\n", fd);
+        drop_client(fd);
+        continue;
+      }
+      if ((ev & EPOLLOUT) && !flush_client(client))
+        drop_client(fd);
+    }
   }
-  return m;
 }
 
-// assuming 32 bit for an int
-int32_t Server::recv_data(uint8_t **data, uint32_t size) {
-  int32_t m = -1;
-  if ((m = recv(c_socket, *data, size, 0)) < 0) {
-    printf("[SERVER] Can't recv data\n");
-    return -1;
+void Server::accept_client() {
+  struct sockaddr_in saAddr;
+  memset(&saAddr, 0, sizeof(saAddr));
+  socklen_t len = sizeof(saAddr);
+  int fd = accept4(s_socket, (struct sockaddr *)&saAddr, &len,
+                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      perror("[SERVER] no connection");
+    return;
+  }
+
+  SSL *ssl = nullptr;
+  if (tls.enabled()) {
+    ssl = tls.accept(fd);
+    if (!ssl) {
+      printf("[SERVER] Can't start a TLS session for %s\n",
+             inet_ntoa(saAddr.sin_addr));
+      close(fd);
+      return;
+    }
+  }
+
+  if ((int)clients.size() >= params.max_clients) {
+    if (params.max_clients == 1) {
+      // single connection: the newest client replaces the old one
+      printf("[SERVER] Replacing client %d\n", clients.begin()->first);
+      drop_client(clients.begin()->first);
+    } else {
+      printf("[SERVER] Too many clients, refusing %s\n",
+             inet_ntoa(saAddr.sin_addr));
+      if (ssl)
+        tls_server::free(ssl);
+      close(fd);
+      return;
+    }
+  }
+
+  server_client &client = clients[fd];
+  client.fd = fd;
+  client.congestion.latency_budget_ms = params.latency_budget_ms;
+  client.congestion.track = params.track_transport;
+  client.pacer.fraction_pct = params.pacing_pct;
+  client.pacer.max_rate = params.max_pacing_rate;
+
+  // packets are written whole with a single sendmsg, Nagle would only hold
+  // back the tail of a frame waiting for an ACK
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (ssl) {
+    // kTLS sockets don't take MSG_ZEROCOPY, the kernel copies while
+    // encrypting anyway
+    client.ssl = ssl;
+    client.handshaking = true;
+    client.accepted_usec = monotonic_usec();
+  } else if (params.zerocopy_threshold > 0) {
+    client.zerocopy =
+        setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    if (!client.zerocopy)
+      perror("[SERVER] SO_ZEROCOPY");
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  ev.data.fd = fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+  printf("[SERVER] Connection %d - %d (%s), %zu clients\n", s_socket, fd,
+         inet_ntoa(saAddr.sin_addr), clients.size());
+
+  count_clients();
+}
+
+void Server::drop_client(int fd) {
+  auto it = clients.find(fd);
+  if (it != clients.end() && it->second.ssl)
+    tls_server::free(it->second.ssl);
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  shutdown(fd, SHUT_RDWR);
+  close(fd);
+  clients.erase(fd);
+  count_clients();
+}
+
+// Drops the clients stuck in the TLS handshake, checked every second
+void Server::expire_handshakes() {
+  int64_t now = monotonic_usec();
+  std::vector<int> stale;
+  for (auto &it : clients) {
+    if (it.second.handshaking &&
+        now - it.second.accepted_usec >= TLS_HANDSHAKE_USEC)
+      stale.push_back(it.first);
+  }
+  for (int fd : stale) {
+    printf("[SERVER] Client %d: TLS handshake timed out\n", fd);
+    drop_client(fd);
   }
-  return m;
 }
 
-int Server::is_connected() { return c_socket != -1; }
+// Local readers get the packets too, whatever the network side does
+void Server::count_clients() {
+  int network = params.udp ? udp.peers() : (int)clients.size();
+  n_clients = network + shm.readers();
+}
+
+// Reads the control messages of the client, returns false on EOF or error
+bool Server::read_client(server_client &client) {
+  while (true) {
+    uint8_t buf[256];
+    ssize_t m;
+    if (client.ssl) {
+      int r = tls_server::read(client.ssl, buf, sizeof(buf));
+      if (r <= 0) {
+        tls_status status = tls_server::status(client.ssl, r);
+        return status == TLS_WANT_READ || status == TLS_WANT_WRITE;
+      }
+      m = r;
+    } else {
+      m = recv(client.fd, buf, sizeof(buf), 0);
+      if (m == 0)
+        return false;
+      if (m < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+
+    for (ssize_t i = 0; i < m; i++) {
+      client.rx[client.rx_size++] = buf[i];
+      if (client.rx_size < CONTROL_MESSAGE_SIZE)
+        continue;
+      client.rx_size = 0;
+      control_message msg;
+      if (!control_message_read(client.rx, msg)) {
+        printf("[SERVER] Client %d speaks protocol version %d\n", client.fd,
+               msg.version);
+        return false;
+      }
+      handle_control(client, msg);
+    }
+  }
+}
+
+void Server::handle_control(server_client &client,
+                            const control_message &msg) {
+  receiver_report &report = client.report;
+  switch (msg.type) {
+  case CONTROL_KEYFRAME_REQUEST:
+    // the decoder is showing garbage until the next keyframe, don't make
+    // it wait for the end of the GOP
+    report.keyframe_requests++;
+    if (client.synced)
+      need_keyframe = true;
+    break;
+  case CONTROL_REPORT:
+    report.reporting = true;
+    report.decode_queue = msg.depth;
+    report.lost = msg.seq;
+    report.rtt_us = msg.time;
+    break;
+  case CONTROL_ACK: {
+    int64_t now = monotonic_usec();
+    const sent_frame &sent = sent_frames[msg.seq % 256];
+    const sent_frame &written = client.written[msg.seq % 256];
+    if (sent.seq == msg.seq && sent.usec >= 0)
+      report.ack_latency_us = now - sent.usec;
+    if (sent.seq == msg.seq && written.seq == msg.seq && written.usec >= 0 &&
+        sent.timing.presented > 0) {
+      // the frame was decoded about half a round trip before its ACK got
+      // here
+      uint32_t rtt =
+          report.rtt_us ? report.rtt_us : client.congestion.last.rtt_us;
+      frame_timing timing = sent.timing;
+      timing.written = written.usec;
+      timing.acked = now - rtt / 2;
+      latency.add(timing);
+    }
+    report.acks++;
+    break;
+  }
+  case CONTROL_PACING:
+    client.pacer.fraction_pct = msg.depth ? msg.depth : params.pacing_pct;
+    client.pacer.max_rate =
+        msg.seq ? (uint64_t)msg.seq * 1000 / 8 : params.max_pacing_rate;
+    printf("[SERVER] Client %d: pacing over %d%% of a frame, up to %lu "
+           "kbit/s\n",
+           client.fd, client.pacer.fraction_pct,
+           (unsigned long)(client.pacer.max_rate * 8 / 1000));
+    break;
+  case CONTROL_PING: {
+    // echoed right away, ahead of anything not yet started
+    control_message pong = msg;
+    pong.type = CONTROL_PONG;
+    std::shared_ptr<uint8_t> data(new uint8_t[CONTROL_MESSAGE_SIZE],
+                                  std::default_delete<uint8_t[]>());
+    control_message_write(pong, data.get());
+    wire_header wire;
+    wire.stream = WIRE_STREAM_CONTROL;
+    server_packet pkt = make_packet(data, CONTROL_MESSAGE_SIZE, wire);
+    pkt.stream = WIRE_STREAM_CONTROL;
+    // a partially sent packet, or one OpenSSL must be handed again for a
+    // retried SSL_write, has to stay in front
+    auto pos = client.queue.begin();
+    if ((client.offset > 0 || client.tls_retry) && pos != client.queue.end())
+      ++pos;
+    client.queue.insert(pos, pkt);
+    client.queued_bytes += pkt.wire_size();
+    if (!client.blocked && !flush_client(client))
+      printf("[SERVER] Can't answer the ping of client %d\n", client.fd);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+void Server::drain_pending() {
+  server_packet pkt;
+  if (params.udp) {
+    // packetized and sent right away, loss is handled by the receivers
+    while (pending.try_pop(pkt)) {
+      shm.publish(pkt.header, pkt.data.get(), pkt.size, pkt.keyframe,
+                  pkt.config);
+      if (pkt.config)
+        udp.set_config(pkt.data.get(), pkt.size);
+      else if (pkt.stream == WIRE_STREAM_VIDEO &&
+               udp.send_frame(pkt.data.get(), pkt.size, pkt.pts,
+                              pkt.keyframe))
+        need_keyframe = true;
+    }
+    return;
+  }
+  while (pending.try_pop(pkt)) {
+    shm.publish(pkt.header, pkt.data.get(), pkt.size, pkt.keyframe,
+                pkt.config);
+    if (pkt.config) {
+      // new codec parameters, everyone has to start over from a keyframe
+      header = pkt;
+      for (auto &it : clients)
+        resync_client(it.second);
+      continue;
+    }
+    if (pkt.stream == WIRE_STREAM_VIDEO) {
+      sent_frames[pkt.seq % 256] = {pkt.seq, monotonic_usec(), pkt.timing};
+      int64_t interval = pkt.pts - last_video_pts;
+      if (last_video_pts >= 0 && interval > 0 && interval < 1000000)
+        frame_interval_us = (frame_interval_us * 7 + interval) / 8;
+      last_video_pts = pkt.pts;
+    }
+    for (auto &it : clients)
+      queue_packet(it.second, pkt);
+  }
+
+  std::vector<int> dropped;
+  for (auto &it : clients) {
+    if (!it.second.blocked && !flush_client(it.second))
+      dropped.push_back(it.first);
+  }
+  for (int fd : dropped)
+    drop_client(fd);
+}
+
+void Server::queue_packet(server_client &client, const server_packet &pkt) {
+  if (client.handshaking)
+    return;
+
+  bool late = client.congestion.over_budget(
+      client.fd, client.queued_bytes + pkt.wire_size());
+
+  if (client.synced &&
+      client.queued_bytes + pkt.wire_size() > params.max_queued_bytes) {
+    printf("[SERVER] Client %d is too slow (%zu bytes queued), resyncing\n",
+           client.fd, client.queued_bytes);
+    resync_client(client);
+  } else if (client.synced && late) {
+    // nothing depends on it, losing it costs a frame of smoothness
+    if (pkt.disposable) {
+      client.congestion.frames_dropped++;
+      return;
+    }
+    // anything else breaks the references of what comes next: skip ahead
+    printf("[SERVER] Client %d is %d ms behind, skipping to a keyframe\n",
+           client.fd, client.congestion.queued_ms);
+    client.congestion.skips++;
+    resync_client(client);
+  }
+
+  if (!client.synced) {
+    // other streams follow once the video is in sync
+    if (pkt.stream != WIRE_STREAM_VIDEO)
+      return;
+    if (late) {
+      // let the socket drain before asking for a (big) keyframe
+      client.congestion.frames_dropped++;
+      return;
+    }
+    if (!pkt.keyframe) {
+      // ask for a keyframe instead of waiting for the end of the GOP
+      if (!client.keyframe_asked) {
+        need_keyframe = true;
+        client.keyframe_asked = true;
+      }
+      return;
+    }
+    if (header.data) {
+      client.queue.push_back(header);
+      client.queued_bytes += header.wire_size();
+    }
+    client.synced = true;
+    client.keyframe_asked = false;
+  }
+
+  if (pkt.stream == WIRE_STREAM_VIDEO)
+    client.pacer.packet(client.fd, pkt.wire_size(), frame_interval_us);
+  client.queue.push_back(pkt);
+  client.queued_bytes += pkt.wire_size();
+}
+
+// Throws away everything that hasn't started going out yet and holds the
+// client until the next keyframe
+void Server::resync_client(server_client &client) {
+  // a partially sent packet must be completed to keep the framing intact
+  size_t keep = client.offset > 0 || client.tls_retry ? 1 : 0;
+  while (client.queue.size() > keep) {
+    client.queued_bytes -= client.queue.back().wire_size();
+    client.queue.pop_back();
+    client.congestion.frames_dropped++;
+  }
+  client.synced = false;
+  client.keyframe_asked = false;
+}
+
+static void add_iov(struct iovec *iov, int &n_iov, const uint8_t *data,
+                    size_t size, size_t &skip) {
+  if (skip >= size) {
+    skip -= size;
+    return;
+  }
+  iov[n_iov].iov_base = (void *)(data + skip);
+  iov[n_iov].iov_len = size - skip;
+  n_iov++;
+  skip = 0;
+}
+
+// Writes as many queued packets as the socket takes, length prefixes and
+// payloads gathered into one sendmsg. Returns false if the client has to be
+// dropped.
+bool Server::flush_client(server_client &client) {
+  if (client.ssl && !client.ktls)
+    return flush_tls(client);
+
+  while (!client.queue.empty()) {
+    const server_packet &front = client.queue.front();
+    // zerocopy packets go alone, their completion is tracked per call
+    bool zerocopy =
+        client.zerocopy && front.size >= params.zerocopy_threshold;
+    const uint8_t *header = front.header;
+    if (zerocopy) {
+      // deque::push_back keeps references to the other elements valid
+      zerocopy_buffer zc;
+      zc.seq = client.zerocopy_seq;
+      zc.data = front.data;
+      memcpy(zc.header, front.header, sizeof(zc.header));
+      client.zerocopy_pending.push_back(zc);
+      header = client.zerocopy_pending.back().header;
+    }
+
+    struct iovec iov[MAX_IOV];
+    int n_iov = 0;
+    size_t skip = client.offset;
+    for (const server_packet &pkt : client.queue) {
+      if (n_iov + 2 > MAX_IOV)
+        break;
+      if (&pkt != &front &&
+          (zerocopy ||
+           (client.zerocopy && pkt.size >= params.zerocopy_threshold)))
+        break;
+      add_iov(iov, n_iov, &pkt == &front ? header : pkt.header,
+              sizeof(pkt.header), skip);
+      add_iov(iov, n_iov, pkt.data.get(), pkt.size, skip);
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n_iov;
+    ssize_t m = sendmsg(client.fd, &msg,
+                        MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+    if (zerocopy) {
+      // only calls that sent something get a completion
+      if (m > 0)
+        client.zerocopy_seq++;
+      else
+        client.zerocopy_pending.pop_back();
+    }
+    if (m < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+        // the kernel buffer is full (or out of zerocopy memory), wait for
+        // EPOLLOUT
+        if (!client.blocked) {
+          client.blocked = true;
+          watch_client(client, true);
+        }
+        return true;
+      }
+      printf("The last error message is: %s\n", strerror(errno));
+      printf("[SERVER] Can't send data from %d -> %zd\n", client.fd, m);
+      return false;
+    }
+
+    client.congestion.bytes_sent += m;
+    bytes_sent += m;
+
+    // short writes leave the offset in the middle of a packet
+    size_t sent = m;
+    while (sent > 0) {
+      size_t left = client.queue.front().wire_size() - client.offset;
+      if (sent < left) {
+        client.offset += sent;
+        break;
+      }
+      sent -= left;
+      packet_written(client, client.queue.front());
+      client.queued_bytes -= client.queue.front().wire_size();
+      client.queue.pop_front();
+      client.offset = 0;
+    }
+  }
+  if (client.blocked) {
+    client.blocked = false;
+    watch_client(client, false);
+  }
+  return true;
+}
+
+void Server::packet_written(server_client &client, const server_packet &pkt) {
+  if (pkt.stream == WIRE_STREAM_VIDEO && !pkt.config)
+    client.written[pkt.seq % 256] = {pkt.seq, monotonic_usec(), {}};
+}
+
+// Without kTLS every piece goes through SSL_write: one record for the header
+// and at least one for the payload, encrypted in userspace
+bool Server::flush_tls(server_client &client) {
+  while (!client.queue.empty()) {
+    const server_packet &front = client.queue.front();
+    const uint8_t *data;
+    size_t left;
+    if (client.offset < sizeof(front.header)) {
+      data = front.header + client.offset;
+      left = sizeof(front.header) - client.offset;
+    } else {
+      data = front.data.get() + client.offset - sizeof(front.header);
+      left = front.wire_size() - client.offset;
+    }
+
+    int m = tls_server::write(client.ssl, data, left);
+    if (m <= 0) {
+      tls_status status = tls_server::status(client.ssl, m);
+      if (status == TLS_WANT_WRITE || status == TLS_WANT_READ) {
+        // the same bytes have to be written again
+        client.tls_retry = true;
+        if (!client.blocked) {
+          client.blocked = true;
+          watch_client(client, true);
+        }
+        return true;
+      }
+      printf("[SERVER] Can't send data to %d over TLS\n", client.fd);
+      return false;
+    }
+    client.tls_retry = false;
+    client.congestion.bytes_sent += m;
+    bytes_sent += m;
+
+    client.offset += m;
+    if (client.offset == front.wire_size()) {
+      packet_written(client, front);
+      client.queued_bytes -= front.wire_size();
+      client.queue.pop_front();
+      client.offset = 0;
+    }
+  }
+  if (client.blocked) {
+    client.blocked = false;
+    watch_client(client, false);
+  }
+  return true;
+}
+
+// Drives the handshake of a new TLS client, returns false if it failed
+bool Server::handshake_client(server_client &client) {
+  switch (tls_server::handshake(client.ssl)) {
+  case TLS_WANT_READ:
+    watch_client(client, false);
+    return true;
+  case TLS_WANT_WRITE:
+    watch_client(client, true);
+    return true;
+  case TLS_FAILED:
+    printf("[SERVER] Client %d: TLS handshake failed\n", client.fd);
+    return false;
+  case TLS_DONE:
+    break;
+  }
+
+  client.handshaking = false;
+  client.ktls = tls_server::kernel_send(client.ssl);
+  printf("[SERVER] Client %d: %s, %s\n", client.fd,
+         tls_server::describe(client.ssl).c_str(),
+         client.ktls ? "encrypted by the kernel"
+                     : "no kTLS, encrypting in userspace");
+  watch_client(client, false);
+  // control messages may have come with the end of the handshake
+  return read_client(client);
+}
+
+// Releases the payloads the kernel is done with
+void Server::reap_zerocopy(server_client &client) {
+  while (true) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(client.fd, &msg, MSG_ERRQUEUE) < 0)
+      return;
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+        continue;
+      struct sock_extended_err *serr =
+          (struct sock_extended_err *)CMSG_DATA(cm);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      // calls ee_info..ee_data (inclusive) are complete
+      uint32_t lo = serr->ee_info, hi = serr->ee_data;
+      auto &zc = client.zerocopy_pending;
+      while (!zc.empty() && zc.front().seq - lo <= hi - lo)
+        zc.pop_front();
+
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED && client.zerocopy) {
+        // e.g. loopback or a NIC without scatter-gather: the kernel copies
+        // anyway, and a deferred copy costs more than a plain send
+        printf("[SERVER] Client %d: zerocopy falls back to copies, "
+               "disabling it\n",
+               client.fd);
+        client.zerocopy = false;
+      }
+    }
+  }
+}
+
+bool Server::get_feedback(transport_feedback &fb) {
+  std::lock_guard<std::mutex> lock(feedback_mutex);
+  fb = feedback;
+  return fb.clients > 0 && fb.throughput > 0;
+}
+
+void Server::update_feedback() {
+  // what the encryption (or the lack of it) costs this thread
+  struct timespec cpu;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+  int64_t cpu_usec = (int64_t)cpu.tv_sec * 1000000 + cpu.tv_nsec / 1000;
+  int64_t now_usec = monotonic_usec();
+  if (now_usec - report_usec >= CPU_REPORT_USEC) {
+    uint64_t bytes = bytes_sent - report_bytes;
+    if (bytes > 0 && report_usec > 0) {
+      double mbit = bytes * 8 / 1e6;
+      printf("[SERVER] %.1f Mbit/s, %.1f%% CPU, %.0f us CPU per Mbit (%s)\n",
+             mbit * 1e6 / (now_usec - report_usec),
+             (cpu_usec - report_cpu_usec) * 100.0 / (now_usec - report_usec),
+             (cpu_usec - report_cpu_usec) / mbit,
+             tls.enabled() ? "TLS" : "plaintext");
+    }
+    report_bytes = bytes_sent;
+    report_cpu_usec = cpu_usec;
+    report_usec = now_usec;
+  }
+
+  latency.rotate();
+  if (now_usec - latency_report_usec >= LATENCY_REPORT_USEC) {
+    if (latency.frames() > 0)
+      latency.print();
+    latency_report_usec = now_usec;
+  }
+
+  if (params.udp) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    udp.update((int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+    count_clients();
+    // no queue or RTT to look at, the receivers report what they lost
+    transport_feedback fb;
+    fb.clients = udp.feedback(fb.throughput, fb.fraction_lost);
+    std::lock_guard<std::mutex> lock(feedback_mutex);
+    feedback = fb;
+    return;
+  }
+  transport_feedback fb;
+  for (auto &it : clients) {
+    congestion_control &cc = it.second.congestion;
+    if (!it.second.synced || cc.throughput == 0)
+      continue;
+    fb.clients++;
+    if (fb.throughput == 0 || cc.throughput < fb.throughput)
+      fb.throughput = cc.throughput;
+    if (cc.queued_ms > fb.queued_ms)
+      fb.queued_ms = cc.queued_ms;
+    if (cc.last.rtt_us > fb.rtt_us)
+      fb.rtt_us = cc.last.rtt_us;
+    if (cc.last.rtt_us - cc.min_rtt_us > fb.queuing_delay_us)
+      fb.queuing_delay_us = cc.last.rtt_us - cc.min_rtt_us;
+    const receiver_report &report = it.second.report;
+    if (report.decode_queue > fb.decode_queue)
+      fb.decode_queue = report.decode_queue;
+    if (report.ack_latency_us > fb.ack_latency_us)
+      fb.ack_latency_us = report.ack_latency_us;
+  }
+  {
+    std::lock_guard<std::mutex> lock(feedback_mutex);
+    feedback = fb;
+  }
+
+  for (auto &it : clients) {
+    congestion_control &cc = it.second.congestion;
+    if (cc.latency_budget_ms <= 0)
+      continue;
+    printf("[SERVER] Client %d: queue %zu B (max %zu B), kernel %u B, ~%d ms, "
+           "drain %lu kB/s, rtt %u us, %lu frames dropped, %lu skips\n",
+           it.first, it.second.queued_bytes, cc.max_queued_bytes, cc.last.outq,
+           cc.queued_ms, (unsigned long)(cc.drain_rate / 1000), cc.last.rtt_us,
+           (unsigned long)cc.frames_dropped, (unsigned long)cc.skips);
+    cc.max_queued_bytes = 0;
+  }
+
+  for (auto &it : clients) {
+    packet_pacer &pacer = it.second.pacer;
+    if (pacer.fraction_pct <= 0 || !it.second.synced)
+      continue;
+    printf("[SERVER] Client %d: pacing %lu kbit/s, %lu bursts, largest %zu B "
+           "over %d ms\n",
+           it.first, (unsigned long)(pacer.rate * 8 / 1000),
+           (unsigned long)pacer.bursts, pacer.max_burst_bytes,
+           pacer.max_burst_ms);
+    pacer.bursts = 0;
+    pacer.max_burst_bytes = 0;
+    pacer.max_burst_ms = 0;
+  }
+
+  for (auto &it : clients) {
+    receiver_report &report = it.second.report;
+    if (!report.reporting)
+      continue;
+    printf("[SERVER] Client %d: decoder queue %d, %u lost, rtt %u us, "
+           "ack latency %u us, %lu acks, %lu keyframe requests\n",
+           it.first, report.decode_queue, report.lost, report.rtt_us,
+           report.ack_latency_us, (unsigned long)report.acks,
+           (unsigned long)report.keyframe_requests);
+    report.acks = report.keyframe_requests = 0;
+  }
+}
+
+void Server::watch_client(server_client &client, bool want_write) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? (uint32_t)EPOLLOUT : 0);
+  ev.data.fd = client.fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client.fd, &ev);
+}
@@ -1,28 +1,257 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "src/atomic_queue.hpp"
+#include "src/congestion.hpp"
+#include "src/latency_stats.hpp"
+#include "src/pacing.hpp"
+#include "src/shm_transport.hpp"
+#include "src/tls.hpp"
+#include "src/udp_transport.hpp"
+#include "src/wire_header.hpp"
+#include <atomic>
 #include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
+struct ServerParams {
+  int port = 53516;
+  // with more than one client the same encoded stream is fanned out to all
+  // of them, with one client a new connection replaces the old one
+  int max_clients = 1;
+  // bound of each client send queue, a client going over it is dropped
+  // back to the next keyframe instead of stalling everyone else
+  size_t max_queued_bytes = 8 << 20;
+  // packets at least this big are sent with MSG_ZEROCOPY, 0 disables it
+  uint32_t zerocopy_threshold = 0;
+  // above this estimated queueing delay frames are dropped, 0 disables it
+  int latency_budget_ms = 0;
+  // estimate throughput and delay even without a budget, for the encoder
+  bool track_transport = false;
+  // RTP over UDP instead of the TCP listener, see udp_transport.hpp
+  bool udp = false;
+  int fec_group = 0;
+  bool hevc = false; // picks the RTP packetization
+  // spread every packet over this share of the frame interval (percent),
+  // no faster than max_pacing_rate (bytes per second), 0 disables them.
+  // Receivers can change both for themselves with CONTROL_PACING.
+  int pacing_pct = 0;
+  uint64_t max_pacing_rate = 0;
+  // PEM certificate chain and key, TLS is enabled when they are set
+  std::string tls_cert, tls_key;
+  // Unix socket handing out the shared memory ring to local readers, next
+  // to the network clients, see shm_transport.hpp. Empty disables it.
+  std::string local_socket;
+  size_t local_ring_size = 32 << 20;
+};
+
+// Network conditions summed up over all the clients, the worst one wins
+struct transport_feedback {
+  int clients = 0;
+  uint64_t throughput = 0;       // bytes per second
+  int queued_ms = 0;             // queueing delay in our and kernel buffers
+  uint32_t rtt_us = 0;
+  uint32_t queuing_delay_us = 0; // RTT above the lowest one seen
+  // from the receivers own reports, 0 if they don't send any
+  int decode_queue = 0;        // frames waiting in the slowest decoder
+  uint32_t ack_latency_us = 0; // from handing a frame over to its decoding
+  // over UDP, out of 256, from the RTCP receiver reports
+  int fraction_lost = 0;
+};
+
+enum server_packet_flags : uint32_t {
+  PACKET_KEYFRAME = 1 << 0,
+  PACKET_DISPOSABLE = 1 << 1, // no other frame references it
+};
+
+// An encoded packet ready to go on the wire. The payload is shared between
+// the send queues of all the clients and released with the last reference.
+struct server_packet {
+  std::shared_ptr<const uint8_t> data;
+  uint32_t size = 0;
+  uint8_t header[WIRE_HEADER_SIZE]; // see wire_header.hpp
+  uint8_t stream = WIRE_STREAM_VIDEO;
+  int64_t pts = 0;
+  uint32_t seq = 0;
+  bool keyframe = false;
+  bool disposable = false;
+  bool config = false; // codec extradata (SPS/PPS)
+  frame_timing timing; // video frames only
+
+  size_t wire_size() const { return sizeof(header) + size; }
+};
+
+// A packet handed to the kernel with MSG_ZEROCOPY, kept alive until the
+// completion for its sendmsg call shows up on the error queue. The header
+// is copied here because the queued packet is popped right after sendmsg,
+// while the kernel may still read (or retransmit) the pages it pinned.
+struct zerocopy_buffer {
+  uint32_t seq;
+  std::shared_ptr<const uint8_t> data;
+  uint8_t header[WIRE_HEADER_SIZE];
+};
+
+// What a receiver told us over the back-channel, see control_message
+struct receiver_report {
+  bool reporting = false; // got at least one report
+  int decode_queue = 0;
+  uint32_t lost = 0;
+  uint32_t rtt_us = 0;
+  uint32_t ack_latency_us = 0; // of the last acknowledged frame
+  uint64_t acks = 0;
+  uint64_t keyframe_requests = 0;
+};
+
+// When a video frame was handed on, by seq, to time its acknowledgement
+struct sent_frame {
+  uint32_t seq = 0;
+  int64_t usec = -1;
+  frame_timing timing;
+};
+
+struct server_client {
+  int fd = -1;
+  std::deque<server_packet> queue;
+  size_t queued_bytes = 0;
+  size_t offset = 0;    // bytes of queue.front() already sent
+  bool blocked = false; // waiting for EPOLLOUT
+  bool synced = false;  // false until the client gets a keyframe
+  bool keyframe_asked = false;
+
+  congestion_control congestion;
+  packet_pacer pacer;
+
+  // control messages come in as a byte stream like everything else
+  uint8_t rx[CONTROL_MESSAGE_SIZE];
+  size_t rx_size = 0;
+  receiver_report report;
+  // when the recent video frames were written to the socket
+  sent_frame written[256];
+
+  bool zerocopy = false;
+  uint32_t zerocopy_seq = 0; // the kernel counts zerocopy sendmsg calls
+  std::deque<zerocopy_buffer> zerocopy_pending;
+
+  SSL *ssl = nullptr;
+  bool handshaking = false;
+  int64_t accepted_usec = 0; // handshakes that never end are cut short
+  bool ktls = false;      // the kernel encrypts, the socket takes plain data
+  bool tls_retry = false; // OpenSSL holds part of queue.front() already
+};
+
+// The server owns its sockets on a dedicated thread driven by epoll.
+// The encoder only ever hands packets over through `send_data`, so
+// capture and encoding never block on the network.
 class Server {
 
 public:
   Server();
+  ~Server();
 
-  void init_server();
+  void init_server(const ServerParams &params);
   void close_server();
   void restart_server();
   void send_header_server(uint8_t *data, uint32_t size);
 
-  int send_data(uint8_t *data, uint32_t size);
-  int recv_data(uint8_t **data, uint32_t size);
+  // copies the data, pts is in microseconds
+  int send_data(uint8_t *data, uint32_t size, uint32_t flags = 0,
+                int64_t pts = 0, uint8_t stream = WIRE_STREAM_VIDEO);
+  // takes a reference on the data, which must not change afterwards
+  int send_data(std::shared_ptr<const uint8_t> data, uint32_t size,
+                uint32_t flags = 0, int64_t pts = 0,
+                uint8_t stream = WIRE_STREAM_VIDEO);
 
   int is_connected();
 
+  // Returns true (once) if a keyframe should be forced, e.g. because a
+  // client joined in the middle of a GOP
+  bool keyframe_requested();
+  // Whether one was asked for and not encoded yet, a frame has to be
+  // encoded for it even if nothing changed
+  bool keyframe_pending() const { return need_keyframe; }
+
+  // Times of a frame about to be encoded with the given pts, its packet
+  // carries them to the clients, for the glass to glass latency. Called
+  // from the encoder thread.
+  void set_frame_timing(int64_t pts, const frame_timing &timing);
+
+  // Latest transport estimates (refreshed every second), false if there is
+  // nothing to go by
+  bool get_feedback(transport_feedback &feedback);
+
 private:
+  void event_loop();
+  void accept_client();
+  void drop_client(int fd);
+  void expire_handshakes();
+  bool read_client(server_client &client);
+  void handle_control(server_client &client, const control_message &msg);
+  void drain_pending();
+  void queue_packet(server_client &client, const server_packet &pkt);
+  void resync_client(server_client &client);
+  bool flush_client(server_client &client);
+  bool flush_tls(server_client &client);
+  bool handshake_client(server_client &client);
+  void reap_zerocopy(server_client &client);
+  void watch_client(server_client &client, bool want_write);
+  void update_feedback();
+  void count_clients();
+  void packet_written(server_client &client, const server_packet &pkt);
+  frame_timing encoded_frame_timing(int64_t pts);
+  server_packet make_packet(std::shared_ptr<const uint8_t> data,
+                            uint32_t size, wire_header &wire);
+  void wake();
+
+  ServerParams params;
+
   int s_socket = -1; // socket
-  int c_socket = -1; // connect socket
+  int u_socket = -1; // UDP mode only
+  int epoll_fd = -1;
+  int wake_fd = -1; // eventfd, signalled when packets are queued or on close
+
+  std::thread loop_thread;
+  std::atomic<bool> running{false};
+  std::atomic<int> n_clients{0};
+  std::atomic<bool> need_keyframe{false};
+
+  // next sequence number of each stream, only touched by the encoder
+  uint32_t next_seq[WIRE_STREAM_COUNT] = {};
+  // frames in the encoder, by pts, only touched by the encoder
+  struct encoding_frame {
+    int64_t pts = -1;
+    frame_timing timing;
+  };
+  encoding_frame encoding[64];
+  int next_encoding = 0;
+
+  // encoder -> event loop, only fills up if the loop itself stalls
+  atomic_queue<server_packet, 256> pending;
+  // owned by the event loop thread
+  std::map<int, server_client> clients;
+  server_packet header; // cached extradata for late joiners
+  // when the recent video frames were handed to the clients, by seq
+  sent_frame sent_frames[256];
+  latency_histogram latency;
+  int64_t latency_report_usec = 0;
+  // measured from the video pts, for the pacing
+  int64_t frame_interval_us = 16667;
+  int64_t last_video_pts = -1;
+  udp_transport udp;
+  tls_server tls;
+  shm_transport shm;
+
+  std::mutex feedback_mutex;
+  transport_feedback feedback;
 
-  const int port = 53516;
+  // CPU the event loop spends per byte sent, to compare TLS modes
+  uint64_t bytes_sent = 0;
+  uint64_t report_bytes = 0;
+  int64_t report_cpu_usec = 0, report_usec = 0;
 };
 
 #endif
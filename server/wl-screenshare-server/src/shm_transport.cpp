@@ -0,0 +1,415 @@
+#include "shm_transport.hpp"
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010 // Linux 5.1
+#endif
+
+// what a packet may take of the ring, so that a reader has a chance to
+// use it before it gets overwritten
+#define MAX_PACKET_SHARE 4
+
+struct shm_hello {
+  uint32_t magic;
+  uint32_t version;
+};
+
+static int futex(std::atomic<uint32_t> *addr, int op, uint32_t val,
+                 const struct timespec *timeout) {
+  return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static bool unix_address(const std::string &path, sockaddr_un &addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "[SERVER] Socket path too long: %s\n", path.c_str());
+    return false;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size());
+  return true;
+}
+
+// Maps the data area of the ring twice in a row
+static uint8_t *map_ring(int fd, uint64_t offset, uint64_t capacity,
+                         int prot) {
+  void *area = mmap(NULL, capacity * 2, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (area == MAP_FAILED)
+    return nullptr;
+  for (int i = 0; i < 2; i++) {
+    if (mmap((uint8_t *)area + i * capacity, capacity, prot,
+             MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+      munmap(area, capacity * 2);
+      return nullptr;
+    }
+  }
+  return (uint8_t *)area;
+}
+
+shm_transport::~shm_transport() { close(); }
+
+bool shm_transport::init(const std::string &_path, size_t _capacity,
+                         int _epoll_fd) {
+  path = _path;
+  epoll_fd = _epoll_fd;
+  size_t page = sysconf(_SC_PAGESIZE);
+  capacity = (_capacity + page - 1) / page * page;
+  uint64_t data_offset = (sizeof(shm_ring_header) + page - 1) / page * page;
+
+  memfd = memfd_create("wl-screenshare-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd < 0 || ftruncate(memfd, data_offset + capacity) != 0) {
+    perror("[SERVER] memfd");
+    return false;
+  }
+  void *header = mmap(NULL, data_offset, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      memfd, 0);
+  data = map_ring(memfd, data_offset, capacity, PROT_READ | PROT_WRITE);
+  if (header == MAP_FAILED || data == nullptr) {
+    perror("[SERVER] mmap ring");
+    return false;
+  }
+  ring = (shm_ring_header *)header;
+  ring->magic = SHM_RING_MAGIC;
+  ring->version = SHM_RING_VERSION;
+  ring->capacity = capacity;
+  ring->data_offset = data_offset;
+  ring->write_pos.store(0);
+  ring->head.store(0);
+  ring->sync_pos.store(SHM_NO_SYNC);
+  ring->futex.store(0);
+  ring->closed.store(0);
+
+  // our mappings stay writable, the readers can only map it read-only
+  if (fcntl(memfd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE) != 0) {
+    perror("[SERVER] F_SEAL_FUTURE_WRITE, readers could write the ring");
+    fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+  }
+
+  sockaddr_un addr;
+  if (!unix_address(path, addr))
+    return false;
+  listen_fd =
+      socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    perror("[SERVER] create unix socket");
+    return false;
+  }
+  // left behind by a previous run
+  unlink(path.c_str());
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd, 10) != 0) {
+    perror("[SERVER] cant bind unix socket");
+    return false;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+  printf("[SERVER] Local readers on %s (%lu KiB ring)\n", path.c_str(),
+         (unsigned long)(capacity >> 10));
+  return true;
+}
+
+void shm_transport::close() {
+  while (!reader_fds.empty())
+    drop_reader(*reader_fds.begin());
+  if (listen_fd >= 0) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, NULL);
+    ::close(listen_fd);
+    unlink(path.c_str());
+    listen_fd = -1;
+  }
+  if (ring) {
+    // the readers keep their mappings, tell them nothing else comes
+    ring->closed.store(1, std::memory_order_release);
+    ring->futex.fetch_add(1, std::memory_order_release);
+    futex(&ring->futex, FUTEX_WAKE, INT_MAX, NULL);
+    munmap(ring, ring->data_offset);
+    ring = nullptr;
+  }
+  if (data) {
+    munmap(data, capacity * 2);
+    data = nullptr;
+  }
+  if (memfd >= 0) {
+    ::close(memfd);
+    memfd = -1;
+  }
+  config.clear();
+}
+
+bool shm_transport::owns(int fd) const {
+  return fd >= 0 && (fd == listen_fd || reader_fds.count(fd));
+}
+
+bool shm_transport::handle_event(int fd, uint32_t events) {
+  if (fd == listen_fd) {
+    size_t before = reader_fds.size();
+    accept_reader();
+    // a new reader waits for a keyframe
+    return reader_fds.size() > before;
+  }
+
+  bool keyframe = false;
+  if (events & EPOLLIN) {
+    while (true) {
+      uint8_t buf[CONTROL_MESSAGE_SIZE];
+      ssize_t m = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+      if (m < 0 && errno == EINTR)
+        continue;
+      if (m < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        break;
+      if (m <= 0) {
+        events |= EPOLLHUP;
+        break;
+      }
+      control_message msg;
+      if (m == CONTROL_MESSAGE_SIZE && control_message_read(buf, msg) &&
+          msg.type == CONTROL_KEYFRAME_REQUEST)
+        keyframe = true;
+    }
+  }
+  if (events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+    drop_reader(fd);
+    printf("[SERVER] Local reader %d gone, %zu readers\n", fd,
+           reader_fds.size());
+  }
+  return keyframe;
+}
+
+void shm_transport::accept_reader() {
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      perror("[SERVER] no local connection");
+    return;
+  }
+
+  shm_hello hello = {SHM_RING_MAGIC, SHM_RING_VERSION};
+  struct iovec iov = {&hello, sizeof(hello)};
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+    perror("[SERVER] send ring");
+    ::close(fd);
+    return;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  ev.data.fd = fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  reader_fds.insert(fd);
+  printf("[SERVER] Local reader %d, %zu readers\n", fd, reader_fds.size());
+}
+
+void shm_transport::drop_reader(int fd) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  ::close(fd);
+  reader_fds.erase(fd);
+}
+
+void shm_transport::publish(const uint8_t *header, const uint8_t *payload,
+                            uint32_t size, bool keyframe, bool is_config) {
+  if (!ring)
+    return;
+  if (is_config) {
+    config.assign(header, header + WIRE_HEADER_SIZE);
+    config.insert(config.end(), payload, payload + size);
+    return;
+  }
+  if (reader_fds.empty())
+    return;
+
+  uint64_t total = WIRE_HEADER_SIZE + size;
+  if (keyframe)
+    total += config.size();
+  if (total > capacity / MAX_PACKET_SHARE) {
+    if (too_big++ == 0)
+      printf("[SERVER] Packet of %lu bytes too big for the local ring\n",
+             (unsigned long)total);
+    return;
+  }
+
+  // single writer, head and write_pos are equal in between packets
+  uint64_t start = ring->head.load(std::memory_order_relaxed);
+  ring->write_pos.store(start + total, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  uint64_t pos = start;
+  if (keyframe)
+    append(pos, config.data(), config.size());
+  append(pos, header, WIRE_HEADER_SIZE);
+  append(pos, payload, size);
+  ring->head.store(start + total, std::memory_order_release);
+  if (keyframe)
+    ring->sync_pos.store(start, std::memory_order_release);
+
+  ring->futex.fetch_add(1, std::memory_order_release);
+  futex(&ring->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+// What goes past the end of the ring lands at its start, through the
+// second mapping
+void shm_transport::append(uint64_t &pos, const uint8_t *src, size_t size) {
+  memcpy(data + pos % capacity, src, size);
+  pos += size;
+}
+
+shm_reader::~shm_reader() { close(); }
+
+bool shm_reader::connect(const std::string &path) {
+  sockaddr_un addr;
+  if (!unix_address(path, addr))
+    return false;
+  sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0 || ::connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+    fprintf(stderr, "Can't connect to %s: %s\n", path.c_str(),
+            strerror(errno));
+    return false;
+  }
+
+  shm_hello hello;
+  struct iovec iov = {&hello, sizeof(hello)};
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello)) {
+    fprintf(stderr, "No ring from %s\n", path.c_str());
+    return false;
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      hello.magic != SHM_RING_MAGIC) {
+    fprintf(stderr, "No ring from %s\n", path.c_str());
+    return false;
+  }
+  int memfd;
+  memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+  if (hello.version != SHM_RING_VERSION) {
+    fprintf(stderr, "Unsupported ring version %u\n", hello.version);
+    ::close(memfd);
+    return false;
+  }
+
+  struct stat st;
+  size_t page = sysconf(_SC_PAGESIZE);
+  header_size = (sizeof(shm_ring_header) + page - 1) / page * page;
+  void *header = MAP_FAILED;
+  if (fstat(memfd, &st) == 0 && (size_t)st.st_size >= header_size)
+    header = mmap(NULL, header_size, PROT_READ, MAP_SHARED, memfd, 0);
+  if (header == MAP_FAILED) {
+    ::close(memfd);
+    return false;
+  }
+  ring = (const shm_ring_header *)header;
+  capacity = ring->capacity;
+  if (ring->data_offset != header_size ||
+      header_size + capacity > (uint64_t)st.st_size ||
+      !(data = map_ring(memfd, header_size, capacity, PROT_READ))) {
+    fprintf(stderr, "Invalid ring\n");
+    ::close(memfd);
+    return false;
+  }
+  // the mappings keep the memory alive
+  ::close(memfd);
+  return true;
+}
+
+void shm_reader::close() {
+  if (data) {
+    munmap((void *)data, capacity * 2);
+    data = nullptr;
+  }
+  if (ring) {
+    munmap((void *)ring, header_size);
+    ring = nullptr;
+  }
+  if (sock >= 0) {
+    ::close(sock);
+    sock = -1;
+  }
+}
+
+shm_result shm_reader::next(wire_header &wire, const uint8_t *&payload,
+                            int timeout_ms) {
+  // futex() wants a non-const pointer, it only reads it for FUTEX_WAIT
+  auto *word = const_cast<std::atomic<uint32_t> *>(&ring->futex);
+  while (true) {
+    uint32_t seen = word->load(std::memory_order_acquire);
+    if (ring->closed.load(std::memory_order_acquire))
+      return SHM_CLOSED;
+
+    if (!started) {
+      uint64_t sync = ring->sync_pos.load(std::memory_order_acquire);
+      if (sync != SHM_NO_SYNC &&
+          ring->write_pos.load(std::memory_order_acquire) - sync <= capacity) {
+        pos = sync;
+        started = true;
+      }
+    }
+
+    if (started && pos != ring->head.load(std::memory_order_acquire)) {
+      const uint8_t *p = data + pos % capacity;
+      bool ok = wire_header_read(p, wire) &&
+                wire.size <= capacity - WIRE_HEADER_SIZE;
+      last = pos;
+      if (!ok || !valid()) {
+        started = false;
+        return SHM_OVERRUN;
+      }
+      payload = p + WIRE_HEADER_SIZE;
+      pos += WIRE_HEADER_SIZE + wire.size;
+      return SHM_PACKET;
+    }
+
+    struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    if (futex(word, FUTEX_WAIT, seen, &ts) != 0 && errno == ETIMEDOUT)
+      return SHM_TIMEOUT;
+  }
+}
+
+// The packet returned last is intact as long as the writer didn't start
+// copying over it
+bool shm_reader::valid() const {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return ring->write_pos.load(std::memory_order_relaxed) <= last + capacity;
+}
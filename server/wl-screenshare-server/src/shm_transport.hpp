@@ -0,0 +1,120 @@
+#ifndef SHM_TRANSPORT_H
+#define SHM_TRANSPORT_H
+
+#include "src/wire_header.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+// Same host alternative to the TCP loopback, for a local recorder or
+// preview. Packets are written once into a ring in a memfd, with the same
+// wire header as on TCP, and any number of readers map it read-only and
+// use the packets in place instead of getting them copied through the
+// kernel twice.
+//
+// Readers connect to a Unix socket (SOCK_SEQPACKET) and get the memfd with
+// SCM_RIGHTS. The connection stays open: the server counts the readers with
+// it and they send control messages (keyframe requests) over it.
+//
+// The data area is mapped twice back to back, so a packet wrapping around
+// the end of the ring is still contiguous. The writer moves write_pos
+// forward before copying a packet and head after it. A reader that finds
+// write_pos more than the capacity ahead of a packet it just used was
+// overrun and starts over from sync_pos, the last keyframe with the codec
+// extradata in front of it. `futex` changes and is woken at every packet.
+#define SHM_RING_MAGIC 0x52535357 // "WSSR"
+#define SHM_RING_VERSION 1
+#define SHM_NO_SYNC UINT64_MAX
+
+struct shm_ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;    // bytes in the data area
+  uint64_t data_offset; // of the data area in the memfd, page aligned
+  std::atomic<uint64_t> write_pos; // bytes being written, up to here
+  std::atomic<uint64_t> head;      // bytes readable, up to here
+  std::atomic<uint64_t> sync_pos;  // SHM_NO_SYNC before the first keyframe
+  std::atomic<uint32_t> futex;
+  std::atomic<uint32_t> closed; // the server is gone, no more packets
+};
+
+// Server side: the ring and the readers connections, driven by the server
+// event loop
+class shm_transport {
+
+public:
+  ~shm_transport();
+
+  // Creates the ring and listens on path, the sockets go into epoll_fd
+  bool init(const std::string &path, size_t capacity, int epoll_fd);
+  void close();
+
+  // The listening socket and the readers connections
+  bool owns(int fd) const;
+  // Accepts a reader or reads its control messages, returns true if a
+  // keyframe should be forced
+  bool handle_event(int fd, uint32_t events);
+  // Appends a packet with its wire header. Codec extradata is kept and
+  // written again in front of every keyframe.
+  void publish(const uint8_t *header, const uint8_t *data, uint32_t size,
+               bool keyframe, bool is_config);
+
+  int readers() const { return (int)reader_fds.size(); }
+
+private:
+  void accept_reader();
+  void drop_reader(int fd);
+  void append(uint64_t &pos, const uint8_t *src, size_t size);
+
+  std::string path;
+  int listen_fd = -1;
+  int memfd = -1;
+  int epoll_fd = -1;
+  shm_ring_header *ring = nullptr;
+  uint8_t *data = nullptr; // twice the capacity
+  uint64_t capacity = 0;
+
+  std::set<int> reader_fds;
+  std::vector<uint8_t> config; // wire header and extradata
+  uint64_t too_big = 0;
+};
+
+enum shm_result {
+  SHM_PACKET,
+  SHM_TIMEOUT,
+  SHM_OVERRUN, // the writer got a ring ahead, wait for the next keyframe
+  SHM_CLOSED,
+};
+
+// Reader side, for local consumers
+class shm_reader {
+
+public:
+  ~shm_reader();
+
+  bool connect(const std::string &path);
+  void close();
+
+  // Waits up to timeout_ms for the next packet. The payload points into the
+  // ring, valid() tells whether it was overwritten while in use.
+  shm_result next(wire_header &wire, const uint8_t *&payload, int timeout_ms);
+  bool valid() const;
+
+  // The Unix socket, control messages are written to it
+  int socket_fd() const { return sock; }
+
+private:
+  int sock = -1;
+  const shm_ring_header *ring = nullptr;
+  const uint8_t *data = nullptr;
+  uint64_t capacity = 0;
+  size_t header_size = 0;
+  bool started = false;
+  uint64_t pos = 0;  // next packet
+  uint64_t last = 0; // packet returned by next()
+};
+
+#endif
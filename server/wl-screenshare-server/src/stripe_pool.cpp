@@ -0,0 +1,166 @@
+#include "stripe_pool.hpp"
+#include "pipeline_stats.hpp"
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+stripe_pool::~stripe_pool() { stop(); }
+
+void stripe_pool::start(int threads, const std::vector<int> &cpus) {
+  stop();
+  stopping = false;
+  if (threads <= 1)
+    return;
+
+  for (int i = 0; i < threads; i++) {
+    workers.emplace_back(&stripe_pool::worker, this, i);
+    if (cpus.empty())
+      continue;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[i % cpus.size()], &set);
+    int err = pthread_setaffinity_np(workers.back().native_handle(),
+                                     sizeof(set), &set);
+    if (err != 0)
+      fprintf(stderr, "Can't pin conversion thread %d to CPU %d: %s\n", i,
+              cpus[i % cpus.size()], strerror(err));
+  }
+}
+
+void stripe_pool::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto &worker : workers)
+    worker.join();
+  workers.clear();
+}
+
+void stripe_pool::run(int _stripes, const std::function<void(int)> &fn,
+                      bool timed) {
+  int64_t start = monotonic_usec();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = &fn;
+    stripes = _stripes;
+    next_stripe = 0;
+    finished = 0;
+    stripe_usec.assign(stripes, 0);
+    generation++;
+  }
+
+  if (workers.empty()) {
+    do_stripes();
+  } else {
+    wake.notify_all();
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return finished == stripes; });
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = nullptr;
+  }
+  if (timed) {
+    int64_t now = monotonic_usec();
+    report(now, now - start);
+  }
+}
+
+void stripe_pool::worker(int) {
+  uint64_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [&] { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+    }
+    do_stripes();
+  }
+}
+
+// Takes stripes until there are none left, on the workers or the caller
+void stripe_pool::do_stripes() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (job && next_stripe < stripes) {
+    int stripe = next_stripe++;
+    const std::function<void(int)> &fn = *job;
+    lock.unlock();
+
+    int64_t start = monotonic_usec();
+    fn(stripe);
+    int64_t usec = monotonic_usec() - start;
+
+    lock.lock();
+    stripe_usec[stripe] = usec;
+    if (++finished == stripes)
+      done.notify_one();
+  }
+}
+
+void stripe_pool::report(int64_t now_usec, int64_t frame_usec) {
+  if (stripe_times.size() != stripe_usec.size()) {
+    stripe_times.assign(stripe_usec.size(), stripe_time());
+    frame_time = stripe_time();
+    frames = 0;
+  }
+  for (size_t i = 0; i < stripe_usec.size(); i++) {
+    stripe_times[i].total += stripe_usec[i];
+    stripe_times[i].max = std::max(stripe_times[i].max, stripe_usec[i]);
+  }
+  frame_time.total += frame_usec;
+  frame_time.max = std::max(frame_time.max, frame_usec);
+  frames++;
+
+  if (last_report == 0)
+    last_report = now_usec;
+  if (now_usec - last_report < 1000000)
+    return;
+
+  printf("Convert %d threads | frame %.2f/%.2f ms | stripes",
+         std::max(threads(), 1),
+         frame_time.total / 1000.0 / frames, frame_time.max / 1000.0);
+  for (auto &stripe : stripe_times) {
+    printf(" %.2f/%.2f", stripe.total / 1000.0 / frames, stripe.max / 1000.0);
+    stripe = stripe_time();
+  }
+  printf(" ms (avg/max)\n");
+  frame_time = stripe_time();
+  frames = 0;
+  last_report = now_usec;
+}
+
+bool parse_cpu_list(const char *list, std::vector<int> &cpus) {
+  cpus.clear();
+  const char *p = list;
+  while (*p) {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p || first < 0)
+      return false;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first)
+        return false;
+    }
+    if (last >= CPU_SETSIZE)
+      return false;
+    for (long cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+    if (*end == ',')
+      end++;
+    else if (*end)
+      return false;
+    p = end;
+  }
+  return !cpus.empty();
+}
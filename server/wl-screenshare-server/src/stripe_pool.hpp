@@ -0,0 +1,67 @@
+#ifndef STRIPE_POOL_H
+#define STRIPE_POOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker threads splitting the work on a frame in horizontal
+// stripes, started once instead of for every frame. The caller waits for
+// the stripes, the workers take them in order as they get free.
+//
+// The time of every stripe is kept and reported once per second, so the
+// pool can be sized: stripes much slower than the others point at busy or
+// slower cores.
+class stripe_pool {
+
+public:
+  ~stripe_pool();
+
+  // Without workers (threads <= 1) run() does the stripes itself. Worker i
+  // is pinned to cpus[i % cpus.size()] if cpus isn't empty.
+  void start(int threads, const std::vector<int> &cpus);
+  void stop();
+
+  int threads() const { return (int)workers.size(); }
+
+  // Calls fn(stripe) for every stripe, returns when all are done. Only
+  // timed runs are in the report.
+  void run(int stripes, const std::function<void(int)> &fn,
+           bool timed = true);
+
+private:
+  void worker(int index);
+  void do_stripes();
+  void report(int64_t now_usec, int64_t frame_usec);
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  bool stopping = false;
+  uint64_t generation = 0; // one per run()
+
+  // the current run, guarded by mutex
+  const std::function<void(int)> *job = nullptr;
+  int stripes = 0;
+  int next_stripe = 0;
+  int finished = 0;
+  std::vector<int64_t> stripe_usec;
+
+  // since the last report
+  struct stripe_time {
+    int64_t total = 0;
+    int64_t max = 0;
+  };
+  std::vector<stripe_time> stripe_times;
+  stripe_time frame_time;
+  int frames = 0;
+  int64_t last_report = 0;
+};
+
+// "0-3,8,10" to the list of CPUs, false if it doesn't parse
+bool parse_cpu_list(const char *list, std::vector<int> &cpus);
+
+#endif
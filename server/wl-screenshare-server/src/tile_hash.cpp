@@ -0,0 +1,279 @@
+#include "tile_hash.hpp"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS
+#endif
+
+#define PRIME32 0x9E3779B1ULL
+#define BLOCK_BYTES 32
+#define LANES 4
+// one key per block of a tile row
+#define KEY_BLOCKS (TILE_SIZE * TILE_MAX_BPP / BLOCK_BYTES)
+
+struct hash_keys {
+  uint64_t k[KEY_BLOCKS * LANES];
+};
+
+// splitmix64, any keys with well mixed bits do
+static constexpr hash_keys make_keys() {
+  hash_keys keys{};
+  uint64_t x = 0;
+  for (int i = 0; i < KEY_BLOCKS * LANES; i++) {
+    x += 0x9E3779B97F4A7C15ULL;
+    uint64_t z = x;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    keys.k[i] = z ^ (z >> 31);
+  }
+  return keys;
+}
+
+alignas(32) static constexpr hash_keys KEYS = make_keys();
+
+static const uint64_t SEEDS[LANES] = {
+    0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL,
+    0x85EBCA77C2B2AE63ULL};
+
+static inline uint64_t rotl64(uint64_t v, int bits) {
+  return (v << bits) | (v >> (64 - bits));
+}
+
+static uint64_t finish(const uint64_t acc[LANES]) {
+  uint64_t h = acc[0] ^ rotl64(acc[1], 17) ^ rotl64(acc[2], 31) ^
+               rotl64(acc[3], 47);
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// The end of a row that doesn't fill a block, zero padded
+static inline const uint8_t *tail_block(uint8_t *block, const uint8_t *row,
+                                        int bytes) {
+  memset(block, 0, BLOCK_BYTES);
+  memcpy(block, row, bytes);
+  return block;
+}
+
+static inline void accumulate_c(uint64_t acc[LANES], const uint8_t *p,
+                                const uint64_t *key) {
+  uint64_t data[LANES];
+  memcpy(data, p, BLOCK_BYTES);
+  for (int i = 0; i < LANES; i++) {
+    uint64_t dk = data[i] ^ key[i];
+    acc[i] += data[i ^ 1] + (dk & 0xFFFFFFFF) * (dk >> 32);
+  }
+}
+
+static inline void scramble_c(uint64_t acc[LANES]) {
+  for (int i = 0; i < LANES; i++)
+    acc[i] = (acc[i] ^ (acc[i] >> 47) ^ KEYS.k[i]) * PRIME32;
+}
+
+// Every row of a band of tiles is hashed from left to right, each tile
+// having its 4 lanes in acc. Going down tile by tile instead would read a
+// few hundred bytes from each of 64 rows and miss the TLB all along.
+static void hash_row_scalar(uint64_t *acc, const uint8_t *row, int bytes,
+                            int tile_bytes) {
+  uint8_t tail[BLOCK_BYTES];
+  for (int x = 0; x < bytes; x += tile_bytes, acc += LANES) {
+    int end = std::min(tile_bytes, bytes - x);
+    int b = 0;
+    for (; (b + 1) * BLOCK_BYTES <= end; b++)
+      accumulate_c(acc, row + x + b * BLOCK_BYTES, KEYS.k + b * LANES);
+    if (b * BLOCK_BYTES < end)
+      accumulate_c(acc,
+                   tail_block(tail, row + x + b * BLOCK_BYTES,
+                              end - b * BLOCK_BYTES),
+                   KEYS.k + b * LANES);
+    scramble_c(acc);
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+// A block is 2 vectors, lanes 0-1 and 2-3
+static inline __m128i accumulate_sse2(__m128i acc, const uint8_t *p,
+                                      const uint64_t *key) {
+  __m128i data = _mm_loadu_si128((const __m128i *)p);
+  __m128i dk = _mm_xor_si128(data, _mm_load_si128((const __m128i *)key));
+  __m128i product = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+  __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+  return _mm_add_epi64(acc, _mm_add_epi64(swapped, product));
+}
+
+// 64 by 32-bit multiply out of two 32 by 32-bit ones
+static inline __m128i scramble_sse2(__m128i acc, const uint64_t *key) {
+  const __m128i prime = _mm_set1_epi64x(PRIME32);
+  acc = _mm_xor_si128(acc, _mm_srli_epi64(acc, 47));
+  acc = _mm_xor_si128(acc, _mm_load_si128((const __m128i *)key));
+  __m128i lo = _mm_mul_epu32(acc, prime);
+  __m128i hi = _mm_mul_epu32(_mm_srli_epi64(acc, 32), prime);
+  return _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+}
+
+static void hash_row_sse2(uint64_t *acc, const uint8_t *row, int bytes,
+                          int tile_bytes) {
+  uint8_t tail[BLOCK_BYTES];
+  for (int x = 0; x < bytes; x += tile_bytes, acc += LANES) {
+    __m128i acc0 = _mm_loadu_si128((const __m128i *)acc);
+    __m128i acc1 = _mm_loadu_si128((const __m128i *)acc + 1);
+    int end = std::min(tile_bytes, bytes - x);
+    for (int b = 0; b * BLOCK_BYTES < end; b++) {
+      const uint8_t *block = row + x + b * BLOCK_BYTES;
+      if ((b + 1) * BLOCK_BYTES > end)
+        block = tail_block(tail, block, end - b * BLOCK_BYTES);
+      const uint64_t *key = KEYS.k + b * LANES;
+      acc0 = accumulate_sse2(acc0, block, key);
+      acc1 = accumulate_sse2(acc1, block + 16, key + 2);
+    }
+    _mm_storeu_si128((__m128i *)acc, scramble_sse2(acc0, KEYS.k));
+    _mm_storeu_si128((__m128i *)acc + 1, scramble_sse2(acc1, KEYS.k + 2));
+  }
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+accumulate_avx2(__m256i acc, const uint8_t *p, const uint64_t *key) {
+  __m256i data = _mm256_loadu_si256((const __m256i *)p);
+  __m256i dk =
+      _mm256_xor_si256(data, _mm256_load_si256((const __m256i *)key));
+  __m256i product = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+  __m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+  return _mm256_add_epi64(acc, _mm256_add_epi64(swapped, product));
+}
+
+__attribute__((target("avx2"))) static void
+hash_row_avx2(uint64_t *acc, const uint8_t *row, int bytes, int tile_bytes) {
+  const __m256i prime = _mm256_set1_epi64x(PRIME32);
+  const __m256i scramble_key = _mm256_load_si256((const __m256i *)KEYS.k);
+  uint8_t tail[BLOCK_BYTES];
+  for (int x = 0; x < bytes; x += tile_bytes, acc += LANES) {
+    __m256i sum = _mm256_loadu_si256((const __m256i *)acc);
+    int end = std::min(tile_bytes, bytes - x);
+    int b = 0;
+    // 2 independent sums for the common case of a whole tile
+    if (end == 8 * BLOCK_BYTES) {
+      __m256i a = _mm256_setzero_si256(), c = _mm256_setzero_si256();
+      for (; b < 8; b += 2) {
+        a = accumulate_avx2(a, row + x + b * BLOCK_BYTES, KEYS.k + b * LANES);
+        c = accumulate_avx2(c, row + x + (b + 1) * BLOCK_BYTES,
+                            KEYS.k + (b + 1) * LANES);
+      }
+      sum = _mm256_add_epi64(sum, _mm256_add_epi64(a, c));
+    }
+    for (; b * BLOCK_BYTES < end; b++) {
+      const uint8_t *block = row + x + b * BLOCK_BYTES;
+      if ((b + 1) * BLOCK_BYTES > end)
+        block = tail_block(tail, block, end - b * BLOCK_BYTES);
+      sum = accumulate_avx2(sum, block, KEYS.k + b * LANES);
+    }
+
+    sum = _mm256_xor_si256(sum, _mm256_srli_epi64(sum, 47));
+    sum = _mm256_xor_si256(sum, scramble_key);
+    __m256i lo = _mm256_mul_epu32(sum, prime);
+    __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(sum, 32), prime);
+    _mm256_storeu_si256((__m256i *)acc,
+                        _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32)));
+  }
+}
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+static inline uint64x2_t accumulate_neon(uint64x2_t acc, const uint8_t *p,
+                                         const uint64_t *key) {
+  uint64x2_t data = vreinterpretq_u64_u8(vld1q_u8(p));
+  uint64x2_t dk = veorq_u64(data, vld1q_u64(key));
+  uint64x2_t product = vmull_u32(vmovn_u64(dk), vshrn_n_u64(dk, 32));
+  uint64x2_t swapped = vextq_u64(data, data, 1);
+  return vaddq_u64(acc, vaddq_u64(swapped, product));
+}
+
+static inline uint64x2_t scramble_neon(uint64x2_t acc, const uint64_t *key) {
+  const uint32x2_t prime = vdup_n_u32(PRIME32);
+  acc = veorq_u64(acc, vshrq_n_u64(acc, 47));
+  acc = veorq_u64(acc, vld1q_u64(key));
+  uint64x2_t lo = vmull_u32(vmovn_u64(acc), prime);
+  uint64x2_t hi = vmull_u32(vshrn_n_u64(acc, 32), prime);
+  return vaddq_u64(lo, vshlq_n_u64(hi, 32));
+}
+
+static void hash_row_neon(uint64_t *acc, const uint8_t *row, int bytes,
+                          int tile_bytes) {
+  uint8_t tail[BLOCK_BYTES];
+  for (int x = 0; x < bytes; x += tile_bytes, acc += LANES) {
+    uint64x2_t acc0 = vld1q_u64(acc), acc1 = vld1q_u64(acc + 2);
+    int end = std::min(tile_bytes, bytes - x);
+    for (int b = 0; b * BLOCK_BYTES < end; b++) {
+      const uint8_t *block = row + x + b * BLOCK_BYTES;
+      if ((b + 1) * BLOCK_BYTES > end)
+        block = tail_block(tail, block, end - b * BLOCK_BYTES);
+      const uint64_t *key = KEYS.k + b * LANES;
+      acc0 = accumulate_neon(acc0, block, key);
+      acc1 = accumulate_neon(acc1, block + 16, key + 2);
+    }
+    vst1q_u64(acc, scramble_neon(acc0, KEYS.k));
+    vst1q_u64(acc + 2, scramble_neon(acc1, KEYS.k + 2));
+  }
+}
+#endif
+
+void tile_hasher::init(int _width, int _height, int bytes_per_pixel,
+                       convert_simd simd, int row_step) {
+  width = _width;
+  height = _height;
+  bpp = std::min(bytes_per_pixel, TILE_MAX_BPP);
+  columns = (width + TILE_SIZE - 1) / TILE_SIZE;
+  rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+  step = std::max(row_step, 1);
+  hashes.assign(columns * rows, 0);
+  previous.assign(step, std::vector<uint64_t>(columns * rows, 0));
+  changed.assign(columns * rows, 1);
+  fresh_frames = step;
+  phase = 0;
+
+  kernel = hash_row_scalar;
+#ifdef HAVE_X86_KERNELS
+  // SSE2 comes with SSE4.1
+  if (simd == CONVERT_AVX2)
+    kernel = hash_row_avx2;
+  else if (simd == CONVERT_SSE41)
+    kernel = hash_row_sse2;
+#elif defined(HAVE_NEON_KERNELS)
+  if (simd == CONVERT_NEON)
+    kernel = hash_row_neon;
+#endif
+}
+
+void tile_hasher::hash(const uint8_t *pixels, int stride, int first,
+                       int last) {
+  // the lanes of a row of tiles
+  std::vector<uint64_t> lanes(columns * LANES);
+  uint64_t *acc = lanes.data();
+  for (int ty = first; ty < std::min(last, rows); ty++) {
+    for (int tx = 0; tx < columns; tx++)
+      memcpy(acc + tx * LANES, SEEDS, sizeof(SEEDS));
+    int y = ty * TILE_SIZE, end = std::min(y + TILE_SIZE, height);
+    for (y += phase; y < end; y += step)
+      kernel(acc, pixels + (intptr_t)y * stride, width * bpp,
+             TILE_SIZE * bpp);
+    for (int tx = 0; tx < columns; tx++)
+      hashes[ty * columns + tx] = finish(acc + tx * LANES);
+  }
+}
+
+int tile_hasher::compare() {
+  int count = 0;
+  for (size_t i = 0; i < hashes.size(); i++) {
+    changed[i] = fresh_frames > 0 || hashes[i] != previous[phase][i];
+    count += changed[i];
+  }
+  hashes.swap(previous[phase]);
+  fresh_frames = std::max(fresh_frames - 1, 0);
+  phase = (phase + 1) % step;
+  return count;
+}
@@ -0,0 +1,64 @@
+#ifndef TILE_HASH_H
+#define TILE_HASH_H
+
+#include "src/color_convert.hpp"
+#include <cstdint>
+#include <vector>
+
+// side of the square tiles, in pixels
+#define TILE_SIZE 64
+// widest pixels hashed, in bytes
+#define TILE_MAX_BPP 8
+// By default each frame hashes one row out of this many, starting one row
+// lower than the frame before, and compares with the hashes of the same
+// rows. A change in the other rows shows up this many frames later at most,
+// as long as frames keep coming.
+#define TILE_ROW_STEP 2
+
+// Finds what changed between two captures when the compositor gives no
+// usable damage: every tile of the frame is hashed and compared with its
+// hash in the previous frame.
+//
+// The hash works like the XXH3 long loop, on 32 bytes a step: 64-bit lanes
+// take the data xored with a key multiplied by its own high half, plus the
+// data of the neighbour lane. The lanes are scrambled after every row, so
+// rows moving inside a tile change the hash too. All kernels give the same
+// hashes.
+class tile_hasher {
+
+public:
+  // row_step 1 hashes every row of every frame
+  void init(int width, int height, int bytes_per_pixel,
+            convert_simd simd = convert_best_simd(),
+            int row_step = TILE_ROW_STEP);
+  // The next frames are dirty everywhere
+  void reset() { fresh_frames = step; }
+
+  int tiles_x() const { return columns; }
+  int tiles_y() const { return rows; }
+  int row_step() const { return step; }
+
+  // Hashes the rows of tiles [first, last), separate ranges can be hashed
+  // at the same time
+  void hash(const uint8_t *pixels, int stride, int first, int last);
+  // Marks the tiles that differ from the previous frame, returns how many
+  int compare();
+  bool dirty(int x, int y) const { return changed[y * columns + x]; }
+
+private:
+  int width = 0, height = 0, bpp = 4;
+  int columns = 0, rows = 0;
+  int step = TILE_ROW_STEP;
+  // frames left to hash before every set of rows has hashes to compare
+  int fresh_frames = TILE_ROW_STEP;
+  // first row hashed in every tile of this frame
+  int phase = 0;
+  std::vector<uint64_t> hashes;
+  std::vector<std::vector<uint64_t>> previous; // one set per phase
+  std::vector<uint8_t> changed;
+  // one row of pixels into the lanes of the tiles it crosses
+  void (*kernel)(uint64_t *acc, const uint8_t *row, int bytes,
+                 int tile_bytes) = nullptr;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "tls.hpp"
+#include <cstdio>
+#include <openssl/err.h>
+
+tls_server::~tls_server() {
+  if (ctx)
+    SSL_CTX_free(ctx);
+}
+
+bool tls_server::init(const std::string &cert, const std::string &key) {
+  ctx = SSL_CTX_new(TLS_server_method());
+  if (!ctx) {
+    ERR_print_errors_fp(stderr);
+    return false;
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+  // the record layer goes to the kernel as soon as the keys are known
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+  // session tickets would be written after the handshake, by OpenSSL,
+  // possibly behind the back of the kernel
+  SSL_CTX_set_num_tickets(ctx, 0);
+  // partial writes in the userspace fallback, the queue keeps the rest
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+  if (SSL_CTX_use_certificate_chain_file(ctx, cert.c_str()) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, key.c_str(), SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    fprintf(stderr, "[SERVER] Can't load the TLS certificate %s / key %s\n",
+            cert.c_str(), key.c_str());
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    ctx = nullptr;
+    return false;
+  }
+  return true;
+}
+
+SSL *tls_server::accept(int fd) {
+  SSL *ssl = SSL_new(ctx);
+  if (!ssl)
+    return nullptr;
+  SSL_set_fd(ssl, fd);
+  SSL_set_accept_state(ssl);
+  return ssl;
+}
+
+tls_status tls_server::handshake(SSL *ssl) {
+  int ret = SSL_do_handshake(ssl);
+  return ret == 1 ? TLS_DONE : status(ssl, ret);
+}
+
+bool tls_server::kernel_send(SSL *ssl) {
+  return BIO_get_ktls_send(SSL_get_wbio(ssl)) == 1;
+}
+
+tls_status tls_server::status(SSL *ssl, int m) {
+  switch (SSL_get_error(ssl, m)) {
+  case SSL_ERROR_NONE:
+    return TLS_DONE;
+  case SSL_ERROR_WANT_READ:
+    return TLS_WANT_READ;
+  case SSL_ERROR_WANT_WRITE:
+    return TLS_WANT_WRITE;
+  default:
+    ERR_print_errors_fp(stderr);
+    ERR_clear_error();
+    return TLS_FAILED;
+  }
+}
+
+int tls_server::read(SSL *ssl, void *buf, int size) {
+  return SSL_read(ssl, buf, size);
+}
+
+int tls_server::write(SSL *ssl, const void *buf, int size) {
+  return SSL_write(ssl, buf, size);
+}
+
+void tls_server::free(SSL *ssl) { SSL_free(ssl); }
+
+std::string tls_server::describe(SSL *ssl) {
+  return std::string(SSL_get_version(ssl)) + " " + SSL_get_cipher(ssl);
+}
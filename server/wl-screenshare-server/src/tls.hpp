@@ -0,0 +1,79 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include "config.h"
+#include <cstdio>
+#include <string>
+
+#ifdef HAVE_TLS
+#include <openssl/ssl.h>
+#else
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+#endif
+
+enum tls_status {
+  TLS_DONE,
+  TLS_WANT_READ,
+  TLS_WANT_WRITE,
+  TLS_FAILED,
+};
+
+// TLS 1.3 for the client connections. Only the handshake runs in userspace:
+// once it is done OpenSSL hands the keys to the kernel (kTLS), which then
+// encrypts the records itself, so the server keeps writing plain data with
+// sendmsg and the gathered header + payload path is unchanged.
+//
+// kTLS needs the tls module (modprobe tls) and an OpenSSL built with it.
+// Without it the records are encrypted by OpenSSL, which works but costs
+// a copy and CPU per byte.
+//
+// OpenSSL is optional, without it (no HAVE_TLS) init() fails and nothing
+// else is ever reached.
+class tls_server {
+
+public:
+  ~tls_server();
+
+  // Loads the certificate chain and its private key (PEM)
+  bool init(const std::string &cert, const std::string &key);
+  bool enabled() const { return ctx != nullptr; }
+
+  // New session on an accepted, non-blocking socket
+  SSL *accept(int fd);
+
+  static tls_status handshake(SSL *ssl);
+  // True if the kernel encrypts what is sent on the socket
+  static bool kernel_send(SSL *ssl);
+  // Maps the result of read/write, m is its return value
+  static tls_status status(SSL *ssl, int m);
+  // SSL_read/SSL_write
+  static int read(SSL *ssl, void *buf, int size);
+  static int write(SSL *ssl, const void *buf, int size);
+  static void free(SSL *ssl);
+  // Protocol version and cipher, for the logs
+  static std::string describe(SSL *ssl);
+
+private:
+  SSL_CTX *ctx = nullptr;
+};
+
+#ifndef HAVE_TLS
+inline tls_server::~tls_server() {}
+
+inline bool tls_server::init(const std::string &, const std::string &) {
+  fprintf(stderr, "[SERVER] Built without OpenSSL, TLS is not available\n");
+  return false;
+}
+
+inline SSL *tls_server::accept(int) { return nullptr; }
+inline tls_status tls_server::handshake(SSL *) { return TLS_FAILED; }
+inline bool tls_server::kernel_send(SSL *) { return false; }
+inline tls_status tls_server::status(SSL *, int) { return TLS_FAILED; }
+inline int tls_server::read(SSL *, void *, int) { return -1; }
+inline int tls_server::write(SSL *, const void *, int) { return -1; }
+inline void tls_server::free(SSL *) {}
+inline std::string tls_server::describe(SSL *) { return ""; }
+#endif
+
+#endif
@@ -0,0 +1,1078 @@
+#include "udp_transport.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RTP_HEADER_SIZE 12
+// keeps datagrams under the MTU of Wi-Fi links and most tunnels
+#define MAX_RTP_PAYLOAD 1200
+// sent packets kept around for NACKs, and for how long they are worth it.
+// Bounded in bytes rather than packets so that a whole 4K keyframe (a few
+// thousand packets) fits, and below half the sequence number space.
+#define RTP_HISTORY_BYTES (16 << 20)
+#define RTP_HISTORY_MAX 32768
+#define RETRANSMIT_WINDOW_US 300000
+// what a single NACK can make us resend, the rest is asked again later
+#define NACK_MAX_BYTES (256 << 10)
+// cookies are valid for one to two of these
+#define COOKIE_EPOCH_US 10000000
+// receivers send a report every second
+#define PEER_TIMEOUT_US 5000000
+
+#define RTCP_RR 201
+#define RTCP_RTPFB 205 // FMT 1: generic NACK
+#define RTCP_PSFB 206  // FMT 1: picture loss indication
+
+#define FU_START 0x80
+#define FU_END 0x40
+
+// receiver side
+#define HELLO_RETRY_US 500000
+// nothing from the server for this long, register again
+#define SERVER_SILENCE_US 2000000
+#define REPORT_INTERVAL_US 1000000
+#define NACK_RETRY_US 30000
+#define NACK_MAX_TRIES 8
+// a bit past the retransmit window of the server
+#define LOSS_GIVE_UP_US 400000
+#define PLI_RETRY_US 500000
+// received packets kept for the FEC after their frame went out
+#define RECEIVED_KEEP 8192
+#define MAX_NACK_PACKET 1400
+#define SEQ_OFFSET (16 << 16)
+
+static int64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static std::string peer_name(const sockaddr_in &addr) {
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+  return std::string(ip) + ":" + std::to_string(ntohs(addr.sin_port));
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static uint16_t get16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+
+static uint32_t get32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Returns the offset of the next Annex B start code at or after pos (size if
+// there is none), with its length in code_len
+static size_t find_start_code(const uint8_t *data, size_t size, size_t pos,
+                              size_t &code_len) {
+  for (size_t i = pos; i + 3 <= size; i++) {
+    if (data[i] != 0 || data[i + 1] != 0)
+      continue;
+    if (data[i + 2] == 1) {
+      code_len = 3;
+      return i;
+    }
+    if (i + 4 <= size && data[i + 2] == 0 && data[i + 3] == 1) {
+      code_len = 4;
+      return i;
+    }
+  }
+  code_len = 0;
+  return size;
+}
+
+udp_transport::~udp_transport() { close(); }
+
+int udp_transport::init(const udp_params &_params) {
+  params = _params;
+  fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("[SERVER] create udp socket");
+    exit(-1);
+  }
+
+  // a keyframe goes out as a burst of a few hundred datagrams
+  int sndbuf = 4 << 20;
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  struct sockaddr_in saAddr;
+  memset(&saAddr, 0, sizeof(saAddr));
+  saAddr.sin_family = AF_INET;
+  saAddr.sin_addr.s_addr = htonl(0); // (IPADDR_ANY)
+  saAddr.sin_port = htons(params.port);
+  if (bind(fd, (struct sockaddr *)&saAddr, sizeof(saAddr)) != 0) {
+    perror("[SERVER] cant bind udp");
+    exit(-1);
+  }
+
+  ssrc = (uint32_t)now_us() ^ (uint32_t)getpid();
+  history.clear();
+  history_bytes = 0;
+  fec = fec_state();
+  if (getrandom(cookie_secret, sizeof(cookie_secret), 0) !=
+      sizeof(cookie_secret)) {
+    fprintf(stderr, "[SERVER] Can't generate the UDP cookie secret\n");
+    exit(-1);
+  }
+  return fd;
+}
+
+void udp_transport::close() {
+  if (fd < 0)
+    return;
+  ::close(fd);
+  fd = -1;
+  peers_by_addr.clear();
+}
+
+bool udp_transport::handle_input() {
+  bool keyframe = false;
+  uint8_t buf[1500];
+  while (true) {
+    sockaddr_in from;
+    socklen_t len = sizeof(from);
+    ssize_t m =
+        recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &len);
+    if (m < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    // a compound RTCP packet, see RFC 3550 6.1
+    size_t off = 0;
+    while (off + 4 <= (size_t)m) {
+      const uint8_t *p = buf + off;
+      size_t plen = (get16(p + 2) + 1) * 4;
+      if ((p[0] >> 6) != 2 || off + plen > (size_t)m)
+        break;
+      if (handle_rtcp(p, plen, from))
+        keyframe = true;
+      off += plen;
+    }
+  }
+  return keyframe;
+}
+
+// Returns true if a registered peer asks for a keyframe
+bool udp_transport::handle_rtcp(const uint8_t *p, size_t size,
+                                const sockaddr_in &from) {
+  if (p[1] == RTCP_APP) {
+    handle_app(p, size, from);
+    return false;
+  }
+  // everything else only from peers that proved they own their address
+  udp_peer *peer = find_peer(from);
+  if (peer == nullptr)
+    return false;
+  peer->last_seen_us = now_us();
+
+  uint8_t fmt = p[0] & 0x1f;
+  if (p[1] == RTCP_RR) {
+    // the block about our stream, the only one a receiver sends
+    if (fmt >= 1 && size >= 32)
+      peer->fraction_lost = p[12];
+    return false;
+  }
+  if (p[1] == RTCP_PSFB && fmt == 1)
+    return true;
+  if (p[1] != RTCP_RTPFB || fmt != 1)
+    return false;
+  // header, sender and media SSRC, then PID + BLP pairs
+  size_t budget = NACK_MAX_BYTES;
+  for (size_t off = 12; off + 4 <= size; off += 4) {
+    uint16_t pid = get16(p + off);
+    uint16_t blp = get16(p + off + 2);
+    for (int i = -1; i < 16; i++) {
+      if (i >= 0 && !(blp & (1 << i)))
+        continue;
+      if (budget == 0) {
+        peer->nacked++;
+        continue;
+      }
+      size_t sent = retransmit(*peer, pid + i + 1);
+      budget -= std::min(budget, sent);
+    }
+  }
+  return false;
+}
+
+// Hello and join, see udp_transport.hpp
+void udp_transport::handle_app(const uint8_t *p, size_t size,
+                               const sockaddr_in &from) {
+  if (size != RTCP_APP_SIZE || memcmp(p + 8, RTCP_APP_NAME, 4) != 0)
+    return;
+  uint8_t subtype = p[0] & 0x1f;
+  int64_t epoch = now_us() / COOKIE_EPOCH_US;
+
+  if (subtype == UDP_HELLO) {
+    uint8_t buf[RTCP_APP_SIZE];
+    buf[0] = 0x80 | UDP_COOKIE;
+    buf[1] = RTCP_APP;
+    put16(buf + 2, RTCP_APP_SIZE / 4 - 1);
+    put32(buf + 4, ssrc);
+    memcpy(buf + 8, RTCP_APP_NAME, 4);
+    make_cookie(from, epoch, buf + 12);
+    if (sendto(fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from,
+               sizeof(from)) < 0)
+      send_drops++;
+    return;
+  }
+  if (subtype != UDP_JOIN)
+    return;
+
+  // the cookie of the previous epoch too, a join may cross the boundary
+  uint8_t cookie[8];
+  for (int64_t e = epoch; e >= epoch - 1; e--) {
+    make_cookie(from, e, cookie);
+    // in constant time, not to tell how much of a guess was right
+    uint8_t diff = 0;
+    for (size_t i = 0; i < sizeof(cookie); i++)
+      diff |= cookie[i] ^ p[12 + i];
+    if (diff == 0) {
+      udp_peer *peer = add_peer(from);
+      if (peer)
+        peer->last_seen_us = now_us();
+      return;
+    }
+  }
+}
+
+static uint64_t rotl(uint64_t v, int b) { return (v << b) | (v >> (64 - b)); }
+
+static uint64_t get64le(const uint8_t *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+// SipHash-2-4, a keyed hash made for short inputs like this one
+static uint64_t siphash(const uint8_t key[16], const uint8_t *msg,
+                        size_t len) {
+  uint64_t k0 = get64le(key), k1 = get64le(key + 8);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL, v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL, v3 = k1 ^ 0x7465646279746573ULL;
+  auto rounds = [&](int n) {
+    for (int i = 0; i < n; i++) {
+      v0 += v1;
+      v1 = rotl(v1, 13) ^ v0;
+      v0 = rotl(v0, 32);
+      v2 += v3;
+      v3 = rotl(v3, 16) ^ v2;
+      v0 += v3;
+      v3 = rotl(v3, 21) ^ v0;
+      v2 += v1;
+      v1 = rotl(v1, 17) ^ v2;
+      v2 = rotl(v2, 32);
+    }
+  };
+
+  uint8_t last[8] = {};
+  size_t full = len & ~(size_t)7;
+  for (size_t i = 0; i < full; i += 8) {
+    uint64_t m = get64le(msg + i);
+    v3 ^= m;
+    rounds(2);
+    v0 ^= m;
+  }
+  memcpy(last, msg + full, len - full);
+  last[7] = (uint8_t)len;
+  uint64_t m = get64le(last);
+  v3 ^= m;
+  rounds(2);
+  v0 ^= m;
+  v2 ^= 0xff;
+  rounds(4);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// keyed hash of the address and port under a secret of this run
+void udp_transport::make_cookie(const sockaddr_in &from, int64_t epoch,
+                                uint8_t *cookie) {
+  uint8_t msg[14];
+  memcpy(msg, &from.sin_addr.s_addr, 4);
+  memcpy(msg + 4, &from.sin_port, 2);
+  for (int i = 0; i < 8; i++)
+    msg[6 + i] = (uint8_t)(epoch >> (i * 8));
+  uint64_t mac = siphash(cookie_secret, msg, sizeof(msg));
+  for (int i = 0; i < 8; i++)
+    cookie[i] = (uint8_t)(mac >> (i * 8));
+}
+
+udp_peer *udp_transport::find_peer(const sockaddr_in &from) {
+  auto it = peers_by_addr.find(peer_name(from));
+  return it != peers_by_addr.end() ? &it->second : nullptr;
+}
+
+udp_peer *udp_transport::add_peer(const sockaddr_in &from) {
+  std::string name = peer_name(from);
+  auto it = peers_by_addr.find(name);
+  if (it != peers_by_addr.end())
+    return &it->second;
+
+  if ((int)peers_by_addr.size() >= params.max_peers) {
+    if (params.max_peers != 1)
+      return nullptr;
+    // single receiver: the newest one replaces the old one
+    printf("[SERVER] Replacing peer %s\n",
+           peers_by_addr.begin()->first.c_str());
+    peers_by_addr.clear();
+  }
+
+  udp_peer &peer = peers_by_addr[name];
+  peer.addr = from;
+  printf("[SERVER] UDP peer %s, %zu peers\n", name.c_str(),
+         peers_by_addr.size());
+  return &peer;
+}
+
+bool udp_transport::send_frame(const uint8_t *data, size_t size,
+                               int64_t pts_us, bool keyframe) {
+  if (fd < 0)
+    return false;
+
+  bool need_keyframe = false;
+  for (auto &it : peers_by_addr) {
+    udp_peer &peer = it.second;
+    if (keyframe) {
+      peer.synced = true;
+      peer.keyframe_asked = false;
+    } else if (!peer.synced && !peer.keyframe_asked) {
+      peer.keyframe_asked = true;
+      need_keyframe = true;
+    }
+  }
+
+  // 90 kHz clock
+  uint32_t ts = (uint32_t)(pts_us * 9 / 100);
+
+  // every keyframe carries the parameter sets, so a receiver can start
+  // from any of them
+  std::vector<std::pair<const uint8_t *, size_t>> nals;
+  if (keyframe) {
+    size_t code_len, start = find_start_code(config.data(), config.size(), 0,
+                                             code_len);
+    while (start < config.size()) {
+      size_t begin = start + code_len;
+      start = find_start_code(config.data(), config.size(), begin, code_len);
+      nals.push_back({config.data() + begin, start - begin});
+    }
+  }
+  size_t code_len, start = find_start_code(data, size, 0, code_len);
+  if (start == size) {
+    // not Annex B, send it as a single unit
+    nals.push_back({data, size});
+  }
+  while (start < size) {
+    size_t begin = start + code_len;
+    start = find_start_code(data, size, begin, code_len);
+    size_t end = start;
+    // trailing zeros belong to the next start code
+    while (end > begin && data[end - 1] == 0 && start < size)
+      end--;
+    nals.push_back({data + begin, end - begin});
+  }
+
+  for (size_t i = 0; i < nals.size(); i++) {
+    if (nals[i].second == 0)
+      continue;
+    send_nal(nals[i].first, nals[i].second, ts, i + 1 == nals.size(),
+             keyframe, nullptr);
+  }
+  if (keyframe)
+    flush_fec();
+  return need_keyframe;
+}
+
+void udp_transport::set_config(const uint8_t *data, size_t size) {
+  config.assign(data, data + size);
+  // new codec parameters, everyone has to start over from a keyframe
+  for (auto &it : peers_by_addr)
+    it.second.synced = false;
+}
+
+void udp_transport::send_nal(const uint8_t *nal, size_t size, uint32_t ts,
+                             bool last, bool keyframe, udp_peer *only) {
+  if (size <= MAX_RTP_PAYLOAD) {
+    send_rtp(nullptr, 0, nal, size, ts, last, keyframe, only);
+    return;
+  }
+
+  // fragmentation unit: FU-A (H.264) or FU (HEVC), the NAL header is
+  // rebuilt by the receiver from the FU headers
+  uint8_t hdr[3];
+  size_t hdr_size, nal_hdr_size;
+  if (params.hevc) {
+    hdr[0] = (nal[0] & 0x81) | (49 << 1);
+    hdr[1] = nal[1];
+    hdr[2] = (nal[0] >> 1) & 0x3f;
+    hdr_size = 3;
+    nal_hdr_size = 2;
+  } else {
+    hdr[0] = (nal[0] & 0xe0) | 28;
+    hdr[1] = nal[0] & 0x1f;
+    hdr_size = 2;
+    nal_hdr_size = 1;
+  }
+  uint8_t type = hdr[hdr_size - 1];
+
+  size_t chunk = MAX_RTP_PAYLOAD - hdr_size;
+  for (size_t off = nal_hdr_size; off < size; off += chunk) {
+    size_t n = std::min(chunk, size - off);
+    bool first = off == nal_hdr_size;
+    bool end = off + n == size;
+    hdr[hdr_size - 1] = type | (first ? FU_START : 0) | (end ? FU_END : 0);
+    send_rtp(hdr, hdr_size, nal + off, n, ts, last && end, keyframe, only);
+  }
+}
+
+void udp_transport::send_rtp(const uint8_t *payload_hdr, size_t hdr_size,
+                             const uint8_t *payload, size_t size, uint32_t ts,
+                             bool marker, bool keyframe, udp_peer *only) {
+  uint16_t seq = next_seq++;
+  sent_packet &slot = new_history_packet(now_us());
+  slot.seq = seq;
+  slot.data.resize(RTP_HEADER_SIZE + hdr_size + size);
+  history_bytes += slot.data.size();
+
+  uint8_t *buf = slot.data.data();
+  buf[0] = 0x80; // version 2
+  buf[1] = (marker ? 0x80 : 0) | RTP_PT_VIDEO;
+  put16(buf + 2, seq);
+  put32(buf + 4, ts);
+  put32(buf + 8, ssrc);
+  if (hdr_size > 0)
+    memcpy(buf + RTP_HEADER_SIZE, payload_hdr, hdr_size);
+  memcpy(buf + RTP_HEADER_SIZE + hdr_size, payload, size);
+
+  send_to_peers(buf, slot.data.size(), only);
+  if (keyframe && params.fec_group > 0)
+    protect(buf, slot.data.size());
+}
+
+void udp_transport::send_to_peers(const uint8_t *buf, size_t size,
+                                  udp_peer *only) {
+  for (auto &it : peers_by_addr) {
+    udp_peer &peer = it.second;
+    if (!peer.synced || (only && only != &peer))
+      continue;
+    // a full socket buffer means the packet is lost, the receiver NACKs it
+    if (sendto(fd, buf, size, MSG_DONTWAIT, (struct sockaddr *)&peer.addr,
+               sizeof(peer.addr)) < 0)
+      send_drops++;
+    else
+      peer.sent_bytes += size;
+  }
+}
+
+// XOR parity over a group of packets, enough to rebuild any single one of
+// them without a round trip
+void udp_transport::protect(const uint8_t *rtp, size_t size) {
+  size_t len = size - RTP_HEADER_SIZE;
+  if (fec.count == 0) {
+    fec.base_seq = get16(rtp + 2);
+    fec.parity.assign(len, 0);
+    fec.byte0_xor = 0;
+    fec.byte1_xor = 0;
+    fec.ts_xor = 0;
+    fec.length_xor = 0;
+  }
+  // protection length is the longest payload, shorter ones count as padded
+  // with zeros
+  if (fec.parity.size() < len)
+    fec.parity.resize(len, 0);
+  for (size_t i = 0; i < len; i++)
+    fec.parity[i] ^= rtp[RTP_HEADER_SIZE + i];
+  fec.byte0_xor ^= rtp[0];
+  fec.byte1_xor ^= rtp[1];
+  fec.ts = get32(rtp + 4);
+  fec.ts_xor ^= fec.ts;
+  fec.length_xor ^= len;
+  if (++fec.count == params.fec_group)
+    flush_fec();
+}
+
+// One FEC packet as in RFC 5109 section 7: FEC header, a level 0 header
+// whose mask covers the group (the long mask past 16 packets), then the
+// parity of the payloads
+void udp_transport::flush_fec() {
+  if (fec.count == 0)
+    return;
+  bool long_mask = fec.count > 16;
+  size_t level_size = long_mask ? FEC_LEVEL_HEADER_SIZE : 4;
+  std::vector<uint8_t> buf(RTP_HEADER_SIZE + FEC_HEADER_SIZE + level_size +
+                           fec.parity.size());
+  buf[0] = 0x80;
+  buf[1] = RTP_PT_FEC;
+  put16(&buf[2], next_fec_seq++);
+  put32(&buf[4], fec.ts);
+  put32(&buf[8], ssrc + 1);
+
+  // E = 0, L, then the recovery of P, X and CC in place of the version
+  uint8_t *p = &buf[RTP_HEADER_SIZE];
+  p[0] = (long_mask ? 0x40 : 0) | (fec.byte0_xor & 0x3f);
+  p[1] = fec.byte1_xor;
+  put16(p + 2, fec.base_seq);
+  put32(p + 4, fec.ts_xor);
+  put16(p + 8, fec.length_xor);
+
+  // the group is consecutive from the base, bit 0 is the leftmost
+  uint8_t *level = p + FEC_HEADER_SIZE;
+  put16(level, fec.parity.size());
+  uint64_t mask = ~0ULL << (64 - fec.count);
+  for (size_t i = 0; i < level_size - 2; i++)
+    level[2 + i] = mask >> (56 - i * 8);
+  memcpy(level + level_size, fec.parity.data(), fec.parity.size());
+  send_to_peers(buf.data(), buf.size(), nullptr);
+  fec.count = 0;
+}
+
+// Appends a packet to the history, dropping the ones that are too old or
+// over its size, and reusing their buffers
+udp_transport::sent_packet &udp_transport::new_history_packet(int64_t now) {
+  while (!history.empty() &&
+         (history_bytes > RTP_HISTORY_BYTES ||
+          history.size() >= RTP_HISTORY_MAX ||
+          now - history.front().sent_us > RETRANSMIT_WINDOW_US)) {
+    sent_packet &old = history.front();
+    history_bytes -= old.data.size();
+    if (spare.size() < 64)
+      spare.push_back(std::move(old.data));
+    history.pop_front();
+  }
+  history.emplace_back();
+  sent_packet &slot = history.back();
+  slot.sent_us = now;
+  if (!spare.empty()) {
+    slot.data = std::move(spare.back());
+    spare.pop_back();
+  }
+  return slot;
+}
+
+// Returns the bytes sent again
+size_t udp_transport::retransmit(udp_peer &peer, uint16_t seq) {
+  peer.nacked++;
+  if (history.empty())
+    return 0;
+  uint16_t index = seq - history.front().seq;
+  if (index >= history.size())
+    return 0; // never sent or long gone
+  sent_packet &slot = history[index];
+  if (now_us() - slot.sent_us > RETRANSMIT_WINDOW_US)
+    return 0; // too late to be of any use
+  if (sendto(fd, slot.data.data(), slot.data.size(), MSG_DONTWAIT,
+             (struct sockaddr *)&peer.addr, sizeof(peer.addr)) < 0) {
+    send_drops++;
+    return 0;
+  }
+  peer.retransmitted++;
+  resent_bytes += slot.data.size();
+  return slot.data.size();
+}
+
+void udp_transport::update(int64_t now) {
+  int64_t elapsed = now - last_update_us;
+  last_update_us = now;
+  for (auto it = peers_by_addr.begin(); it != peers_by_addr.end();) {
+    udp_peer &peer = it->second;
+    if (now - peer.last_seen_us > PEER_TIMEOUT_US) {
+      printf("[SERVER] UDP peer %s timed out\n", it->first.c_str());
+      it = peers_by_addr.erase(it);
+      continue;
+    }
+    if (elapsed > 0 && elapsed < PEER_TIMEOUT_US) {
+      uint64_t rate = peer.sent_bytes * 1000000 / elapsed;
+      peer.throughput = rate * (256 - std::max(peer.fraction_lost, 0)) / 256;
+    }
+    peer.sent_bytes = 0;
+    if (peer.nacked > 0) {
+      printf("[SERVER] Peer %s: %lu nacked, %lu retransmitted\n",
+             it->first.c_str(), (unsigned long)peer.nacked,
+             (unsigned long)peer.retransmitted);
+      peer.nacked = peer.retransmitted = 0;
+    }
+    ++it;
+  }
+  if (send_drops > 0) {
+    printf("[SERVER] %lu datagrams dropped by the socket\n",
+           (unsigned long)send_drops);
+    send_drops = 0;
+  }
+}
+
+int udp_transport::feedback(uint64_t &throughput, int &fraction_lost) const {
+  int reporting = 0;
+  throughput = 0;
+  fraction_lost = 0;
+  for (auto &it : peers_by_addr) {
+    const udp_peer &peer = it.second;
+    if (!peer.synced || peer.fraction_lost < 0 || peer.throughput == 0)
+      continue;
+    reporting++;
+    if (throughput == 0 || peer.throughput < throughput)
+      throughput = peer.throughput;
+    fraction_lost = std::max(fraction_lost, peer.fraction_lost);
+  }
+  return reporting;
+}
+
+udp_receiver::~udp_receiver() { close(); }
+
+bool udp_receiver::connect(const std::string &address, int port,
+                           bool _hevc) {
+  hevc = _hevc;
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  std::string service = std::to_string(port);
+  if (getaddrinfo(address.c_str(), service.c_str(), &hints, &res) != 0) {
+    fprintf(stderr, "Can't resolve %s\n", address.c_str());
+    return false;
+  }
+  fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  // connected, so that only the server gets through
+  if (fd < 0 || ::connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+    fprintf(stderr, "Can't connect to %s:%d: %s\n", address.c_str(), port,
+            strerror(errno));
+    freeaddrinfo(res);
+    return false;
+  }
+  freeaddrinfo(res);
+
+  // a keyframe comes in as a burst of a few thousand datagrams
+  int rcvbuf = 8 << 20;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  ssrc = (uint32_t)now_us() ^ ((uint32_t)getpid() << 16) ^ (uint32_t)fd;
+  return true;
+}
+
+void udp_receiver::close() {
+  if (fd < 0)
+    return;
+  ::close(fd);
+  fd = -1;
+}
+
+bool udp_receiver::poll(int timeout_ms) {
+  if (fd < 0)
+    return false;
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  if (::poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR)
+    return false;
+
+  int64_t now = now_us();
+  uint8_t buf[2048];
+  while (true) {
+    ssize_t m = recv(fd, buf, sizeof(buf), 0);
+    if (m < 0) {
+      if (errno == EINTR)
+        continue;
+      // refused: nothing listens yet, the hello goes out again
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED)
+        break;
+      return false;
+    }
+    if (drop && drop(buf, m))
+      continue;
+    handle_datagram(buf, m, now);
+  }
+
+  if (state == JOINED && now - heard_us > SERVER_SILENCE_US)
+    state = HELLO; // the server restarted or forgot about us
+  if (state == HELLO) {
+    if (hello_us < 0 || now - hello_us >= HELLO_RETRY_US) {
+      uint8_t zeros[8] = {};
+      send_app(UDP_HELLO, zeros);
+      hello_us = now;
+    }
+    return true;
+  }
+  if (now - report_us >= REPORT_INTERVAL_US) {
+    send_report();
+    report_us = now;
+  }
+  find_missing(now);
+  assemble(now);
+  return true;
+}
+
+bool udp_receiver::next_frame(udp_frame &frame) {
+  if (frames.empty())
+    return false;
+  frame = std::move(frames.front());
+  frames.pop_front();
+  return true;
+}
+
+void udp_receiver::handle_datagram(const uint8_t *buf, size_t size,
+                                   int64_t now) {
+  if (size == RTCP_APP_SIZE && buf[1] == RTCP_APP &&
+      memcmp(buf + 8, RTCP_APP_NAME, 4) == 0) {
+    if ((buf[0] & 0x1f) == UDP_COOKIE) {
+      send_app(UDP_JOIN, buf + 12);
+      if (state != JOINED)
+        report_us = now;
+      state = JOINED;
+      heard_us = now;
+    }
+    return;
+  }
+  // no CSRCs or extensions, the server never adds any
+  if (size <= RTP_HEADER_SIZE || (buf[0] & 0xdf) != 0x80)
+    return;
+  heard_us = now;
+  uint8_t pt = buf[1] & 0x7f;
+  if (pt == RTP_PT_VIDEO)
+    add_media(buf, size);
+  else if (pt == RTP_PT_FEC)
+    add_fec(buf, size);
+}
+
+// Sequence number extended with the cycles, going by the highest one seen
+int64_t udp_receiver::extend(uint16_t seq) const {
+  if (highest_seq < 0)
+    return SEQ_OFFSET + seq;
+  return highest_seq + (int16_t)(seq - (uint16_t)highest_seq);
+}
+
+void udp_receiver::add_media(const uint8_t *buf, size_t size) {
+  int64_t seq = extend(get16(buf + 2));
+  // the first report already covers the packets since this one
+  if (reported_seq < 0)
+    reported_seq = seq - 1;
+  highest_seq = std::max(highest_seq, seq);
+  media_ssrc = get32(buf + 8);
+  if (next_seq < 0 || (!started && seq < next_seq))
+    next_seq = seq;
+  stats.packets++;
+  stats.bytes += size;
+  if (packets.count(seq))
+    return; // both a retransmission and the FEC made it
+  packets[seq].assign(buf, buf + size);
+  missing.erase(seq);
+}
+
+void udp_receiver::add_fec(const uint8_t *buf, size_t size) {
+  if (highest_seq < 0 || size < RTP_HEADER_SIZE + FEC_HEADER_SIZE + 4)
+    return;
+  const uint8_t *p = buf + RTP_HEADER_SIZE;
+  bool long_mask = p[0] & 0x40;
+  size_t level_size = long_mask ? FEC_LEVEL_HEADER_SIZE : 4;
+  const uint8_t *level = p + FEC_HEADER_SIZE;
+  if (size < RTP_HEADER_SIZE + FEC_HEADER_SIZE + level_size + get16(level))
+    return;
+
+  fec_packet f;
+  f.base = extend(get16(p + 2));
+  for (size_t i = 0; i < level_size - 2; i++)
+    f.mask |= (uint64_t)level[2 + i] << (56 - i * 8);
+  f.data.assign(buf, buf + size);
+  fec.push_back(std::move(f));
+  stats.packets++;
+  stats.bytes += size;
+}
+
+// Notes the holes below the highest packet and tries to fill them: from
+// the FEC first, then by asking the server again
+void udp_receiver::find_missing(int64_t now) {
+  if (next_seq < 0)
+    return;
+  for (int64_t seq = next_seq; seq < highest_seq; seq++) {
+    if (!packets.count(seq) && !missing.count(seq)) {
+      missing[seq].since_us = now;
+      holes++;
+    }
+  }
+  if (missing.empty())
+    return;
+
+  // a recovered packet can complete another group
+  bool progress = true;
+  while (progress && !missing.empty()) {
+    progress = false;
+    for (const fec_packet &f : fec)
+      progress |= recover(f);
+  }
+
+  if (!nack)
+    return;
+  std::vector<int64_t> seqs;
+  for (auto &it : missing) {
+    missing_packet &mp = it.second;
+    if (mp.tries >= NACK_MAX_TRIES || now - mp.nacked_us < NACK_RETRY_US)
+      continue;
+    mp.tries++;
+    mp.nacked_us = now;
+    seqs.push_back(it.first);
+  }
+  if (!seqs.empty()) {
+    send_nacks(seqs);
+    stats.nacked += seqs.size();
+  }
+}
+
+// Rebuilds the packet of a group that has exactly one of them missing, as in
+// RFC 5109 section 8
+bool udp_receiver::recover(const fec_packet &f) {
+  int64_t lost = -1;
+  for (int i = 0; i < 64; i++) {
+    if (!(f.mask & (1ULL << (63 - i))) || packets.count(f.base + i))
+      continue;
+    if (lost >= 0)
+      return false; // more than one
+    lost = f.base + i;
+  }
+  if (lost < 0 || lost < next_seq)
+    return false;
+
+  const uint8_t *p = f.data.data() + RTP_HEADER_SIZE;
+  size_t level_size = p[0] & 0x40 ? FEC_LEVEL_HEADER_SIZE : 4;
+  const uint8_t *level = p + FEC_HEADER_SIZE;
+  size_t protection = get16(level);
+  uint8_t byte0 = p[0], byte1 = p[1];
+  uint32_t ts = get32(p + 4);
+  uint16_t length = get16(p + 8);
+  std::vector<uint8_t> payload(level + level_size, level + level_size +
+                                                       protection);
+  uint32_t media = 0;
+  for (int i = 0; i < 64; i++) {
+    if (!(f.mask & (1ULL << (63 - i))) || f.base + i == lost)
+      continue;
+    const std::vector<uint8_t> &q = packets[f.base + i];
+    byte0 ^= q[0];
+    byte1 ^= q[1];
+    ts ^= get32(&q[4]);
+    length ^= q.size() - RTP_HEADER_SIZE;
+    media = get32(&q[8]);
+    size_t n = std::min(protection, q.size() - RTP_HEADER_SIZE);
+    for (size_t k = 0; k < n; k++)
+      payload[k] ^= q[RTP_HEADER_SIZE + k];
+  }
+  if (length > protection)
+    return false;
+
+  std::vector<uint8_t> &rtp = packets[lost];
+  rtp.resize(RTP_HEADER_SIZE + length);
+  rtp[0] = 0x80 | (byte0 & 0x3f);
+  rtp[1] = byte1;
+  put16(&rtp[2], (uint16_t)lost);
+  put32(&rtp[4], ts);
+  put32(&rtp[8], media);
+  memcpy(&rtp[RTP_HEADER_SIZE], payload.data(), length);
+  missing.erase(lost);
+  stats.recovered++;
+  return true;
+}
+
+// Hands out the frames that are complete, in order, and gives up on the
+// ones the server can't repair any more
+void udp_receiver::assemble(int64_t now) {
+  while (next_seq >= 0) {
+    int64_t seq = next_seq;
+    bool complete = false;
+    for (auto it = packets.find(seq); it != packets.end() && it->first == seq;
+         ++it, ++seq) {
+      if (it->second[1] & 0x80) {
+        complete = true;
+        break;
+      }
+    }
+    if (complete) {
+      emit_frame(next_seq, seq, now);
+      next_seq = seq + 1;
+      started = true;
+      continue;
+    }
+
+    auto hole = missing.find(seq);
+    if (hole == missing.end() || now - hole->second.since_us < LOSS_GIVE_UP_US)
+      break;
+    // skip to the end of the broken frame, once it came in
+    auto end = packets.upper_bound(seq);
+    while (end != packets.end() && !(end->second[1] & 0x80))
+      ++end;
+    if (end == packets.end())
+      break;
+    for (int64_t k = next_seq; k <= end->first; k++) {
+      if (!packets.count(k))
+        stats.lost++;
+    }
+    next_seq = end->first + 1;
+    started = true;
+    dropped++;
+    waiting_keyframe = true;
+    if (pli_us < 0 || now - pli_us >= PLI_RETRY_US)
+      request_keyframe();
+  }
+
+  missing.erase(missing.begin(), missing.lower_bound(next_seq));
+  while (packets.size() > RECEIVED_KEEP && packets.begin()->first < next_seq)
+    packets.erase(packets.begin());
+  while (!fec.empty() && fec.front().base + 64 < next_seq)
+    fec.pop_front();
+}
+
+void udp_receiver::emit_frame(int64_t first, int64_t last, int64_t now) {
+  udp_frame frame;
+  const std::vector<uint8_t> &rtp = packets[first];
+  frame.pts = (int64_t)get32(&rtp[4]) * 100 / 9;
+  for (int64_t seq = first; seq <= last; seq++)
+    depacketize(packets[seq], frame);
+
+  if (waiting_keyframe && !frame.keyframe) {
+    // it references something we don't have
+    dropped++;
+    if (pli_us < 0 || now - pli_us >= PLI_RETRY_US)
+      request_keyframe();
+    return;
+  }
+  waiting_keyframe = false;
+  frame.dropped = dropped;
+  dropped = 0;
+  frames.push_back(std::move(frame));
+}
+
+// Single NAL unit packets and FU-A/FU fragments back to Annex B
+void udp_receiver::depacketize(const std::vector<uint8_t> &rtp,
+                               udp_frame &frame) {
+  static const uint8_t start_code[4] = {0, 0, 0, 1};
+  const uint8_t *p = rtp.data() + RTP_HEADER_SIZE;
+  size_t size = rtp.size() - RTP_HEADER_SIZE;
+  size_t hdr_size = hevc ? 3 : 2;
+  uint8_t type = hevc ? (p[0] >> 1) & 0x3f : p[0] & 0x1f;
+  bool fu = type == (hevc ? 49 : 28);
+  if (fu && size <= hdr_size)
+    return;
+
+  const uint8_t *data = p;
+  uint8_t nal_hdr[2];
+  size_t nal_hdr_size = 0;
+  if (fu) {
+    uint8_t fu_hdr = p[hdr_size - 1];
+    type = fu_hdr & (hevc ? 0x3f : 0x1f);
+    data += hdr_size;
+    size -= hdr_size;
+    if (!(fu_hdr & FU_START)) {
+      frame.data.insert(frame.data.end(), data, data + size);
+      return;
+    }
+    if (hevc) {
+      nal_hdr[0] = (p[0] & 0x81) | (type << 1);
+      nal_hdr[1] = p[1];
+      nal_hdr_size = 2;
+    } else {
+      nal_hdr[0] = (p[0] & 0xe0) | type;
+      nal_hdr_size = 1;
+    }
+  }
+
+  if (hevc ? (type >= 16 && type <= 21) || (type >= 32 && type <= 34)
+           : type == 5 || type == 7)
+    frame.keyframe = true;
+  frame.data.insert(frame.data.end(), start_code, start_code + 4);
+  frame.data.insert(frame.data.end(), nal_hdr, nal_hdr + nal_hdr_size);
+  frame.data.insert(frame.data.end(), data, data + size);
+}
+
+void udp_receiver::request_keyframe() {
+  if (fd < 0)
+    return;
+  uint8_t buf[12];
+  buf[0] = 0x80 | 1; // FMT 1: PLI
+  buf[1] = RTCP_PSFB;
+  put16(buf + 2, sizeof(buf) / 4 - 1);
+  put32(buf + 4, ssrc);
+  put32(buf + 8, media_ssrc);
+  send(fd, buf, sizeof(buf), MSG_DONTWAIT);
+  pli_us = now_us();
+  stats.keyframe_requests++;
+}
+
+void udp_receiver::send_app(uint8_t subtype, const uint8_t *data) {
+  uint8_t buf[RTCP_APP_SIZE];
+  buf[0] = 0x80 | subtype;
+  buf[1] = RTCP_APP;
+  put16(buf + 2, RTCP_APP_SIZE / 4 - 1);
+  put32(buf + 4, ssrc);
+  memcpy(buf + 8, RTCP_APP_NAME, 4);
+  memcpy(buf + 12, data, 8);
+  send(fd, buf, sizeof(buf), MSG_DONTWAIT);
+}
+
+// Receiver report with a single block, it also keeps us registered. The
+// fraction lost counts the packets that went missing on the way, even the
+// repaired ones, which is what the server adapts its bitrate to. The
+// cumulative count is what stayed lost.
+void udp_receiver::send_report() {
+  uint8_t buf[32];
+  size_t size = 8;
+  buf[0] = 0x80;
+  buf[1] = RTCP_RR;
+  put32(buf + 4, ssrc);
+  if (highest_seq >= 0) {
+    int64_t expected = highest_seq - reported_seq;
+    uint64_t lost = holes - reported_holes;
+    uint8_t fraction =
+        expected > 0 ? (uint8_t)std::min<int64_t>(255, lost * 256 / expected)
+                     : 0;
+    buf[0] |= 1;
+    put32(buf + 8, media_ssrc);
+    put32(buf + 12, ((uint32_t)fraction << 24) | (stats.lost & 0xffffff));
+    put32(buf + 16, (uint32_t)(highest_seq - SEQ_OFFSET));
+    // no jitter, and no sender reports to point at
+    memset(buf + 20, 0, 12);
+    size = 32;
+    reported_seq = highest_seq;
+    reported_holes = holes;
+  }
+  put16(buf + 2, size / 4 - 1);
+  send(fd, buf, size, MSG_DONTWAIT);
+}
+
+// Generic NACKs (RFC 4585 6.2.1), seqs in ascending order
+void udp_receiver::send_nacks(const std::vector<int64_t> &seqs) {
+  uint8_t buf[MAX_NACK_PACKET];
+  size_t size = 12;
+  for (size_t i = 0; i < seqs.size();) {
+    int64_t pid = seqs[i];
+    uint16_t blp = 0;
+    for (i++; i < seqs.size() && seqs[i] - pid <= 16; i++)
+      blp |= 1 << (seqs[i] - pid - 1);
+    put16(buf + size, (uint16_t)pid);
+    put16(buf + size + 2, blp);
+    size += 4;
+    if (size + 4 > sizeof(buf) || i == seqs.size()) {
+      buf[0] = 0x80 | 1; // FMT 1: generic NACK
+      buf[1] = RTCP_RTPFB;
+      put16(buf + 2, size / 4 - 1);
+      put32(buf + 4, ssrc);
+      put32(buf + 8, media_ssrc);
+      send(fd, buf, size, MSG_DONTWAIT);
+      size = 12;
+    }
+  }
+}
@@ -0,0 +1,246 @@
+#ifndef UDP_TRANSPORT_H
+#define UDP_TRANSPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+
+// RTP payload types
+#define RTP_PT_VIDEO 96
+#define RTP_PT_FEC 127 // "ulpfec"
+
+// RFC 5109 FEC header and level 0 header with the long (48 bit) mask
+#define FEC_HEADER_SIZE 10
+#define FEC_LEVEL_HEADER_SIZE 8
+#define FEC_MAX_GROUP 48
+
+// Registration, RTCP APP packets (RFC 3550 6.7) named "WLSS", the subtype
+// says which step it is. Every one carries 8 bytes: zeros in the hello,
+// the cookie in the other two, so the answer is never bigger than what
+// asked for it.
+#define RTCP_APP 204
+#define RTCP_APP_NAME "WLSS"
+#define RTCP_APP_SIZE 20
+#define UDP_HELLO 0  // receiver -> server
+#define UDP_COOKIE 1 // server -> receiver
+#define UDP_JOIN 2   // receiver -> server, with the cookie
+
+// RTP/UDP alternative to the TCP stream, for lossy links where waiting for
+// TCP to retransmit stalls everything behind the lost segment.
+//
+// Receivers register with a return routability check: they send an RTCP
+// APP hello, get a cookie bound to their address back and join by echoing
+// it. Nothing else is answered before that, so a forged source address
+// can neither take the stream over nor have it (or retransmissions)
+// reflected at someone else. A receiver report every second then keeps
+// them alive and tells the loss --abr adapts to. They get the video as
+// RTP, H.264/HEVC NAL units fragmented as in RFC 6184/7798. Lost packets
+// are recovered from a retransmission buffer when the receiver sends a
+// generic NACK (RFC 4585), a PLI asks for a keyframe. Keyframes can
+// additionally be protected with ULP FEC packets (RFC 5109, a single level
+// 0 XOR parity), one for every `fec_group` packets, on their own SSRC and
+// sequence numbers.
+struct udp_params {
+  int port = 53516;
+  int max_peers = 1;
+  bool hevc = false;
+  int fec_group = 0; // 0 disables FEC
+};
+
+struct udp_peer {
+  sockaddr_in addr;
+  int64_t last_seen_us = 0;
+  bool synced = false; // false until the peer gets a keyframe
+  bool keyframe_asked = false;
+
+  uint64_t nacked = 0;        // packets asked again
+  uint64_t retransmitted = 0; // of which still in the buffer
+
+  // for the adaptive bitrate, over the last update() interval
+  uint64_t sent_bytes = 0;
+  uint64_t throughput = 0; // bytes per second that weren't reported lost
+  int fraction_lost = -1;  // of 256, from the last receiver report
+};
+
+class udp_transport {
+
+public:
+  ~udp_transport();
+
+  int init(const udp_params &params); // returns the socket
+  void close();
+
+  // Reads what the receivers sent, returns true if one wants a keyframe
+  bool handle_input();
+  // Sends an encoded access unit to every receiver, returns true if one of
+  // them needs a keyframe to start decoding
+  bool send_frame(const uint8_t *data, size_t size, int64_t pts_us,
+                  bool keyframe);
+  // Codec extradata, sent ahead of the first keyframe of every receiver
+  void set_config(const uint8_t *data, size_t size);
+  // Forgets silent receivers and prints statistics, once per second
+  void update(int64_t now_us);
+  // What the worst receiver got over the last update() interval, in bytes
+  // per second, and the loss it reported (out of 256). Returns how many
+  // receivers sent reports.
+  int feedback(uint64_t &throughput, int &fraction_lost) const;
+
+  int peers() const { return (int)peers_by_addr.size(); }
+  // sent again for NACKs, since the start
+  uint64_t retransmitted_bytes() const { return resent_bytes; }
+
+private:
+  // consecutive sequence numbers, history.front() is the oldest
+  struct sent_packet {
+    uint16_t seq = 0;
+    int64_t sent_us = 0;
+    std::vector<uint8_t> data;
+  };
+
+  // the recovery fields of RFC 5109 section 7.3
+  struct fec_state {
+    std::vector<uint8_t> parity; // XOR of the protected RTP payloads
+    uint16_t base_seq = 0;
+    int count = 0;
+    uint8_t byte0_xor = 0; // P, X, CC
+    uint8_t byte1_xor = 0; // marker and payload type
+    uint32_t ts_xor = 0;
+    uint16_t length_xor = 0;
+    uint32_t ts = 0; // of the last protected packet
+  };
+
+  bool handle_rtcp(const uint8_t *buf, size_t size, const sockaddr_in &from);
+  void handle_app(const uint8_t *buf, size_t size, const sockaddr_in &from);
+  void make_cookie(const sockaddr_in &from, int64_t epoch, uint8_t *cookie);
+  udp_peer *find_peer(const sockaddr_in &from);
+  udp_peer *add_peer(const sockaddr_in &from);
+  void send_nal(const uint8_t *nal, size_t size, uint32_t ts, bool last,
+                bool keyframe, udp_peer *only);
+  void send_rtp(const uint8_t *payload_hdr, size_t hdr_size,
+                const uint8_t *payload, size_t size, uint32_t ts, bool marker,
+                bool keyframe, udp_peer *only);
+  void send_to_peers(const uint8_t *buf, size_t size, udp_peer *only);
+  void protect(const uint8_t *rtp, size_t size);
+  void flush_fec();
+  size_t retransmit(udp_peer &peer, uint16_t seq);
+  sent_packet &new_history_packet(int64_t now);
+
+  udp_params params;
+  int fd = -1;
+  uint32_t ssrc = 0;
+  uint16_t next_seq = 0;
+  uint16_t next_fec_seq = 0;
+
+  std::map<std::string, udp_peer> peers_by_addr;
+  std::vector<uint8_t> config;
+  std::deque<sent_packet> history;
+  size_t history_bytes = 0;
+  std::vector<std::vector<uint8_t>> spare; // buffers of dropped packets
+  fec_state fec;
+  uint8_t cookie_secret[16];
+
+  uint64_t send_drops = 0;
+  uint64_t resent_bytes = 0;
+  int64_t last_update_us = 0;
+};
+
+// An access unit put back together by udp_receiver
+struct udp_frame {
+  std::vector<uint8_t> data; // Annex B
+  int64_t pts = 0;           // microseconds, from the RTP timestamp
+  bool keyframe = false;
+  uint32_t dropped = 0; // frames given up on since the previous one
+};
+
+struct udp_receiver_stats {
+  uint64_t packets = 0;
+  uint64_t bytes = 0;
+  uint64_t nacked = 0;    // sequence numbers asked again
+  uint64_t recovered = 0; // rebuilt from FEC packets
+  uint64_t lost = 0;      // neither retransmitted nor recovered in time
+  uint64_t keyframe_requests = 0;
+};
+
+// Receiver side, for the headless receiver and the loss test. Registers
+// with the server, puts the access units back together, repairs single
+// losses from the FEC packets and NACKs the rest. A frame that is still
+// incomplete when the server can't retransmit any more is given up on,
+// and everything up to the next keyframe with it.
+class udp_receiver {
+
+public:
+  ~udp_receiver();
+
+  bool connect(const std::string &address, int port, bool hevc);
+  void close();
+
+  // Waits up to timeout_ms for datagrams and handles them, then sends what
+  // is due: the registration, receiver reports and NACKs. Returns false if
+  // the socket failed.
+  bool poll(int timeout_ms);
+  bool next_frame(udp_frame &frame);
+  void request_keyframe();
+  bool joined() const { return state == JOINED; }
+
+  udp_receiver_stats stats;
+  // NACKs can be turned off, to see what the FEC repairs alone
+  bool nack = true;
+  // drops the incoming datagrams it returns true for, to simulate loss
+  std::function<bool(const uint8_t *, size_t)> drop;
+
+private:
+  enum join_state { HELLO, JOINED };
+
+  struct missing_packet {
+    int64_t since_us = 0;
+    int64_t nacked_us = 0;
+    int tries = 0;
+  };
+
+  struct fec_packet {
+    int64_t base = 0;
+    uint64_t mask = 0; // bit 63 is the base
+    std::vector<uint8_t> data;
+  };
+
+  void handle_datagram(const uint8_t *buf, size_t size, int64_t now);
+  void add_media(const uint8_t *buf, size_t size);
+  void add_fec(const uint8_t *buf, size_t size);
+  int64_t extend(uint16_t seq) const;
+  void find_missing(int64_t now);
+  bool recover(const fec_packet &fec);
+  void assemble(int64_t now);
+  void emit_frame(int64_t first, int64_t last, int64_t now);
+  void depacketize(const std::vector<uint8_t> &rtp, udp_frame &frame);
+  void send_app(uint8_t subtype, const uint8_t *data);
+  void send_report();
+  void send_nacks(const std::vector<int64_t> &seqs);
+
+  int fd = -1;
+  bool hevc = false;
+  uint32_t ssrc = 0, media_ssrc = 0;
+  join_state state = HELLO;
+  int64_t hello_us = -1, heard_us = 0, report_us = 0, pli_us = -1;
+
+  // extended sequence numbers, starting at 16 cycles to stay positive
+  int64_t highest_seq = -1;
+  int64_t next_seq = -1; // first packet of the next frame
+  bool started = false;  // a frame was put together
+  bool waiting_keyframe = true;
+  uint32_t dropped = 0;
+  int64_t reported_seq = -1;
+  // packets found missing, repaired later or not
+  uint64_t holes = 0, reported_holes = 0;
+
+  std::map<int64_t, std::vector<uint8_t>> packets;
+  std::map<int64_t, missing_packet> missing;
+  std::deque<fec_packet> fec;
+  std::deque<udp_frame> frames;
+};
+
+#endif
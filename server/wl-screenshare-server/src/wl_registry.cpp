@@ -22,6 +22,8 @@ static void handle_global(void *, struct wl_registry *registry, uint32_t name,
     xdg_output_manager = (zxdg_output_manager_v1 *)wl_registry_bind(
         registry, name, &zxdg_output_manager_v1_interface,
         2); // version 2 for name & description, if available
+  } else if (strcmp(interface, wl_shm_interface.name) == 0) {
+    shm = (wl_shm *)wl_registry_bind(registry, name, &wl_shm_interface, 1);
   } else if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0) {
     dmabuf = (zwp_linux_dmabuf_v1 *)wl_registry_bind(
         registry, name, &zwp_linux_dmabuf_v1_interface, 4);
@@ -1,4 +1,6 @@
 #include "src/zwlr_screencopy.hpp"
+#include "src/dmabuf_pool.hpp"
+#include "src/pipeline_stats.hpp"
 #include "src/zwp_linux_buffer.hpp"
 
 #include <fcntl.h>
@@ -13,16 +15,20 @@
 #include <wayland-client-protocol.h>
 #include <xf86drm.h>
 
-bool can_read_buffer = true;
+int frames_in_flight = 0;
+int frames_starved = 0;
 bool use_dmabuf = false;
 bool use_damage = true;
 bool use_hwupload = false;
 struct gbm_device *gbm_device = NULL;
 struct zwp_linux_dmabuf_v1 *dmabuf = NULL;
-atomic_queue<wf_buffer *> buffer_queue;
+struct wl_shm *shm = NULL;
+atomic_queue<wf_buffer *, BUFFER_QUEUE_SIZE>
+    buffer_queue(overflow_policy::drop_oldest);
+std::atomic<bool> damage_lost{false};
 struct zwlr_screencopy_manager_v1 *screencopy_manager = NULL;
 
-static wl_shm_format drm_to_wl_shm_format(uint32_t format) {
+wl_shm_format drm_to_wl_shm_format(uint32_t format) {
   if (format == GBM_FORMAT_ARGB8888) {
     return WL_SHM_FORMAT_ARGB8888;
   } else if (format == GBM_FORMAT_XRGB8888) {
@@ -32,7 +38,7 @@ static wl_shm_format drm_to_wl_shm_format(uint32_t format) {
   }
 }
 
-static uint32_t wl_shm_to_drm_format(uint32_t format) {
+uint32_t wl_shm_to_drm_format(uint32_t format) {
   if (format == WL_SHM_FORMAT_ARGB8888) {
     return GBM_FORMAT_ARGB8888;
   } else if (format == WL_SHM_FORMAT_XRGB8888) {
@@ -42,16 +48,6 @@ static uint32_t wl_shm_to_drm_format(uint32_t format) {
   }
 }
 
-static void free_shm_buffer(wf_buffer &buffer) {
-  if (buffer.wl_buffer == NULL) {
-    return;
-  }
-
-  munmap(buffer.data, buffer.size);
-  wl_buffer_destroy(buffer.wl_buffer);
-  buffer.wl_buffer = NULL;
-}
-
 InputFormat get_input_format(wf_buffer &buffer) {
   if (use_dmabuf && !use_hwupload) {
     return INPUT_FORMAT_DMABUF;
@@ -90,13 +86,38 @@ InputFormat get_input_format(wf_buffer &buffer) {
   }
 }
 
+// No buffer for the frame. With all of them taken, its slot stays counted
+// until one is released, see dmabuf_pool::wakeup_fd(), instead of the frame
+// being requested again right away.
+static void skip_frame(zwlr_screencopy_frame_v1 *frame) {
+  zwlr_screencopy_frame_v1_destroy(frame);
+  damage_lost = true;
+  if (buffer_pool.exhausted()) {
+    if (frames_starved++ == 0)
+      std::cerr << "No free capture buffer, waiting for one" << std::endl;
+  } else {
+    std::cerr << "Can't allocate a capture buffer, skipping a frame"
+              << std::endl;
+    frames_in_flight--;
+  }
+}
+
 static void frame_handle_buffer(void *data,
                                 struct zwlr_screencopy_frame_v1 *frame,
                                 uint32_t format, uint32_t width,
                                 uint32_t height, uint32_t stride) {
+  if (use_dmabuf) {
+    return;
+  }
 
-  // DISABLED
-  return;
+  wf_buffer *buffer = buffer_pool.acquire(width, height, format, stride);
+  if (buffer == nullptr) {
+    skip_frame(frame);
+    return;
+  }
+  buffer->y_invert = false;
+  buffer->damage.clear();
+  zwlr_screencopy_frame_v1_set_user_data(frame, buffer);
 }
 
 static void frame_handle_flags(void *data, struct zwlr_screencopy_frame_v1 *,
@@ -113,6 +134,9 @@ static void frame_handle_ready(void *data,
   wf_buffer *buffer = (wf_buffer *)data;
   buffer->presented.tv_sec = ((1ll * tv_sec_hi) << 32ll) | tv_sec_low;
   buffer->presented.tv_nsec = tv_nsec;
+  buffer->base_usec =
+      buffer->presented.tv_sec * 1000000ll + buffer->presented.tv_nsec / 1000;
+  buffer->ready_usec = monotonic_usec();
 
   if (!frame_writer) {
     params.format = get_input_format(*buffer);
@@ -123,15 +147,39 @@ static void frame_handle_ready(void *data,
     frame_writer = std::unique_ptr<FrameWriter>(new FrameWriter(params));
   }
 
-  buffer_queue.push(buffer);
+  // flagged before the oldest frame goes, so that the encoder can't take
+  // the one after it without noticing
+  if (buffer_queue.size() >= BUFFER_QUEUE_SIZE)
+    damage_lost = true;
+  wf_buffer *dropped = nullptr;
+  if (!buffer_queue.push(buffer, &dropped) && dropped) {
+    std::cerr << "Encoder is falling behind, dropping a frame" << std::endl;
+    buffer_pool.release(dropped);
+  }
+  zwlr_screencopy_frame_v1_destroy(frame);
+  frames_in_flight--;
+}
+
+void abort_frame(zwlr_screencopy_frame_v1 *frame) {
+  damage_lost = true;
   zwlr_screencopy_frame_v1_destroy(frame);
-  can_read_buffer = true;
+  frames_in_flight--;
 }
 
-static void frame_handle_failed(void *, struct zwlr_screencopy_frame_v1 *) {}
+static void frame_handle_failed(void *data,
+                                struct zwlr_screencopy_frame_v1 *frame) {
+  if (data)
+    buffer_pool.release((wf_buffer *)data);
+  abort_frame(frame);
+}
 
-static void frame_handle_damage(void *, struct zwlr_screencopy_frame_v1 *,
-                                uint32_t, uint32_t, uint32_t, uint32_t) {}
+static void frame_handle_damage(void *data, struct zwlr_screencopy_frame_v1 *,
+                                uint32_t x, uint32_t y, uint32_t width,
+                                uint32_t height) {
+  wf_buffer *buffer = (wf_buffer *)data;
+  if (buffer)
+    buffer->damage.push_back({(int)x, (int)y, (int)width, (int)height});
+}
 
 static void frame_handle_linux_dmabuf(void *data,
                                       struct zwlr_screencopy_frame_v1 *frame,
@@ -141,42 +189,25 @@ static void frame_handle_linux_dmabuf(void *data,
     return;
   }
 
-  wf_buffer *buffer = (wf_buffer *)data;
-
-  buffer->format = drm_to_wl_shm_format(format);
-  buffer->drm_format = format;
-  buffer->width = width;
-  buffer->height = height;
-
-  const uint64_t modifier = 0; // DRM_FORMAT_MOD_LINEAR
-  buffer->bo = gbm_bo_create_with_modifiers(
-      gbm_device, buffer->width, buffer->height, format, &modifier, 1);
-  if (buffer->bo == NULL) {
-    buffer->bo =
-        gbm_bo_create(gbm_device, buffer->width, buffer->height, format,
-                      GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING);
-  }
-  if (buffer->bo == NULL) {
-    std::cerr << "Failed to create gbm bo" << std::endl;
-    /*exit_main_loop = true;*/
+  wf_buffer *buffer = buffer_pool.acquire(width, height, format);
+  if (buffer == nullptr) {
+    skip_frame(frame);
     return;
   }
+  buffer->y_invert = false;
+  buffer->damage.clear();
+  zwlr_screencopy_frame_v1_set_user_data(frame, buffer);
 
-  buffer->stride = gbm_bo_get_stride(buffer->bo);
-
-  buffer->params = zwp_linux_dmabuf_v1_create_params(dmabuf);
-
-  uint64_t mod = gbm_bo_get_modifier(buffer->bo);
-  int fd = gbm_bo_get_fd(buffer->bo);
-  zwp_linux_buffer_params_v1_add(
-      buffer->params, fd, 0, gbm_bo_get_offset(buffer->bo, 0),
-      gbm_bo_get_stride(buffer->bo), mod >> 32, mod & 0xffffffff);
+  if (buffer->wl_buffer) {
+    copy_frame(frame, buffer);
+    return;
+  }
 
-  // params_listener will free fdata
+  // first use of this buffer, params_listener will free fdata
   frame_data_t *fdata = new frame_data_t;
   fdata->frame = frame;
   fdata->buffer = buffer;
-  fdata->bo_fd = fd;
+  fdata->bo_fd = buffer->bo_fd;
 
   zwp_linux_buffer_params_v1_add_listener(buffer->params, &params_listener,
                                           fdata);
@@ -184,8 +215,22 @@ static void frame_handle_linux_dmabuf(void *data,
                                     buffer->height, format, 0);
 }
 
-static void frame_handle_buffer_done(void *,
-                                     struct zwlr_screencopy_frame_v1 *) {}
+void copy_frame(zwlr_screencopy_frame_v1 *frame, wf_buffer *buffer) {
+  if (use_damage) {
+    zwlr_screencopy_frame_v1_copy_with_damage(frame, buffer->wl_buffer);
+  } else {
+    zwlr_screencopy_frame_v1_copy(frame, buffer->wl_buffer);
+  }
+}
+
+// The shm buffer is copied into once all the buffer types were offered,
+// dmabuf ones as soon as their wl_buffer exists
+static void frame_handle_buffer_done(void *data,
+                                     struct zwlr_screencopy_frame_v1 *frame) {
+  if (!use_dmabuf && data) {
+    copy_frame(frame, (wf_buffer *)data);
+  }
+}
 
 const struct zwlr_screencopy_frame_v1_listener frame_listener = {
     .buffer = frame_handle_buffer,
@@ -1,3 +1,6 @@
+#ifndef ZWLR_SCREENCOPY_H
+#define ZWLR_SCREENCOPY_H
+
 #include "src/atomic_queue.hpp"
 #include "src/frame-writer.hpp"
 
@@ -7,7 +10,7 @@
 
 struct wf_buffer {
   struct gbm_bo *bo = nullptr;
-  int bo_fd;
+  int bo_fd = -1;
   zwp_linux_buffer_params_v1 *params = nullptr;
   struct wl_buffer *wl_buffer = nullptr;
   void *data = nullptr;
@@ -19,6 +22,12 @@ struct wf_buffer {
 
   timespec presented;
   uint64_t base_usec;
+  int64_t ready_usec; // when the copy was done, CLOCK_MONOTONIC
+  // what changed since the frame was requested, only with copy_with_damage
+  std::vector<damage_rect> damage;
+
+  // taken from the pool by a capture, until the encoder is done with it
+  std::atomic<bool> in_use{false};
 };
 struct frame_data_t {
   zwlr_screencopy_frame_v1 *frame = NULL;
@@ -26,14 +35,32 @@ struct frame_data_t {
   int bo_fd;
 };
 
-extern bool can_read_buffer;
+extern int frames_in_flight;
+// of frames_in_flight, given up for lack of a free buffer and waiting for
+// one to come back before they are requested again
+extern int frames_starved;
 extern bool use_dmabuf;
 extern bool use_damage;
 extern struct gbm_device *gbm_device;
 extern struct zwp_linux_dmabuf_v1 *dmabuf;
-extern atomic_queue<wf_buffer *> buffer_queue;
+extern struct wl_shm *shm;
+// capture -> encoder, when the encoder falls behind the oldest frame goes
+#define BUFFER_QUEUE_SIZE 4
+// frames requested from the compositor at the same time
+#define MAX_CAPTURE_DEPTH 3
+extern atomic_queue<wf_buffer *, BUFFER_QUEUE_SIZE> buffer_queue;
+// a frame was dropped or failed, and what it changed with it: the next one
+// the encoder gets has to be taken as changed all over
+extern std::atomic<bool> damage_lost;
 
 extern const struct zwlr_screencopy_frame_v1_listener frame_listener;
 extern struct zwlr_screencopy_manager_v1 *screencopy_manager;
 
 InputFormat get_input_format(wf_buffer &buffer);
+wl_shm_format drm_to_wl_shm_format(uint32_t format);
+uint32_t wl_shm_to_drm_format(uint32_t format);
+void copy_frame(zwlr_screencopy_frame_v1 *frame, wf_buffer *buffer);
+// Gives up on a frame whose buffer was already released or discarded
+void abort_frame(zwlr_screencopy_frame_v1 *frame);
+
+#endif
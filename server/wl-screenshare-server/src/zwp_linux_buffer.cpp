@@ -1,4 +1,5 @@
 #include "src/zwp_linux_buffer.hpp"
+#include "src/dmabuf_pool.hpp"
 #include "src/zwlr_screencopy.hpp"
 
 #include <fcntl.h>
@@ -80,15 +81,19 @@ static void dmabuf_created(void *data, struct zwp_linux_buffer_params_v1 *,
 
   zwlr_screencopy_frame_v1 *frame = frame_data->frame;
 
-  free(frame_data);
-  if (use_damage) {
-    zwlr_screencopy_frame_v1_copy_with_damage(frame, buffer->wl_buffer);
-  } else {
-    zwlr_screencopy_frame_v1_copy(frame, buffer->wl_buffer);
-  }
+  delete frame_data;
+  copy_frame(frame, buffer);
 }
 
-static void dmabuf_failed(void *, struct zwp_linux_buffer_params_v1 *) {}
+// The params are spent either way, so the buffer can't be tried again: it
+// is destroyed and the pool allocates a new one for the next frame
+static void dmabuf_failed(void *data, struct zwp_linux_buffer_params_v1 *) {
+  frame_data_t *frame_data = (frame_data_t *)data;
+  std::cerr << "The compositor refused a dmabuf capture buffer" << std::endl;
+  buffer_pool.discard(frame_data->buffer);
+  abort_frame(frame_data->frame);
+  delete frame_data;
+}
 
 const struct zwp_linux_buffer_params_v1_listener params_listener = {
     .created = dmabuf_created,
@@ -0,0 +1,138 @@
+// The lock-free ring against the queues it could have been: the mutex
+// protected std::queue it replaced, polled by the consumer like the old
+// write_loop did, and the same queue with a condition variable.
+//
+// - uncontended: push then pop on one thread, the cost of the calls
+// - hand-off: one producer and one consumer thread, as fast as they go
+// - paced: a push every millisecond like a capture, the CPU time both
+//   threads burn, in percent of one core
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <time.h>
+
+#include "src/atomic_queue.hpp"
+
+#define HANDOFF_ITEMS 1000000
+#define PACED_ITEMS 500
+#define QUEUE_SIZE 256
+
+static int64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct ring_queue {
+  static constexpr const char *name = "lock-free ring";
+  atomic_queue<uintptr_t, QUEUE_SIZE> q;
+  void push(uintptr_t v) { q.push(v); }
+  uintptr_t pop() {
+    uintptr_t v = 0;
+    while (!q.pop(v, -1))
+      ;
+    return v;
+  }
+};
+
+// the queue before the ring, unbounded
+struct polled_queue {
+  static constexpr const char *name = "mutex, polled";
+  std::queue<uintptr_t> q;
+  std::mutex m;
+  void push(uintptr_t v) {
+    std::lock_guard<std::mutex> lock(m);
+    q.push(v);
+  }
+  bool empty() {
+    std::lock_guard<std::mutex> lock(m);
+    return q.empty();
+  }
+  uintptr_t pop() {
+    while (empty())
+      ;
+    std::lock_guard<std::mutex> lock(m);
+    uintptr_t v = q.front();
+    q.pop();
+    return v;
+  }
+};
+
+struct condvar_queue {
+  static constexpr const char *name = "mutex, condvar";
+  std::queue<uintptr_t> q;
+  std::mutex m;
+  std::condition_variable not_empty, not_full;
+  void push(uintptr_t v) {
+    std::unique_lock<std::mutex> lock(m);
+    not_full.wait(lock, [this]() { return q.size() < QUEUE_SIZE; });
+    q.push(v);
+    not_empty.notify_one();
+  }
+  uintptr_t pop() {
+    std::unique_lock<std::mutex> lock(m);
+    not_empty.wait(lock, [this]() { return !q.empty(); });
+    uintptr_t v = q.front();
+    q.pop();
+    not_full.notify_one();
+    return v;
+  }
+};
+
+template <typename Q> static void bench() {
+  {
+    Q queue;
+    int64_t start = clock_ns(CLOCK_MONOTONIC);
+    uintptr_t sum = 0;
+    for (uintptr_t i = 1; i <= HANDOFF_ITEMS; i++) {
+      queue.push(i);
+      sum += queue.pop();
+    }
+    double ns = double(clock_ns(CLOCK_MONOTONIC) - start) / HANDOFF_ITEMS;
+    printf("%-16s uncontended %8.1f ns/item\n", Q::name, ns + sum * 0);
+  }
+
+  {
+    Q queue;
+    int64_t start = clock_ns(CLOCK_MONOTONIC);
+    std::thread consumer([&]() {
+      for (int i = 0; i < HANDOFF_ITEMS; i++)
+        queue.pop();
+    });
+    for (uintptr_t i = 1; i <= HANDOFF_ITEMS; i++)
+      queue.push(i);
+    consumer.join();
+    double ns = double(clock_ns(CLOCK_MONOTONIC) - start) / HANDOFF_ITEMS;
+    printf("%-16s hand-off    %8.1f ns/item\n", Q::name, ns);
+  }
+
+  {
+    Q queue;
+    int64_t wall = clock_ns(CLOCK_MONOTONIC);
+    int64_t cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    std::thread consumer([&]() {
+      for (int i = 0; i < PACED_ITEMS; i++)
+        queue.pop();
+    });
+    for (uintptr_t i = 1; i <= PACED_ITEMS; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      queue.push(i);
+    }
+    consumer.join();
+    cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    wall = clock_ns(CLOCK_MONOTONIC) - wall;
+    printf("%-16s paced       %8.1f %% cpu\n", Q::name, 100.0 * cpu / wall);
+  }
+}
+
+int main() {
+  bench<ring_queue>();
+  bench<condvar_queue>();
+  bench<polled_queue>();
+  return 0;
+}
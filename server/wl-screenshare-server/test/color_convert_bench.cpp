@@ -0,0 +1,106 @@
+// Time per frame of every conversion kernel the CPU runs, single threaded,
+// and of swscale doing the same conversion the way the filter graph set it
+// up before (BT.601, full range in and out, bicubic chroma).
+
+#include <cstdint>
+#include <cstdio>
+#include <time.h>
+#include <vector>
+
+#include "src/color_convert.hpp"
+
+#ifdef HAVE_SWSCALE
+extern "C" {
+#include <libswscale/swscale.h>
+}
+#endif
+
+// each measurement runs for at least this long
+#define BENCH_USEC 500000
+
+static int64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+template <typename F> static double ms_per_frame(F convert) {
+  convert(); // warm the caches and the page tables up
+  int frames = 0;
+  int64_t start = now_us(), elapsed = 0;
+  while (elapsed < BENCH_USEC) {
+    convert();
+    frames++;
+    elapsed = now_us() - start;
+  }
+  return elapsed / 1000.0 / frames;
+}
+
+static void bench(int width, int height, convert_output output) {
+  int src_stride = 4 * width;
+  std::vector<uint8_t> src((size_t)src_stride * height);
+  uint32_t seed = 1;
+  for (auto &b : src) {
+    seed = seed * 1664525 + 1013904223;
+    b = seed >> 24;
+  }
+
+  int cw = (width + 1) / 2, ch = (height + 1) / 2;
+  std::vector<uint8_t> planes[3] = {
+      std::vector<uint8_t>((size_t)width * height),
+      std::vector<uint8_t>((size_t)(output == CONVERT_NV12 ? 2 * cw : cw) *
+                           ch),
+      std::vector<uint8_t>((size_t)cw * ch)};
+  uint8_t *dst[3] = {planes[0].data(), planes[1].data(), planes[2].data()};
+  int dst_stride[3] = {width, output == CONVERT_NV12 ? 2 * cw : cw, cw};
+  const char *name = output == CONVERT_I420 ? "I420" : "NV12";
+
+  std::vector<convert_simd> kernels = {CONVERT_SCALAR};
+  convert_simd best = convert_best_simd();
+  if (best == CONVERT_AVX2)
+    kernels.push_back(CONVERT_SSE41);
+  if (best != CONVERT_SCALAR)
+    kernels.push_back(best);
+  for (convert_simd simd : kernels) {
+    color_converter converter;
+    converter.init(CONVERT_BGRX, output, simd);
+    double ms = ms_per_frame([&]() {
+      converter.convert(src.data(), src_stride, width, height, dst,
+                        dst_stride);
+    });
+    printf("%dx%d BGRX->%s %-8s %7.3f ms\n", width, height, name,
+           convert_simd_name(simd), ms);
+  }
+
+#ifdef HAVE_SWSCALE
+  AVPixelFormat out_fmt =
+      output == CONVERT_I420 ? AV_PIX_FMT_YUV420P : AV_PIX_FMT_NV12;
+  SwsContext *sws =
+      sws_getContext(width, height, AV_PIX_FMT_BGR0, width, height, out_fmt,
+                     SWS_BICUBIC, NULL, NULL, NULL);
+  if (!sws) {
+    printf("%dx%d BGRX->%s swscale can't do it\n", width, height, name);
+    return;
+  }
+  const int *table = sws_getCoefficients(SWS_CS_ITU601);
+  sws_setColorspaceDetails(sws, table, 1, table, 1, 0, 1 << 16, 1 << 16);
+  const uint8_t *src_planes[1] = {src.data()};
+  double ms = ms_per_frame([&]() {
+    sws_scale(sws, src_planes, &src_stride, 0, height, dst, dst_stride);
+  });
+  printf("%dx%d BGRX->%s %-8s %7.3f ms\n", width, height, name, "swscale",
+         ms);
+  sws_freeContext(sws);
+#endif
+}
+
+int main() {
+  for (convert_output output : {CONVERT_I420, CONVERT_NV12}) {
+    bench(1920, 1080, output);
+    bench(3840, 2160, output);
+  }
+#ifndef HAVE_SWSCALE
+  printf("built without libswscale, nothing to compare against\n");
+#endif
+  return 0;
+}
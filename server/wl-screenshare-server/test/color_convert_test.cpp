@@ -0,0 +1,149 @@
+// Every SIMD kernel the CPU runs against the scalar one, bit for bit, over
+// odd sizes, padded and negative strides, and regions.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "src/color_convert.hpp"
+
+// written around the planes, a kernel going past its row shows up in it
+#define CANARY 0xa5
+#define PAD 32
+
+static int failures = 0;
+
+static uint32_t lcg(uint32_t &state) {
+  state = state * 1664525 + 1013904223;
+  return state >> 8;
+}
+
+// The planes of a frame with room and canaries around every row
+struct yuv_frame {
+  std::vector<uint8_t> planes[3];
+  int stride[3] = {};
+  uint8_t *data[3] = {};
+
+  yuv_frame(int width, int height, convert_output output) {
+    int cw = (width + 1) / 2, ch = (height + 1) / 2;
+    int widths[3] = {width, output == CONVERT_NV12 ? 2 * cw : cw, cw};
+    int heights[3] = {height, ch, ch};
+    for (int i = 0; i < (output == CONVERT_NV12 ? 2 : 3); i++) {
+      stride[i] = widths[i] + 2 * PAD + 3;
+      planes[i].assign((size_t)stride[i] * (heights[i] + 2), CANARY);
+      data[i] = planes[i].data() + stride[i] + PAD;
+    }
+  }
+
+  bool operator==(const yuv_frame &o) const {
+    for (int i = 0; i < 3; i++) {
+      if (planes[i] != o.planes[i])
+        return false;
+    }
+    return true;
+  }
+};
+
+static const char *input_name(convert_input input) {
+  return input == CONVERT_BGRX ? "BGRX" : "RGBX";
+}
+
+static const char *output_name(convert_output output) {
+  return output == CONVERT_I420 ? "I420" : "NV12";
+}
+
+static void check_frame(convert_input input, convert_output output,
+                        convert_simd simd, int width, int height,
+                        int src_pad, bool inverted, uint32_t &seed) {
+  int src_stride = 4 * width + src_pad;
+  std::vector<uint8_t> src((size_t)src_stride * height);
+  for (auto &b : src) {
+    // the extremes are where a saturating kernel would differ
+    uint32_t r = lcg(seed);
+    b = r % 8 == 0 ? 0 : r % 8 == 1 ? 255 : r;
+  }
+  const uint8_t *pixels = src.data();
+  if (inverted) {
+    pixels += (size_t)src_stride * (height - 1);
+    src_stride = -src_stride;
+  }
+
+  color_converter scalar, vector;
+  scalar.init(input, output, CONVERT_SCALAR);
+  vector.init(input, output, simd);
+  yuv_frame expected(width, height, output), got(width, height, output);
+  scalar.convert(pixels, src_stride, width, height, expected.data,
+                 expected.stride);
+  vector.convert(pixels, src_stride, width, height, got.data, got.stride);
+  if (!(got == expected)) {
+    fprintf(stderr, "%s %s->%s %dx%d pad %d%s differs from scalar\n",
+            convert_simd_name(simd), input_name(input), output_name(output),
+            width, height, src_pad, inverted ? " inverted" : "");
+    failures++;
+  }
+
+  // a region at even coordinates gives the bytes of the full conversion
+  if (width < 4 || height < 4)
+    return;
+  int x = 2 * (int)(lcg(seed) % (width / 4));
+  int y = 2 * (int)(lcg(seed) % (height / 4));
+  int w = 1 + lcg(seed) % (width - x), h = 1 + lcg(seed) % (height - y);
+  if (x + w < width)
+    w += w % 2;
+  if (y + h < height)
+    h += h % 2;
+  yuv_frame region = expected;
+  for (int i = 0; i < 3; i++)
+    region.data[i] = region.planes[i].data() + region.stride[i] + PAD;
+  vector.convert_region(pixels, src_stride, x, y, w, h, region.data,
+                        region.stride);
+  if (!(region == expected)) {
+    fprintf(stderr, "%s %s->%s %dx%d region %d,%d %dx%d differs\n",
+            convert_simd_name(simd), input_name(input), output_name(output),
+            width, height, x, y, w, h);
+    failures++;
+  }
+}
+
+int main() {
+  std::vector<convert_simd> kernels;
+  convert_simd best = convert_best_simd();
+  if (best == CONVERT_AVX2)
+    kernels = {CONVERT_SSE41, CONVERT_AVX2};
+  else if (best != CONVERT_SCALAR)
+    kernels = {best};
+  if (kernels.empty()) {
+    printf("no SIMD kernel on this CPU, nothing to compare\n");
+    return 77; // skipped
+  }
+
+  uint32_t seed = 42;
+  int frames = 0;
+  for (convert_simd simd : kernels) {
+    for (convert_input input : {CONVERT_BGRX, CONVERT_RGBX}) {
+      for (convert_output output : {CONVERT_I420, CONVERT_NV12}) {
+        // every width around the 8, 16 and 32 pixel steps and their tails
+        for (int width = 1; width <= 70; width++) {
+          for (int height : {1, 2, 3, 4, 7}) {
+            check_frame(input, output, simd, width, height, (width * 7) % 13,
+                        width % 3 == 0, seed);
+            frames++;
+          }
+        }
+        for (int width : {1919, 1920, 3839, 3840}) {
+          check_frame(input, output, simd, width, 5, 64, false, seed);
+          check_frame(input, output, simd, width, 4, 0, true, seed);
+          frames += 2;
+        }
+      }
+    }
+  }
+
+  if (failures > 0) {
+    fprintf(stderr, "%d of %d conversions differ\n", failures, frames);
+    return 1;
+  }
+  printf("%d conversions match the scalar kernel\n", frames);
+  return 0;
+}
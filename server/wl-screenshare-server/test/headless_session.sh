@@ -0,0 +1,84 @@
+# Sourced by the tests that need a compositor: a headless sway for the
+# server to capture, optionally showing a moving test pattern, and helpers
+# to start the server and check the receiver reports.
+# Exits 77, which meson counts as skipped, when sway is missing.
+
+server=$build/wl-screenshare-server
+receiver=$build/wl-screenshare-receiver
+
+tmp=$(mktemp -d)
+pids=""
+
+cleanup() {
+  for pid in $pids; do
+    kill "$pid" 2>/dev/null || true
+  done
+  wait 2>/dev/null || true
+  rm -rf "$tmp"
+}
+trap cleanup EXIT INT TERM
+
+skip() {
+  echo "skipped: $*"
+  exit 77
+}
+
+fail() {
+  echo "FAIL: $*"
+  if [ -f "$tmp/server.log" ]; then
+    echo "--- server log"
+    tail -n 50 "$tmp/server.log"
+  fi
+  exit 1
+}
+
+start_sway() {
+  command -v sway > /dev/null || skip "sway not found"
+  export XDG_RUNTIME_DIR="$tmp"
+  : > "$tmp/sway.conf"
+  WLR_BACKENDS=headless WLR_RENDERER=pixman WLR_LIBINPUT_NO_DEVICES=1 \
+    sway -c "$tmp/sway.conf" > "$tmp/sway.log" 2>&1 &
+  pids="$pids $!"
+  for i in $(seq 50); do
+    for socket in "$tmp"/wayland-*; do
+      if [ -S "$socket" ]; then
+        export WAYLAND_DISPLAY="${socket##*/}"
+        return 0
+      fi
+    done
+    sleep 0.1
+  done
+  cat "$tmp/sway.log"
+  fail "sway didn't start"
+}
+
+# A full screen test pattern, fails without ffplay
+start_pattern() {
+  command -v ffplay > /dev/null || return 1
+  SDL_VIDEODRIVER=wayland ffplay -loglevel quiet -fs -f lavfi \
+    -i testsrc2=size=1920x1080:rate=30 > /dev/null 2>&1 &
+  pids="$pids $!"
+  sleep 1
+}
+
+# start_server <extra options>...
+start_server() {
+  "$server" -c libx264 -p preset=ultrafast -D -y -o HEADLESS-1 "$@" \
+    > "$tmp/server.log" 2>&1 &
+  server_pid=$!
+  pids="$pids $server_pid"
+  sleep 2
+  kill -0 "$server_pid" 2>/dev/null || fail "the server exited"
+}
+
+# field <report> <name>: a number out of a receiver JSON report
+field() {
+  echo "$1" | sed -n "s/.*\"$2\": \([0-9.]*\).*/\1/p"
+}
+
+# check <report> <name> <comparison>, e.g. check "$report" lost "== 0"
+check() {
+  value=$(field "$1" "$2")
+  awk "BEGIN { exit !($value $3) }" 2>/dev/null ||
+    fail "$2 is ${value:-missing}, expected $3"
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+# The server and the receiver over loopback, with the network on its own
+# epoll thread:
+# - the server keeps capturing and encoding while nobody is connected
+# - a client joining mid-stream is sent a keyframe and decodes it cleanly,
+#   twice in a row
+# With ffplay around, a test pattern keeps frames coming and the frame rate
+# is checked too. Needs sway, skipped otherwise.
+#
+# usage: loopback_test.sh <build dir>
+
+set -eu
+build=${1:-build}
+. "$(dirname "$0")/headless_session.sh"
+
+start_sway
+moving=false
+if start_pattern; then
+  moving=true
+fi
+start_server -M 1
+
+sleep 2
+kill -0 "$server_pid" 2>/dev/null || fail "the server exited with no client"
+
+for client in 1 2; do
+  "$receiver" -t 4 -i 4 > "$tmp/receiver.json" ||
+    fail "receiver $client exited with an error"
+  report=$(grep '"final": true' "$tmp/receiver.json") ||
+    fail "no final report from receiver $client"
+  echo "receiver $client: $report"
+  check "$report" keyframes ">= 1"
+  check "$report" decode_errors "== 0"
+  check "$report" lost "== 0"
+  if $moving; then
+    check "$report" fps ">= 10"
+  fi
+done
+
+kill -0 "$server_pid" 2>/dev/null || fail "the server exited"
+echo "ok"
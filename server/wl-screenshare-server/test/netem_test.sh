@@ -0,0 +1,68 @@
+#!/bin/sh
+# The adaptive bitrate (--abr) against a link shaped with tc netem on
+# loopback. A test pattern is streamed to one receiver for 45 s:
+# -  0-15 s no shaping, the stream has to need more than the shaped rate
+# - 15-30 s 40 ms RTT at RATE_KBPS: the bitrate comes down under the rate
+#   and the RTT stays close to the 40 ms instead of filling the queue
+# - 30-45 s no shaping again: the bitrate probes back up
+# Changes the qdisc of lo, so it needs root and isn't run by meson test.
+# Skipped (77) without root, tc netem, sway or ffplay.
+#
+# usage: sudo netem_test.sh <build dir>
+
+set -eu
+build=${1:-build}
+. "$(dirname "$0")/headless_session.sh"
+
+RATE_KBPS=2000
+
+[ "$(id -u)" = 0 ] || skip "needs root for tc"
+command -v tc > /dev/null || skip "tc not found"
+tc qdisc show dev lo | grep -q netem && fail "lo already has a netem qdisc"
+
+shape() {
+  tc qdisc add dev lo root netem delay 20ms rate ${RATE_KBPS}kbit ||
+    skip "netem not available"
+}
+unshape() {
+  tc qdisc del dev lo root 2>/dev/null || true
+}
+trap 'unshape; cleanup' EXIT INT TERM
+
+# average of a field over the reports in [from, to) seconds
+average() {
+  grep '"final": false' "$tmp/receiver.json" | while read -r report; do
+    echo "$(field "$report" time) $(field "$report" "$1")"
+  done | awk -v from="$2" -v to="$3" \
+    '$1 >= from && $1 < to { sum += $2; n++ } END { print n ? sum / n : 0 }'
+}
+
+start_sway
+start_pattern || skip "ffplay not found"
+start_server -A 300:20000
+
+"$receiver" -t 45 -i 1 > "$tmp/receiver.json" &
+receiver_pid=$!
+sleep 15
+shape
+sleep 15
+unshape
+wait "$receiver_pid" || fail "the receiver exited with an error"
+
+free=$(average bitrate_kbps 8 15)
+shaped=$(average bitrate_kbps 25 30)
+shaped_rtt=$(average rtt_ms 25 30)
+probed=$(average bitrate_kbps 40 45)
+echo "free $free kbit/s, shaped $shaped kbit/s (rtt $shaped_rtt ms)," \
+  "probed $probed kbit/s"
+grep "Adaptive bitrate" "$tmp/server.log" | tail -n 5
+
+awk "BEGIN { exit !($free > 1.5 * $RATE_KBPS) }" ||
+  fail "the test pattern only needs $free kbit/s, nothing to adapt"
+awk "BEGIN { exit !($shaped < 1.1 * $RATE_KBPS) }" ||
+  fail "$shaped kbit/s over a $RATE_KBPS kbit/s link"
+awk "BEGIN { exit !($shaped_rtt < 150) }" ||
+  fail "the RTT grew to $shaped_rtt ms, the queue filled up"
+awk "BEGIN { exit !($probed > 1.3 * $shaped) }" ||
+  fail "the bitrate stayed at $probed kbit/s once the link was free"
+echo "ok"
@@ -0,0 +1,90 @@
+// Time per frame of the tile hash find_damage() runs on every captured
+// frame, on every row and on every second one, single threaded. Next to it
+// a plain read of the whole frame and of every second row, which is what
+// memory allows at best.
+
+#include <cstdint>
+#include <cstdio>
+#include <time.h>
+#include <vector>
+
+#include "src/tile_hash.hpp"
+
+// each measurement runs for at least this long
+#define BENCH_USEC 500000
+
+static int64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+template <typename F> static double ms_per_frame(F run) {
+  run(); // warm the caches and the page tables up
+  int frames = 0;
+  int64_t start = now_us(), elapsed = 0;
+  while (elapsed < BENCH_USEC) {
+    run();
+    frames++;
+    elapsed = now_us() - start;
+  }
+  return elapsed / 1000.0 / frames;
+}
+
+// sums one row out of step, keeps the compiler from dropping the reads
+static uint64_t read_rows(const uint8_t *pixels, int stride, int height,
+                          int step) {
+  uint64_t sum = 0;
+  for (int y = 0; y < height; y += step) {
+    const uint64_t *row = (const uint64_t *)(pixels + (size_t)y * stride);
+    for (int x = 0; x < stride / 8; x++)
+      sum += row[x];
+  }
+  return sum;
+}
+
+static void bench(int width, int height) {
+  int stride = 4 * width;
+  std::vector<uint8_t> frame((size_t)stride * height);
+  uint32_t seed = 1;
+  for (auto &b : frame) {
+    seed = seed * 1664525 + 1013904223;
+    b = seed >> 24;
+  }
+
+  volatile uint64_t sink = 0;
+  double ms = ms_per_frame(
+      [&]() { sink = sink + read_rows(frame.data(), stride, height, 1); });
+  printf("%dx%d read 1/1 rows          %7.3f ms\n", width, height, ms);
+  ms = ms_per_frame([&]() {
+    sink = sink + read_rows(frame.data(), stride, height, TILE_ROW_STEP);
+  });
+  printf("%dx%d read 1/%d rows          %7.3f ms\n", width, height,
+         TILE_ROW_STEP, ms);
+
+  std::vector<convert_simd> kernels = {CONVERT_SCALAR};
+  convert_simd best = convert_best_simd();
+  if (best == CONVERT_AVX2)
+    kernels.push_back(CONVERT_SSE41);
+  if (best != CONVERT_SCALAR)
+    kernels.push_back(best);
+  // every row is what damage-driven capture hashes
+  for (convert_simd simd : kernels) {
+    for (int step : {1, TILE_ROW_STEP}) {
+      tile_hasher tiles;
+      tiles.init(width, height, 4, simd, step);
+      ms = ms_per_frame([&]() {
+        tiles.hash(frame.data(), stride, 0, tiles.tiles_y());
+        tiles.compare();
+      });
+      printf("%dx%d hash %-8s 1/%d rows %7.3f ms\n", width, height,
+             convert_simd_name(simd), step, ms);
+    }
+  }
+}
+
+int main() {
+  bench(1920, 1080);
+  bench(3840, 2160);
+  return 0;
+}
@@ -0,0 +1,435 @@
+// RTP/UDP transport over loopback with simulated loss: registration, NACK
+// retransmission, FEC repair and the limits on what forged or greedy
+// receivers can get out of the server.
+
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "src/udp_transport.hpp"
+
+#define PORT 53590
+#define NACK_BUDGET (256 << 10) // NACK_MAX_BYTES in udp_transport.cpp
+
+static int failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond);        \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static int64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t lcg(uint32_t &state) {
+  state = state * 1664525 + 1013904223;
+  return state >> 8;
+}
+
+// An Annex B access unit: parameter sets in front of keyframes, then one
+// slice NAL of the given size with bytes that never form a start code
+static std::vector<uint8_t> make_frame(bool keyframe, size_t size,
+                                       uint32_t seed) {
+  std::vector<uint8_t> au;
+  auto nal = [&](uint8_t header, size_t n) {
+    static const uint8_t start[4] = {0, 0, 0, 1};
+    au.insert(au.end(), start, start + 4);
+    au.push_back(header);
+    for (size_t i = 0; i < n; i++)
+      au.push_back(1 + lcg(seed) % 255);
+  };
+  if (keyframe) {
+    nal(0x67, 20); // SPS
+    nal(0x68, 4);  // PPS
+  }
+  nal(keyframe ? 0x65 : 0x41, size);
+  return au;
+}
+
+static bool is_media(const uint8_t *buf, size_t size) {
+  return size > 12 && (buf[1] & 0x7f) == RTP_PT_VIDEO;
+}
+
+static uint16_t rtp_seq(const uint8_t *buf) { return (buf[2] << 8) | buf[3]; }
+
+// Drives both ends until the receiver has a frame or the timeout expires
+static bool pump(udp_transport &server, udp_receiver &rx, udp_frame &frame,
+                 int timeout_ms = 2000) {
+  int64_t end = now_us() + timeout_ms * 1000;
+  while (now_us() < end) {
+    server.handle_input();
+    rx.poll(2);
+    server.handle_input();
+    if (rx.next_frame(frame))
+      return true;
+  }
+  return false;
+}
+
+static bool join(udp_transport &server, udp_receiver &rx) {
+  int64_t end = now_us() + 2000000;
+  while (now_us() < end && (!rx.joined() || server.peers() == 0)) {
+    rx.poll(2);
+    server.handle_input();
+  }
+  return rx.joined() && server.peers() > 0;
+}
+
+// The stream starts with a clean keyframe, the receivers only get media
+// from the first keyframe after they joined
+static bool start(udp_transport &server, udp_receiver &rx, int64_t &pts) {
+  if (!join(server, rx))
+    return false;
+  std::vector<uint8_t> key = make_frame(true, 3000, 1);
+  server.send_frame(key.data(), key.size(), pts, true);
+  pts += 16667;
+  udp_frame frame;
+  return pump(server, rx, frame) && frame.keyframe && frame.data == key;
+}
+
+static void send_and_check(udp_transport &server, udp_receiver &rx,
+                           const std::vector<uint8_t> &au, int64_t pts,
+                           bool keyframe) {
+  server.send_frame(au.data(), au.size(), pts, keyframe);
+  udp_frame frame;
+  CHECK(pump(server, rx, frame));
+  CHECK(frame.data == au);
+  CHECK(frame.keyframe == keyframe);
+  CHECK(frame.dropped == 0);
+  CHECK(frame.pts / 1000 == pts / 1000);
+}
+
+// Random loss, repaired with NACKs alone. Frames go out at their own pace
+// rather than one at a time: a lost tail packet only shows up as a gap
+// once the next frame comes in.
+static void test_nack() {
+  udp_transport server;
+  udp_params params;
+  params.port = PORT;
+  server.init(params);
+  udp_receiver rx;
+  CHECK(rx.connect("127.0.0.1", PORT, false));
+  int64_t pts = 0;
+  CHECK(start(server, rx, pts));
+
+  uint32_t state = 1234;
+  bool lossy = true;
+  rx.drop = [&](const uint8_t *buf, size_t size) {
+    return lossy && is_media(buf, size) && lcg(state) % 100 < 10;
+  };
+  std::vector<std::vector<uint8_t>> sent;
+  std::vector<udp_frame> received;
+  udp_frame frame;
+  uint32_t seed = 7;
+  for (int i = 0; i < 60; i++, pts += 16667) {
+    bool keyframe = i % 30 == 0;
+    sent.push_back(make_frame(
+        keyframe, keyframe ? 200000 : 1000 + lcg(seed) % 40000, seed));
+    server.send_frame(sent.back().data(), sent.back().size(), pts, keyframe);
+    int64_t end = now_us() + 5000;
+    while (now_us() < end) {
+      server.handle_input();
+      rx.poll(1);
+      while (rx.next_frame(frame))
+        received.push_back(std::move(frame));
+    }
+  }
+  // a clean last frame gives away any tail loss of the one before
+  lossy = false;
+  sent.push_back(make_frame(false, 1000, 8));
+  server.send_frame(sent.back().data(), sent.back().size(), pts, false);
+  while (received.size() < sent.size() && pump(server, rx, frame))
+    received.push_back(std::move(frame));
+
+  CHECK(received.size() == sent.size());
+  for (size_t i = 0; i < received.size() && i < sent.size(); i++) {
+    CHECK(received[i].data == sent[i]);
+    CHECK(received[i].dropped == 0);
+  }
+  CHECK(rx.stats.nacked > 0);
+  CHECK(rx.stats.lost == 0);
+}
+
+// Receiver reports carry the loss before the NACKs repair it, the
+// server turns them into the feedback the adaptive bitrate runs on
+static void test_feedback() {
+  udp_transport server;
+  udp_params params;
+  params.port = PORT;
+  server.init(params);
+  udp_receiver rx;
+  CHECK(rx.connect("127.0.0.1", PORT, false));
+  int64_t pts = 0;
+  CHECK(start(server, rx, pts));
+  server.update(now_us());
+
+  uint32_t state = 99;
+  rx.drop = [&](const uint8_t *buf, size_t size) {
+    return is_media(buf, size) && lcg(state) % 100 < 10;
+  };
+  udp_frame frame;
+  uint32_t seed = 3;
+  // long enough for a receiver report about the lossy part
+  int64_t end = now_us() + 1300000;
+  while (now_us() < end) {
+    std::vector<uint8_t> au = make_frame(false, 20000, seed++);
+    server.send_frame(au.data(), au.size(), pts, false);
+    pts += 16667;
+    int64_t next = now_us() + 5000;
+    while (now_us() < next) {
+      server.handle_input();
+      rx.poll(1);
+      while (rx.next_frame(frame))
+        ;
+    }
+  }
+  server.update(now_us());
+
+  uint64_t throughput = 0;
+  int fraction_lost = 0;
+  CHECK(server.feedback(throughput, fraction_lost) == 1);
+  // 10% is 25.6 out of 256
+  CHECK(fraction_lost > 12 && fraction_lost < 52);
+  // about 4 MB/s went out
+  CHECK(throughput > 1000000 && throughput < 8000000);
+  CHECK(rx.stats.lost == 0);
+}
+
+// A 4K sized keyframe is several thousand packets, its first ones must
+// still be in the history when their NACKs come in
+static void test_large_keyframe() {
+  udp_transport server;
+  udp_params params;
+  params.port = PORT;
+  server.init(params);
+  udp_receiver rx;
+  CHECK(rx.connect("127.0.0.1", PORT, false));
+  int64_t pts = 0;
+  CHECK(start(server, rx, pts));
+
+  // the first fragments of the next frame, on their first try only
+  int first = -1;
+  std::vector<int> seen(65536, 0);
+  rx.drop = [&](const uint8_t *buf, size_t size) {
+    if (!is_media(buf, size))
+      return false;
+    uint16_t seq = rtp_seq(buf);
+    if (first < 0)
+      first = seq;
+    return (uint16_t)(seq - first) < 16 && seen[seq]++ == 0;
+  };
+  std::vector<uint8_t> au = make_frame(true, 3 << 20, 99);
+  send_and_check(server, rx, au, pts, true);
+  CHECK(rx.stats.nacked >= 16);
+}
+
+// One loss in every group of a keyframe, repaired from the FEC without a
+// single NACK
+static void test_fec() {
+  udp_transport server;
+  udp_params params;
+  params.port = PORT;
+  params.fec_group = 8;
+  server.init(params);
+  udp_receiver rx;
+  rx.nack = false;
+  CHECK(rx.connect("127.0.0.1", PORT, false));
+  int64_t pts = 0;
+  CHECK(start(server, rx, pts));
+
+  rx.drop = [](const uint8_t *buf, size_t size) {
+    return is_media(buf, size) && rtp_seq(buf) % 8 == 3;
+  };
+  std::vector<uint8_t> au = make_frame(true, 100000, 5);
+  send_and_check(server, rx, au, pts, true);
+  CHECK(rx.stats.recovered > 0);
+  CHECK(rx.stats.nacked == 0);
+}
+
+// Unrepairable loss: the frame is given up on and the receiver waits for
+// the keyframe it asks for
+static void test_give_up() {
+  udp_transport server;
+  udp_params params;
+  params.port = PORT;
+  server.init(params);
+  udp_receiver rx;
+  rx.nack = false;
+  CHECK(rx.connect("127.0.0.1", PORT, false));
+  int64_t pts = 0;
+  CHECK(start(server, rx, pts));
+
+  bool lose = true;
+  rx.drop = [&lose](const uint8_t *buf, size_t size) {
+    if (!is_media(buf, size) || !lose)
+      return false;
+    lose = false;
+    return true;
+  };
+  std::vector<uint8_t> lost = make_frame(false, 5000, 3);
+  server.send_frame(lost.data(), lost.size(), pts, false);
+  pts += 16667;
+  std::vector<uint8_t> next = make_frame(false, 5000, 4);
+  server.send_frame(next.data(), next.size(), pts, false);
+  pts += 16667;
+
+  bool keyframe = false;
+  int64_t end = now_us() + 2000000;
+  while (!keyframe && now_us() < end) {
+    keyframe = server.handle_input();
+    rx.poll(5);
+  }
+  CHECK(keyframe);
+  CHECK(rx.stats.lost == 1);
+
+  udp_frame frame;
+  CHECK(!rx.next_frame(frame)); // the second one references the lost one
+  std::vector<uint8_t> key = make_frame(true, 5000, 6);
+  server.send_frame(key.data(), key.size(), pts, true);
+  CHECK(pump(server, rx, frame));
+  CHECK(frame.data == key);
+  CHECK(frame.dropped == 2);
+}
+
+static int raw_socket() {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(PORT);
+  connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+  return fd;
+}
+
+// Drains a raw socket for a while, returns the bytes received
+static size_t drain(udp_transport &server, int fd, int ms) {
+  size_t bytes = 0;
+  int64_t end = now_us() + ms * 1000;
+  uint8_t buf[2048];
+  while (now_us() < end) {
+    server.handle_input();
+    struct pollfd pfd = {fd, POLLIN, 0};
+    poll(&pfd, 1, 2);
+    ssize_t m;
+    while ((m = recv(fd, buf, sizeof(buf), 0)) > 0)
+      bytes += m;
+  }
+  return bytes;
+}
+
+// Packets that didn't go through the cookie exchange are ignored, a
+// joined one can't get more than the NACK budget resent at once
+static void test_forged_peers() {
+  udp_transport server;
+  udp_params params;
+  params.port = PORT;
+  server.init(params);
+  udp_receiver rx;
+  CHECK(rx.connect("127.0.0.1", PORT, false));
+  int64_t pts = 0;
+  CHECK(start(server, rx, pts));
+
+  // receiver report, PLI and NACK without having joined
+  int forged = raw_socket();
+  uint8_t rr[8] = {0x80, 201, 0, 1, 1, 2, 3, 4};
+  uint8_t pli[12] = {0x81, 206, 0, 2, 1, 2, 3, 4, 0, 0, 0, 0};
+  uint8_t nack[16] = {0x81, 205, 0, 3, 1, 2, 3, 4,
+                      0,    0,   0, 0, 0, 0, 0xff, 0xff};
+  send(forged, rr, sizeof(rr), 0);
+  send(forged, pli, sizeof(pli), 0);
+  send(forged, nack, sizeof(nack), 0);
+  bool keyframe = false;
+  for (int i = 0; i < 20; i++) {
+    usleep(1000);
+    keyframe |= server.handle_input();
+  }
+  CHECK(!keyframe);
+  CHECK(server.peers() == 1);
+  // a join with a made up cookie
+  uint8_t join[RTCP_APP_SIZE] = {0x80 | UDP_JOIN, RTCP_APP, 0, 4};
+  memcpy(join + 8, RTCP_APP_NAME, 4);
+  send(forged, join, sizeof(join), 0);
+  CHECK(drain(server, forged, 20) == 0);
+  CHECK(server.peers() == 1);
+
+  // the real receiver still gets the stream
+  std::vector<uint8_t> au = make_frame(false, 2000, 8);
+  send_and_check(server, rx, au, pts, false);
+  pts += 16667;
+  close(forged);
+
+  // a raw peer going through the handshake, then asking for everything
+  udp_params multi = params;
+  multi.max_peers = 2;
+  udp_transport greedy_server;
+  server.close();
+  greedy_server.init(multi);
+  int fd = raw_socket();
+  uint8_t hello[RTCP_APP_SIZE] = {0x80 | UDP_HELLO, RTCP_APP, 0, 4};
+  memcpy(hello + 8, RTCP_APP_NAME, 4);
+  send(fd, hello, sizeof(hello), 0);
+  uint8_t buf[2048];
+  ssize_t m = -1;
+  int64_t end = now_us() + 1000000;
+  while (m != RTCP_APP_SIZE && now_us() < end) {
+    greedy_server.handle_input();
+    m = recv(fd, buf, sizeof(buf), 0);
+  }
+  CHECK(m == RTCP_APP_SIZE);
+  memcpy(join + 12, buf + 12, 8);
+  send(fd, join, sizeof(join), 0);
+  drain(greedy_server, fd, 20);
+  CHECK(greedy_server.peers() == 1);
+
+  std::vector<uint8_t> key = make_frame(true, 2 << 20, 9);
+  greedy_server.send_frame(key.data(), key.size(), pts, true);
+  CHECK(drain(greedy_server, fd, 50) > 0);
+
+  // NACK every packet of it, sequence numbers start at 0
+  std::vector<uint8_t> all(12);
+  all[0] = 0x81;
+  all[1] = 205;
+  size_t packets = key.size() / 1200;
+  for (size_t pid = 0; pid < packets && all.size() < 1400; pid += 17) {
+    all.push_back(pid >> 8);
+    all.push_back(pid);
+    all.push_back(0xff);
+    all.push_back(0xff);
+  }
+  all[3] = all.size() / 4 - 1;
+  send(fd, all.data(), all.size(), 0);
+  drain(greedy_server, fd, 50);
+  uint64_t resent = greedy_server.retransmitted_bytes();
+  CHECK(resent >= NACK_BUDGET);
+  CHECK(resent <= NACK_BUDGET + 1500);
+  close(fd);
+}
+
+int main() {
+  test_nack();
+  test_feedback();
+  test_large_keyframe();
+  test_fec();
+  test_give_up();
+  test_forged_peers();
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("udp loss test passed\n");
+  return 0;
+}